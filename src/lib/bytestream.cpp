@@ -37,16 +37,16 @@
 
 #include "narf/bytestream.h"
 
-narf::ByteStream::ByteStream() : pos(0) { }
+narf::ByteStream::ByteStream() : pos(0), overran_(false) { }
 
-narf::ByteStream::ByteStream(size_t size) : pos(0) {
+narf::ByteStream::ByteStream(size_t size) : pos(0), overran_(false) {
 	data_.resize(size);
 }
 
 narf::ByteStream::ByteStream(std::string data) : ByteStream(data.c_str(), data.size()) {
 }
 
-narf::ByteStream::ByteStream(const void* data, size_t size) : pos(0) {
+narf::ByteStream::ByteStream(const void* data, size_t size) : pos(0), overran_(false) {
 	if (data != nullptr) {
 		auto v = static_cast<const uint8_t*>(data);
 		data_ = std::vector<uint8_t>(v, v + size);
@@ -0,0 +1,82 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <random>
+
+#include "narf/world.h"
+
+// scatter antigrav entities randomly in a box and return their IDs
+static std::vector<narf::Entity::ID> scatterEntities(narf::EntityManager& em, size_t count, float size, std::mt19937& rng) {
+	std::uniform_real_distribution<float> coord(0.0f, size);
+	std::vector<narf::Entity::ID> ids;
+	for (size_t i = 0; i < count; i++) {
+		auto id = em.newEntity();
+		narf::EntityRef ent(em, id);
+		ent->set(narf::Entity::Antigrav);
+		ent->position = narf::FixedPoint3(narf::Point3f(coord(rng), coord(rng), coord(rng)));
+		em.positionChanged(id);
+		ids.push_back(id);
+	}
+	return ids;
+}
+
+TEST(EntityManager, SpatialHash) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	auto& em = world.entityManager;
+	std::mt19937 rng(5678);
+	auto ids = scatterEntities(em, 10000, 100.0f, rng);
+
+	std::uniform_real_distribution<float> v(-2.0f, 2.0f);
+	for (auto id : ids) {
+		narf::EntityRef(em, id)->velocity = narf::Vector3f(v(rng), v(rng), v(rng));
+	}
+
+	typedef std::chrono::steady_clock clock;
+	const int ticks = 20;
+	size_t numPairs = 0;
+	double updateTime = 0.0, overlapTime = 0.0;
+	for (int i = 0; i < ticks; i++) {
+		auto start = clock::now();
+		world.update(1.0 / 60.0);
+		auto mid = clock::now();
+		std::vector<std::pair<narf::Entity::ID, narf::Entity::ID>> pairs;
+		em.findOverlaps(pairs);
+		numPairs += pairs.size();
+		updateTime += std::chrono::duration<double, std::milli>(mid - start).count() / ticks;
+		overlapTime += std::chrono::duration<double, std::milli>(clock::now() - mid).count() / ticks;
+	}
+
+	// brute force all-pairs for comparison
+	auto start = clock::now();
+	size_t bruteForcePairs = 0;
+	std::vector<narf::AABB> boxes;
+	for (auto& ent : em.getEntities()) {
+		boxes.push_back(ent.getAABB());
+	}
+	for (size_t i = 0; i < boxes.size(); i++) {
+		for (size_t j = i + 1; j < boxes.size(); j++) {
+			bruteForcePairs += boxes[i].intersect(boxes[j]);
+		}
+	}
+	auto bruteForceTime = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+	std::vector<std::pair<narf::Entity::ID, narf::Entity::ID>> pairs;
+	em.findOverlaps(pairs);
+	EXPECT_EQ(bruteForcePairs, pairs.size());
+
+	printf("10k moving entities: update %.2f ms, overlap pass %.2f ms (%zu overlaps), brute force overlap pass %.2f ms\n",
+		updateTime, overlapTime, numPairs / ticks, bruteForceTime);
+
+	// nearest neighbor queries, both where entities are dense and out beyond them where the search has to widen
+	std::uniform_real_distribution<float> coord(-100.0f, 200.0f);
+	const int queries = 1000;
+	std::vector<narf::Entity::ID> found;
+	start = clock::now();
+	for (int i = 0; i < queries; i++) {
+		found.clear();
+		em.findNearest(narf::Point3f(coord(rng), coord(rng), coord(rng)), 10, 1000.0f, found);
+		EXPECT_EQ(10u, found.size());
+	}
+	auto nearestTime = std::chrono::duration<double, std::micro>(clock::now() - start).count() / queries;
+	printf("10k entities: 10 nearest in %.1f us\n", nearestTime);
+}
@@ -0,0 +1,15 @@
+#include <stdio.h>
+
+#include <gtest/gtest.h>
+
+#include "narf/version.h"
+
+// timings of the engine's hot paths; not run by the unit tests, since they only print numbers
+// build with "make narfblock-bench", and pick benchmarks with --gtest_filter
+int main(int argc, char **argv)
+{
+	printf("NarfBlock benchmarks\n");
+	printf("Version: %d.%d%s\n", VERSION_MAJOR, VERSION_MINOR, VERSION_RELEASE);
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
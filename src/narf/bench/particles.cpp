@@ -0,0 +1,28 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <random>
+
+#include "narf/world.h"
+
+TEST(ParticleSystem, Bouncing) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	world.setGravity(-24.0f);
+	auto& particles = world.particles;
+	particles.setCapacity(100000);
+
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> coord(0.0f, 64.0f), speed(-4.0f, 4.0f);
+	while (particles.spawn({coord(rng), coord(rng), coord(rng)}, {speed(rng), speed(rng), speed(rng)},
+		1000.0f, narf::ParticleSystem::Collision::Bounce)) {
+	}
+
+	world.update(1.0 / 60.0); // load chunks
+	const int ticks = 60;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < ticks; i++) {
+		world.particles.update(1.0 / 60.0);
+	}
+	auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / ticks;
+	printf("100k particles: %.2f ms per tick (%u left)\n", ms, particles.size());
+}
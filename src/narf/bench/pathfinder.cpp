@@ -0,0 +1,70 @@
+#include <time.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "narf/world.h"
+
+TEST(Pathfinder, ZigzagPaths) {
+	narf::World world(512, 512, 64, 16, 16, 16);
+	narf::Block b;
+	b.id = 2;
+
+	// walls every 64 blocks with the gap at alternating ends, so the path zigzags across the world
+	for (int32_t x = 64; x < 512; x += 64) {
+		auto gap = (x / 64) % 2 ? 500 : 10;
+		for (int32_t y = 0; y < 512; y++) {
+			if (y != gap) {
+				world.putBlock(&b, {x, y, 48});
+				world.putBlock(&b, {x, y, 49});
+			}
+		}
+	}
+
+	for (int32_t z = 0; z < world.chunksZ(); z++) {
+		for (int32_t y = 0; y < world.chunksY(); y++) {
+			for (int32_t x = 0; x < world.chunksX(); x++) {
+				world.getChunk({x, y, z}); // generate the world before timing
+			}
+		}
+	}
+
+	auto& pathfinder = world.pathfinder;
+	std::vector<narf::BlockCoord> path;
+	auto bench = [&](const char* name, const narf::BlockCoord& from, const narf::BlockCoord& to) {
+		auto time = [&]() {
+			auto start = std::chrono::steady_clock::now();
+			EXPECT_TRUE(pathfinder.findPath(from, to, path));
+			return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		};
+		auto builds = pathfinder.regionBuilds();
+		auto cold = time(); // builds regions for every chunk it touches
+		auto warm = time();
+		printf("%s: %zu-block path, %.2f ms cold (%llu chunks built), %.2f ms warm\n",
+			name, path.size(), cold, (unsigned long long)(pathfinder.regionBuilds() - builds), warm);
+		EXPECT_EQ(to, path.back());
+	};
+	bench("straight", {2, 2, 48}, {60, 508, 48});
+	bench("zigzag", {2, 2, 48}, {508, 508, 48}); // has to search most of the world
+
+	// the same search queued, as the server runs it a slice at a time each tick; no update may overrun its budget
+	// by much, measured in CPU time, so being preempted (which only makes an update stop sooner) does not count
+	const narf::timediff budget(0.002);
+	bool finished = false;
+	pathfinder.request({2, 2, 48}, {508, 508, 48}, [&](narf::Pathfinder::RequestID, bool found, const std::vector<narf::BlockCoord>&) {
+		EXPECT_TRUE(found);
+		finished = true;
+	});
+	int updates = 0;
+	double longest = 0.0;
+	while (!finished) {
+		auto start = clock();
+		pathfinder.update(budget);
+		longest = std::max(longest, (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC);
+		updates++;
+	}
+	printf("zigzag queued: %d updates of %.0f ms, longest %.2f ms CPU\n", updates, budget.milliseconds(), longest);
+	EXPECT_LT(longest, budget.milliseconds() * 2.0);
+}
@@ -0,0 +1,42 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+#include "narf/world.h"
+
+TEST(World, SweepAABB) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	narf::Block b;
+	b.id = 2;
+	for (int32_t y = 48; y < 64; y++) {
+		for (int32_t x = 48; x < 64; x++) {
+			world.putBlock(&b, {x, y, 56});
+		}
+	}
+
+	// half-height block, which is not a full cube
+	narf::BlockType slabType(5, 5, 5, 5, 5, 5);
+	slabType.aabbCenterOffset = narf::Vector3f(0.0f, 0.0f, -0.25f);
+	slabType.aabbHalfSize = narf::Vector3f(0.5f, 0.5f, 0.25f);
+	narf::Block slab;
+	slab.id = world.addBlockType(slabType);
+	world.putBlock(&slab, {52, 52, 57});
+
+	// entities resting on the ground and falling onto it, as each entity's collision check does every tick
+	// (the chunks only need preparing once, since nothing changes between the sweeps)
+	narf::Vector3f half(0.375f, 0.375f, 0.375f);
+	narf::SweepResult r;
+	world.updateCollision(narf::AABB({56.0f, 56.0f, 60.0f}, {8.0f, 8.0f, 4.0f}), {0.0f, 0.0f, 0.0f}, 0.0f);
+	const int sweeps = 200000;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < sweeps; i++) {
+		auto x = 48.5f + (float)(i % 15), y = 48.5f + (float)(i / 15 % 15);
+		if (i % 2) {
+			world.sweepAABB(narf::AABB({x, y, 57.375f}, half), {0.05f, 0.05f, -0.05f}, 0.5f, r);
+		} else {
+			world.sweepAABB(narf::AABB({x, y, 63.0f}, half), {0.5f, 0.5f, -6.0f}, 0.5f, r);
+		}
+	}
+	auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / sweeps;
+	printf("box sweeps: %.0f ns each\n", ns);
+}
@@ -36,3 +36,8 @@ narf::AABB narf::BlockType::getAABB(const narf::BlockCoord& bc) const {
 	Vector3f blockCenter((float)bc.x + 0.5f, (float)bc.y + 0.5f, (float)bc.z + 0.5f);
 	return AABB(blockCenter + aabbCenterOffset, aabbHalfSize);
 }
+
+
+bool narf::BlockType::fullCube() const {
+	return aabbCenterOffset == Vector3f(0.0f, 0.0f, 0.0f) && aabbHalfSize == Vector3f(0.5f, 0.5f, 0.5f);
+}
@@ -88,6 +88,9 @@ public:
 
 	// calculate AABB for a block of this type at location bc
 	AABB getAABB(const BlockCoord& bc) const;
+
+	// true if the AABB fills the whole block
+	bool fullCube() const;
 };
 
 } // namespace narf
@@ -35,10 +35,38 @@
 #include "narf/console.h"
 #include "narf/math/coorditer.h"
 
+#include <string.h>
+#include <algorithm>
+
+
+narf::Chunk::Chunk(World* world, SlabPool& dataPool, const Vector3<int32_t>& size, const ChunkCoord& pos, uint64_t journalSeq) :
+	world_(world), dataPool_(dataPool), opaqueCount_(0), visibility_(0), visibilityDirty_(true), collisionDirty_(true),
+	checksum_(0), checksumDirty_(true), journal_(journalSeq), size_(size),
+	defaultGeometry_(size == Vector3<int32_t>(DefaultChunkGeometry::SizeX, DefaultChunkGeometry::SizeY, DefaultChunkGeometry::SizeZ)),
+	pos_(pos) {
+	assert((size_.x & (size_.x - 1)) == 0);
+	assert((size_.y & (size_.y - 1)) == 0);
+	assert((size_.z & (size_.z - 1)) == 0);
+	shiftX_ = ilog2(size_.x);
+	shiftXY_ = ilog2(size_.x * size_.y);
+
+	assert((size_.x & (BrickSize - 1)) == 0);
+	assert((size_.y & (BrickSize - 1)) == 0);
+	assert((size_.z & (BrickSize - 1)) == 0);
+	bricks_.x = size_.x >> BrickShift;
+	bricks_.y = size_.y >> BrickShift;
+	bricks_.z = size_.z >> BrickShift;
+
+	assert(dataPool_.itemSize() >= dataSize(size_));
+	auto data = static_cast<uint8_t*>(dataPool_.alloc());
+	if (!data) {
+		narf::console->println("Chunk: out of memory for blocks");
+		abort();
+	}
+	memset(data, 0, dataSize(size_));
+	blocks_ = reinterpret_cast<Block*>(data);
+	brickOpaqueCount_ = data + static_cast<size_t>(size_.x * size_.y * size_.z) * sizeof(Block);
 
-narf::Chunk::Chunk(World* world, const Vector3<int32_t>& size, const ChunkCoord& pos) :
-	world_(world), size_(size), pos_(pos) {
-	blocks_ = (Block*)calloc(static_cast<size_t>(size_.x * size_.y * size_.z), sizeof(Block));
 	posBlocks_.x = pos_.x * world->chunkSizeX();
 	posBlocks_.y = pos_.y * world->chunkSizeY();
 	posBlocks_.z = pos_.z * world->chunkSizeZ();
@@ -46,14 +74,60 @@ narf::Chunk::Chunk(World* world, const Vector3<int32_t>& size, const ChunkCoord&
 
 
 narf::Chunk::~Chunk() {
-	free(blocks_);
+	dataPool_.free(blocks_);
+}
+
+
+size_t narf::Chunk::dataSize(const Vector3<int32_t>& size) {
+	auto numBlocks = static_cast<size_t>(size.x * size.y * size.z);
+	auto numBricks = static_cast<size_t>((size.x >> BrickShift) * (size.y >> BrickShift) * (size.z >> BrickShift));
+	return numBlocks * sizeof(Block) + numBricks * sizeof(uint8_t);
+}
+
+
+const uint32_t narf::ChunkJournal::Capacity;
+
+
+bool narf::ChunkJournal::changesSince(uint64_t since, std::vector<Change>& changes) const {
+	changes.clear();
+	if (since > seq_ || since < resetSeq_ || seq_ - since > Capacity) {
+		return false;
+	}
+	for (auto i = since; i < seq_; i++) {
+		changes.push_back(changes_[i % Capacity]);
+	}
+	return true;
 }
 
 
 void narf::Chunk::putBlock(const Block *b, const BlockCoord& c) {
-	Block *to_replace = &blocks_[c.z * size_.x * size_.y + c.y * size_.x + c.x];
+	auto index = blockIndex(c);
+	Block *to_replace = &blocks_[index];
 	if (!world_->getBlockType(to_replace->id)->indestructible) {
+		bool wasOpaque = to_replace->id != 0;
+		bool isOpaque = b->id != 0;
+		if (wasOpaque != isOpaque) {
+			auto& brickCount = brickOpaqueCount_[brickIndex(c)];
+			if (isOpaque) {
+				brickCount++;
+				opaqueCount_++;
+			} else {
+				brickCount--;
+				opaqueCount_--;
+			}
+			visibilityDirty_ = true;
+		}
+		bool changed = to_replace->id != b->id;
+		if (changed) {
+			journal_.record(static_cast<uint32_t>(index), b->id);
+			collisionDirty_ = true;
+			checksumDirty_ = true;
+		}
 		*to_replace = *b;
+		if (changed) {
+			world_->entityManager.blockChanged(c + posBlocks_);
+			world_->pathfinder.blockChanged(c + posBlocks_);
+		}
 		if (world_->blockUpdate) {
 			world_->blockUpdate(c + posBlocks_);
 		}
@@ -61,6 +135,128 @@ void narf::Chunk::putBlock(const Block *b, const BlockCoord& c) {
 }
 
 
+void narf::Chunk::rebuildOccupancy() {
+	if (defaultGeometry_) {
+		rebuildOccupancy(DefaultChunkGeometry());
+	} else {
+		rebuildOccupancy(ChunkGeometry(size_));
+	}
+}
+
+
+template<class Geometry>
+void narf::Chunk::rebuildOccupancy(const Geometry& g) {
+	visibilityDirty_ = true;
+	collisionDirty_ = true;
+	checksumDirty_ = true;
+	opaqueCount_ = 0;
+	memset(brickOpaqueCount_, 0, static_cast<size_t>(bricks_.x * bricks_.y * bricks_.z));
+
+	for (int32_t z = 0; z < g.sizeZ(); z++) {
+		for (int32_t y = 0; y < g.sizeY(); y++) {
+			for (int32_t x = 0; x < g.sizeX(); x++) {
+				BlockCoord c(x, y, z);
+				if (isOpaque(g, c)) {
+					brickOpaqueCount_[brickIndex(c)]++;
+					opaqueCount_++;
+				}
+			}
+		}
+	}
+}
+
+
+uint16_t narf::Chunk::faceConnection(BlockFace a, BlockFace b) {
+	assert(a != BlockFace::Invalid && b != BlockFace::Invalid);
+	if (a > b) {
+		std::swap(a, b);
+	}
+	// index of unordered pair (a, b) with a < b among the 15 pairs of 6 faces
+	static const uint8_t firstPair[6] = {0, 5, 9, 12, 14, 15};
+	return (uint16_t)(1u << (firstPair[a] + (b - a - 1)));
+}
+
+
+uint16_t narf::Chunk::getVisibility() {
+	if (visibilityDirty_) {
+		calcVisibility();
+		visibilityDirty_ = false;
+	}
+	return visibility_;
+}
+
+
+void narf::Chunk::calcVisibility() {
+	auto numBlocks = static_cast<size_t>(size_.x * size_.y * size_.z);
+
+	if (opaqueCount_ == 0) {
+		visibility_ = 0x7FFF; // all faces connected
+		return;
+	}
+	if (opaqueCount_ == numBlocks) {
+		visibility_ = 0;
+		return;
+	}
+
+	visibility_ = 0;
+
+	// flood fill each connected region of non-opaque blocks and record which faces it touches
+	std::vector<bool> visited(numBlocks, false);
+	std::vector<BlockCoord> stack;
+
+	ZYXCoordIter<BlockCoord> iter({0, 0, 0}, {size_.x, size_.y, size_.z});
+	for (const auto& start : iter) {
+		auto startIndex = blockIndex(start);
+		if (visited[startIndex] || isOpaque(start)) {
+			continue;
+		}
+
+		unsigned faces = 0; // bit set of BlockFace
+		visited[startIndex] = true;
+		stack.push_back(start);
+		while (!stack.empty()) {
+			auto c = stack.back();
+			stack.pop_back();
+
+			if (c.x == size_.x - 1) faces |= 1u << BlockFace::XPos;
+			if (c.x == 0) faces |= 1u << BlockFace::XNeg;
+			if (c.y == size_.y - 1) faces |= 1u << BlockFace::YPos;
+			if (c.y == 0) faces |= 1u << BlockFace::YNeg;
+			if (c.z == size_.z - 1) faces |= 1u << BlockFace::ZPos;
+			if (c.z == 0) faces |= 1u << BlockFace::ZNeg;
+
+			const BlockCoord neighbors[6] = {
+				{c.x + 1, c.y, c.z}, {c.x - 1, c.y, c.z},
+				{c.x, c.y + 1, c.z}, {c.x, c.y - 1, c.z},
+				{c.x, c.y, c.z + 1}, {c.x, c.y, c.z - 1},
+			};
+			for (const auto& n : neighbors) {
+				if (n.x < 0 || n.y < 0 || n.z < 0 || n.x >= size_.x || n.y >= size_.y || n.z >= size_.z) {
+					continue;
+				}
+				auto index = blockIndex(n);
+				if (!visited[index] && !isOpaque(n)) {
+					visited[index] = true;
+					stack.push_back(n);
+				}
+			}
+		}
+
+		for (unsigned a = 0; a < 6; a++) {
+			for (unsigned b = a + 1; b < 6; b++) {
+				if ((faces & (1u << a)) && (faces & (1u << b))) {
+					visibility_ |= faceConnection((BlockFace)a, (BlockFace)b);
+				}
+			}
+		}
+
+		if (visibility_ == 0x7FFF) {
+			break; // can't get any more connected
+		}
+	}
+}
+
+
 void narf::Chunk::fillRectPrism(const BlockCoord& c1, const BlockCoord& c2, uint8_t block_id) {
 	ZYXCoordIter<BlockCoord> iter(c1, c2);
 	for (const auto& c : iter) {
@@ -151,32 +347,121 @@ void narf::Chunk::generate() {
 	} else if (pos_.z < 2) {
 		fillRectPrism({0, 0, 0}, {size_.x, size_.y, size_.z}, 2); // dirt
 	}
+
+	// nobody has seen this chunk yet, so there is no point in keeping the individual changes
+	journal_.reset();
+}
+
+
+uint64_t narf::Chunk::checksum() {
+	if (checksumDirty_) {
+		// hash eight block IDs at a time; the chunk dimensions are multiples of the brick size, so the count is too
+		static_assert(sizeof(Block) == 1, "blocks must be bytes");
+		auto numWords = static_cast<size_t>(size_.x * size_.y * size_.z) / 8;
+		uint64_t h = 0;
+		for (size_t i = 0; i < numWords; i++) {
+			uint64_t word;
+			memcpy(&word, &blocks_[i * 8], sizeof(word));
+			h = mix64(h ^ word);
+		}
+		checksum_ = h;
+		checksumDirty_ = false;
+	}
+	return checksum_;
+}
+
+
+void narf::Chunk::calcCollision() {
+	auto numBlocks = static_cast<size_t>(size_.x * size_.y * size_.z);
+	collision_.cubes.assign((numBlocks + 63) / 64, 0);
+	collision_.shapes.assign((numBlocks + 63) / 64, 0);
+	collision_.shapesBefore.assign((numBlocks + 63) / 64, 0);
+	collision_.boxes.clear();
+	if (opaqueCount_ == 0) {
+		return;
+	}
+
+	for (size_t i = 0; i < numBlocks; i++) {
+		auto id = blocks_[i].id;
+		if (id == 0) {
+			continue;
+		}
+		auto type = world_->getBlockType(id);
+		if (type->fullCube()) {
+			collision_.cubes[i >> 6] |= 1ull << (i & 63);
+		} else {
+			collision_.shapes[i >> 6] |= 1ull << (i & 63);
+			collision_.boxes.push_back(type->getAABB(blockCoord(static_cast<uint32_t>(i)) + posBlocks_));
+		}
+	}
+
+	uint32_t count = 0;
+	for (size_t w = 0; w < collision_.shapes.size(); w++) {
+		collision_.shapesBefore[w] = count;
+		count += static_cast<uint32_t>(std::bitset<64>(collision_.shapes[w]).count());
+	}
+}
+
+
+// blocks are converted to/from their serialized form this many at a time
+static const size_t SerializeBatch = 256;
+
+template<class Geometry>
+void narf::Chunk::serializeBlocks(const Geometry& g, narf::ByteStream& s) const {
+	// each block is a little-endian uint16_t ID
+	uint8_t buf[SerializeBatch * 2];
+	for (size_t i = 0; i < g.numBlocks(); i += SerializeBatch) {
+		auto n = std::min(SerializeBatch, g.numBlocks() - i);
+		for (size_t j = 0; j < n; j++) {
+			uint16_t id = blocks_[i + j].id;
+			buf[j * 2 + 0] = (uint8_t)id;
+			buf[j * 2 + 1] = (uint8_t)(id >> 8);
+		}
+		s.write(buf, n * 2);
+	}
 }
 
 
 void narf::Chunk::serialize(narf::ByteStream& s) {
-	// TODO: use a CoordIter
-	int32_t numBlocks = size_.x * size_.y * size_.z;
-	for (int32_t i = 0; i < numBlocks; i++) {
-		uint16_t tmp16 = blocks_[i].id;
-		s.write(tmp16, LE);
+	if (defaultGeometry_) {
+		serializeBlocks(DefaultChunkGeometry(), s);
+	} else {
+		serializeBlocks(ChunkGeometry(size_), s);
+	}
+}
+
+
+template<class Geometry>
+bool narf::Chunk::deserializeBlocks(const Geometry& g, narf::ByteStream& s) {
+	uint8_t buf[SerializeBatch * 2];
+	for (size_t i = 0; i < g.numBlocks(); i += SerializeBatch) {
+		auto n = std::min(SerializeBatch, g.numBlocks() - i);
+		if (s.bytesLeft() < n * 2 || !s.read(buf, n * 2)) {
+			return false;
+		}
+		for (size_t j = 0; j < n; j++) {
+			uint16_t id = (uint16_t)(buf[j * 2 + 0] | (buf[j * 2 + 1] << 8));
+			blocks_[i + j].id = static_cast<narf::BlockTypeId>(id);
+		}
 	}
+	return true;
 }
 
 
 void narf::Chunk::deserialize(narf::ByteStream& s) {
-	// TODO: add optimized array read
-	int32_t numBlocks = size_.x * size_.y * size_.z;
-	for (int32_t i = 0; i < numBlocks; i++) {
-		uint16_t id;
-		if (!s.read(&id, LE)) {
-			// TODO: chunk invalid
-			narf::console->println("Chunk::deserialize: ran out of blocks");
-			assert(0);
-			return;
-		}
-		blocks_[i].id = static_cast<narf::BlockTypeId>(id);
+	bool ok = defaultGeometry_ ?
+		deserializeBlocks(DefaultChunkGeometry(), s) :
+		deserializeBlocks(ChunkGeometry(size_), s);
+	if (!ok) {
+		// TODO: chunk invalid
+		narf::console->println("Chunk::deserialize: ran out of blocks");
+		assert(0);
+		return;
 	}
+	rebuildOccupancy();
+	journal_.reset();
+	world_->entityManager.chunkChanged(pos_);
+	world_->pathfinder.chunkChanged(pos_);
 	if (world_->chunkUpdate) {
 		world_->chunkUpdate(pos_);
 	}
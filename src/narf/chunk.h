@@ -36,11 +36,14 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <bitset>
 #include <vector>
 
 #include "narf/block.h"
 #include "narf/bytestream.h"
+#include "narf/math/ints.h"
 #include "narf/math/vector.h"
+#include "narf/slab.h"
 
 namespace narf {
 
@@ -49,15 +52,141 @@ class World;
 // chunk coordinate (in units of chunks) within world
 typedef Point3<int32_t> ChunkCoord;
 
+// chunk dimensions known at compile time, so block index math and loops over a chunk fold into constants
+template<int32_t X, int32_t Y, int32_t Z>
+class FixedChunkGeometry {
+public:
+	static_assert(X > 0 && (X & (X - 1)) == 0, "chunk size must be a power of 2");
+	static_assert(Y > 0 && (Y & (Y - 1)) == 0, "chunk size must be a power of 2");
+	static_assert(Z > 0 && (Z & (Z - 1)) == 0, "chunk size must be a power of 2");
+
+	static const int32_t SizeX = X;
+	static const int32_t SizeY = Y;
+	static const int32_t SizeZ = Z;
+
+	// block index is z << ShiftXY | y << ShiftX | x
+	static const int32_t ShiftX = constIlog2(X);
+	static const int32_t ShiftXY = constIlog2(X * Y);
+
+	constexpr int32_t sizeX() const { return X; }
+	constexpr int32_t sizeY() const { return Y; }
+	constexpr int32_t sizeZ() const { return Z; }
+
+	constexpr size_t numBlocks() const { return static_cast<size_t>(X * Y * Z); }
+
+	size_t index(const Point3<int32_t>& c) const {
+		return static_cast<size_t>((c.z << ShiftXY) | (c.y << ShiftX) | c.x);
+	}
+};
+
+// chunk dimensions only known at run time (e.g. a world loaded with an unusual chunk size)
+class ChunkGeometry {
+public:
+	ChunkGeometry(const Vector3<int32_t>& size) :
+		size_(size), shiftX_(ilog2(size.x)), shiftXY_(ilog2(size.x * size.y)) {}
+
+	int32_t sizeX() const { return size_.x; }
+	int32_t sizeY() const { return size_.y; }
+	int32_t sizeZ() const { return size_.z; }
+
+	size_t numBlocks() const { return static_cast<size_t>(size_.x * size_.y * size_.z); }
+
+	size_t index(const Point3<int32_t>& c) const {
+		return static_cast<size_t>((c.z << shiftXY_) | (c.y << shiftX_) | c.x);
+	}
+
+private:
+	Vector3<int32_t> size_;
+	int32_t shiftX_, shiftXY_; // sizes are powers of 2, so block index math is shifts as in FixedChunkGeometry
+};
+
+// chunk size used by the client and server; chunks of this size take the specialized code paths
+typedef FixedChunkGeometry<16, 16, 16> DefaultChunkGeometry;
+
+// bounded log of the most recent block changes in a chunk
+// consumers remember seq() when they catch up and later ask for the changes made since then
+class ChunkJournal {
+public:
+	struct Change {
+		uint32_t index; // block index within the chunk
+		BlockTypeId id; // new block type
+	};
+
+	// number of changes kept; consumers further behind than this see the whole chunk as changed
+	static const uint32_t Capacity = 64;
+
+	// seq is where numbering starts, so a chunk that replaces an unloaded copy can carry on from the copy's seq()
+	explicit ChunkJournal(uint64_t seq = 0) : seq_(seq), resetSeq_(seq) {}
+
+	// sequence number of the latest change (0 if nothing has changed)
+	uint64_t seq() const { return seq_; }
+
+	void record(uint32_t index, BlockTypeId id)
+	{
+		changes_[seq_ % Capacity] = {index, id};
+		seq_++;
+	}
+
+	// note that the whole chunk changed (e.g. replaced by deserialize())
+	void reset()
+	{
+		seq_++;
+		resetSeq_ = seq_;
+	}
+
+	// get the changes made after sequence number since, oldest first
+	// returns false if they are no longer available and the whole chunk must be treated as changed
+	bool changesSince(uint64_t since, std::vector<Change>& changes) const;
+
+private:
+	uint64_t seq_;
+	uint64_t resetSeq_; // seq_ as of the last reset(); changes before it are gone
+	Change changes_[Capacity];
+};
+
+// collision geometry of a chunk (see Chunk::getCollision())
+struct ChunkCollision {
+	// bit i is set if block i (in the same order as ChunkJournal::Change::index) is solid and fills its whole block
+	std::vector<uint64_t> cubes;
+
+	// bit i is set if block i is solid with any other shape
+	std::vector<uint64_t> shapes;
+
+	// AABBs of the blocks in shapes, in block order
+	std::vector<AABB> boxes;
+
+	// number of bits set in shapes before each word, to find a block's entry in boxes
+	std::vector<uint32_t> shapesBefore;
+
+	bool cube(size_t index) const { return ((cubes[index >> 6] >> (index & 63)) & 1) != 0; }
+	bool shaped(size_t index) const { return ((shapes[index >> 6] >> (index & 63)) & 1) != 0; }
+
+	// the AABB of shaped block index
+	const AABB& box(size_t index) const
+	{
+		auto below = shapes[index >> 6] & ((1ull << (index & 63)) - 1);
+		return boxes[shapesBefore[index >> 6] + std::bitset<64>(below).count()];
+	}
+};
+
 class Chunk {
 public:
 
 	// block coordinate within chunk
 	typedef Point3<int32_t> BlockCoord;
 
-	Chunk(World *world, const Vector3<int32_t>& size, const ChunkCoord& pos);
+	// block storage for the chunk is taken from dataPool, whose items must be at least dataSize(size) bytes
+	// journalSeq is the journal seq() of the last copy of this chunk that was unloaded (0 if none)
+	Chunk(World *world, SlabPool& dataPool, const Vector3<int32_t>& size, const ChunkCoord& pos, uint64_t journalSeq);
 	~Chunk();
 
+	// bytes of block storage needed by a chunk of the given size
+	static size_t dataSize(const Vector3<int32_t>& size);
+
+	// no copying
+	Chunk(const Chunk&) = delete;
+	Chunk& operator=(const Chunk&) = delete;
+
 	void serialize(ByteStream& s);
 	void deserialize(ByteStream& s);
 
@@ -73,26 +202,146 @@ public:
 		assert(c.y < size_.y);
 		assert(c.z < size_.z);
 
-		return &blocks_[((c.z * size_.y) + c.y) * size_.x + c.x];
+		return &blocks_[blockIndex(c)];
 	}
 
 	void putBlock(const Block *b, const BlockCoord& c);
 
+	// recent changes to this chunk, for consumers that poll rather than use World's callbacks
+	const ChunkJournal& journal() const { return journal_; }
+
+	// inverse of the block index used in ChunkJournal::Change
+	BlockCoord blockCoord(uint32_t index) const
+	{
+		auto i = static_cast<int32_t>(index);
+		return BlockCoord(i & (size_.x - 1), (i >> shiftX_) & (size_.y - 1), i >> shiftXY_);
+	}
+
 	bool isOpaque(const BlockCoord& c) const
 	{
 		return getBlock(c)->id != 0;
 	}
 
+	// versions of getBlock() and isOpaque() for loops specialized on chunk geometry
+	// g must describe this chunk's size (see hasDefaultGeometry())
+	template<class Geometry>
+	const Block *getBlock(const Geometry& g, const BlockCoord& c) const
+	{
+		assert(c.x >= 0 && c.x < g.sizeX());
+		assert(c.y >= 0 && c.y < g.sizeY());
+		assert(c.z >= 0 && c.z < g.sizeZ());
+		return &blocks_[g.index(c)];
+	}
+
+	template<class Geometry>
+	bool isOpaque(const Geometry& g, const BlockCoord& c) const
+	{
+		return getBlock(g, c)->id != 0;
+	}
+
+	// true if this chunk's size matches DefaultChunkGeometry
+	bool hasDefaultGeometry() const { return defaultGeometry_; }
+
+	// bricks are 4x4x4 groups of blocks used to skip empty space quickly
+	static const int32_t BrickShift = 2;
+	static const int32_t BrickSize = 1 << BrickShift;
+
+	// true if this chunk contains no opaque blocks at all
+	bool empty() const { return opaqueCount_ == 0; }
+
+	// true if every block in this chunk is opaque
+	bool full() const { return opaqueCount_ == static_cast<uint32_t>(size_.x * size_.y * size_.z); }
+
+	// true if the brick containing block c (relative to chunk) contains no opaque blocks
+	bool brickEmpty(const BlockCoord& c) const
+	{
+		return brickOpaqueCount_[brickIndex(c)] == 0;
+	}
+
+	// recalculate the collision geometry if the chunk has changed since it was last calculated
+	void updateCollision()
+	{
+		if (collisionDirty_) {
+			calcCollision();
+			collisionDirty_ = false;
+		}
+	}
+
+	// collision geometry; updateCollision() must have been called since the chunk last changed, so that
+	// this can be read from several threads at once
+	const ChunkCollision& getCollision() const
+	{
+		assert(!collisionDirty_);
+		return collision_;
+	}
+
+	// hash of the block contents, recalculated the first time it is requested after the chunk changes
+	uint64_t checksum();
+
+	// bit for a pair of chunk faces in the set returned by getVisibility()
+	static uint16_t faceConnection(BlockFace a, BlockFace b);
+
+	// set of face pairs (15 bits) that are connected through non-opaque blocks in this chunk
+	// recalculated by flood fill the first time it is requested after the chunk changes
+	uint16_t getVisibility();
+
+	// true if something looking into this chunk through face a could see out through face b
+	bool facesConnected(BlockFace a, BlockFace b)
+	{
+		return (getVisibility() & faceConnection(a, b)) != 0;
+	}
+
 protected:
 	World *world_;
+	SlabPool& dataPool_;
 	Block *blocks_; // size_.X by size_.Y by size_.Z 3D array of blocks in this chunk
 
-	Vector3<int32_t> size_; // size of this chunk in blocks
+	// occupancy counts, maintained incrementally by putBlock()
+	uint32_t opaqueCount_; // number of opaque blocks in the whole chunk
+	uint8_t *brickOpaqueCount_; // number of opaque blocks in each brick (stored after blocks_)
+	Vector3<int32_t> bricks_; // size of this chunk in bricks
+
+	uint16_t visibility_; // cached result of getVisibility()
+	bool visibilityDirty_; // visibility_ needs to be recalculated
+
+	ChunkCollision collision_; // cached result of getCollision()
+	bool collisionDirty_; // collision_ needs to be recalculated
+
+	uint64_t checksum_; // cached result of checksum()
+	bool checksumDirty_; // checksum_ needs to be recalculated
+
+	ChunkJournal journal_;
+
+	Vector3<int32_t> size_; // size of this chunk in blocks (powers of 2)
+	int32_t shiftX_, shiftXY_; // log2 of size_.x and of size_.x * size_.y
+	bool defaultGeometry_; // size_ matches DefaultChunkGeometry
 	ChunkCoord pos_; // position within the world of this chunk in chunks
 	BlockCoord posBlocks_; // position within the world of this chunk in blocks
 
 	void fillRectPrism(const BlockCoord& c1, const BlockCoord& c2, uint8_t block_id);
 	void fillXYPlane(int32_t z, uint8_t block_id);
+
+	// index into blocks_ of block c (relative to chunk)
+	size_t blockIndex(const BlockCoord& c) const
+	{
+		return static_cast<size_t>((c.z << shiftXY_) | (c.y << shiftX_) | c.x);
+	}
+
+	size_t brickIndex(const BlockCoord& c) const
+	{
+		return static_cast<size_t>(
+			((c.z >> BrickShift) << (shiftXY_ - 2 * BrickShift)) |
+			((c.y >> BrickShift) << (shiftX_ - BrickShift)) |
+			(c.x >> BrickShift));
+	}
+
+	void rebuildOccupancy();
+	void calcVisibility();
+	void calcCollision();
+
+	template<class Geometry> void serializeBlocks(const Geometry& g, ByteStream& s) const;
+	template<class Geometry> bool deserializeBlocks(const Geometry& g, ByteStream& s);
+	template<class Geometry> void rebuildOccupancy(const Geometry& g);
 };
 
 } // namespace narf
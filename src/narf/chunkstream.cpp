@@ -0,0 +1,102 @@
+/*
+ * NarfBlock chunk streaming
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "narf/chunkstream.h"
+#include "narf/world.h"
+
+#include <algorithm>
+
+using namespace narf;
+
+
+static int32_t distanceSquared(const ChunkCoord& a, const ChunkCoord& b) {
+	auto dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+	return dx * dx + dy * dy + dz * dz;
+}
+
+
+void ChunkStream::clear() {
+	radius_ = -1;
+	sent_.clear();
+	queue_.clear();
+	unloaded_.clear();
+}
+
+
+void ChunkStream::update(const World& world, const ChunkCoord& center, int32_t radius) {
+	unloaded_.clear();
+	if (center == center_ && radius == radius_) {
+		return;
+	}
+	center_ = center;
+	radius_ = radius;
+
+	// the extra chunk of slack keeps a client moving back and forth over a chunk boundary
+	// from having the same chunks dropped and sent again
+	auto keep = (radius + 1) * (radius + 1);
+	for (auto it = sent_.begin(); it != sent_.end(); ) {
+		if (distanceSquared(it->first, center) > keep) {
+			unloaded_.push_back(it->first);
+			it = sent_.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	queue_.clear();
+	ChunkCoord c1(std::max(center.x - radius, 0), std::max(center.y - radius, 0), std::max(center.z - radius, 0));
+	ChunkCoord c2(std::min(center.x + radius + 1, world.chunksX()), std::min(center.y + radius + 1, world.chunksY()),
+		std::min(center.z + radius + 1, world.chunksZ()));
+	for (int32_t z = c1.z; z < c2.z; z++) {
+		for (int32_t y = c1.y; y < c2.y; y++) {
+			for (int32_t x = c1.x; x < c2.x; x++) {
+				ChunkCoord cc(x, y, z);
+				if (distanceSquared(cc, center) <= radius * radius && !has(cc)) {
+					queue_.push_back(cc);
+				}
+			}
+		}
+	}
+	std::sort(queue_.begin(), queue_.end(), [&](const ChunkCoord& a, const ChunkCoord& b) {
+		return distanceSquared(a, center) > distanceSquared(b, center);
+	});
+}
+
+
+bool ChunkStream::next(ChunkCoord& cc) {
+	if (queue_.empty()) {
+		return false;
+	}
+	cc = queue_.back();
+	queue_.pop_back();
+	return true;
+}
@@ -0,0 +1,103 @@
+/*
+ * NarfBlock chunk streaming
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NARF_CHUNKSTREAM_H
+#define NARF_CHUNKSTREAM_H
+
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "narf/chunk.h"
+
+namespace narf {
+
+class World;
+
+// the chunks one client has been sent, and the order to send it the rest in:
+// only chunks near the client are wanted, nearest first, so what it takes to get started
+// does not depend on the size of the world
+class ChunkStream {
+public:
+	ChunkStream() : center_(0, 0, 0), radius_(-1) { }
+
+	// want the chunks within radius chunks of center
+	// when center or radius change, the chunks still to send are reordered by distance from the new center,
+	// and chunks already sent that are now more than radius + 1 chunks away are dropped (see unloaded())
+	void update(const World& world, const ChunkCoord& center, int32_t radius);
+
+	// take the nearest chunk still to send; false if there is none
+	// call sent() once it has been sent
+	bool next(ChunkCoord& cc);
+
+	// record that the chunk has been sent as of the given version (its journal sequence number)
+	void sent(const ChunkCoord& cc, uint64_t version) { sent_[cc] = version; }
+
+	// chunk has been sent and not dropped since
+	bool has(const ChunkCoord& cc) const { return sent_.count(cc) != 0; }
+
+	// version of the chunk that was sent, or 0 if it has not been sent
+	uint64_t version(const ChunkCoord& cc) const
+	{
+		auto it = sent_.find(cc);
+		return it != sent_.end() ? it->second : 0;
+	}
+
+	// chunk has been sent, but not as of this version
+	bool outdated(const ChunkCoord& cc, uint64_t version) const
+	{
+		auto it = sent_.find(cc);
+		return it != sent_.end() && it->second != version;
+	}
+
+	// chunks dropped by the last update(); the client can let go of them
+	const std::vector<ChunkCoord>& unloaded() const { return unloaded_; }
+
+	size_t size() const { return sent_.size(); }
+	size_t queued() const { return queue_.size(); }
+
+	// start over, e.g. for a new client
+	void clear();
+
+private:
+	ChunkCoord center_;
+	int32_t radius_; // -1 until the first update()
+
+	std::unordered_map<ChunkCoord, uint64_t> sent_; // version of each chunk sent
+	std::vector<ChunkCoord> queue_; // wanted chunks not sent yet, furthest first
+	std::vector<ChunkCoord> unloaded_;
+};
+
+} // namespace narf
+
+#endif // NARF_CHUNKSTREAM_H
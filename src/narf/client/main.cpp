@@ -214,6 +214,8 @@ void configEvent(const std::string& key) {
 	if (key == "video.renderDistance") {
 		renderer->setRenderDistance(config.getInt32(key));
 		narf::console->println("Setting renderDistance to " + std::to_string(renderer->getRenderDistance()));
+	} else if (key == "video.occlusionCulling") {
+		renderer->occlusionCulling = config.getBool(key);
 	} else if (key == "video.consoleCursorShape") {
 		auto shapeStr = config.getString(key);
 		clientConsole->setCursorShape(narf::ClientConsole::cursorShapeFromString(shapeStr));
@@ -473,7 +475,8 @@ void draw2d() {
 	}
 
 	entityInfoBuffer->clear();
-	entityInfoBuffer->print("numEntities: " + std::to_string(world->entityManager.getNumEntities()), 0, (float)display->height() - hudFontHeight * 3.0f, blue);
+	entityInfoBuffer->print("numEntities: " + std::to_string(world->entityManager.getNumEntities()) +
+		" desyncs: " + std::to_string(world->entityManager.desyncs()), 0, (float)display->height() - hudFontHeight * 3.0f, blue);
 
 	std::string location_str;
 	if (playerEID == narf::Entity::InvalidID) {
@@ -481,7 +484,8 @@ void draw2d() {
 	} else {
 		narf::EntityRef player(world->entityManager, playerEID);
 		if (player.ent) {
-			location_str = "Pos: " + std::to_string(player->position.x) + ", " + std::to_string(player->position.y) + ", " + std::to_string(player->position.z);
+			auto position = player->position.toFloat();
+			location_str = "Pos: " + std::to_string(position.x) + ", " + std::to_string(position.y) + ", " + std::to_string(position.z);
 		}
 	}
 	location_str += " Yaw: " + std::to_string(cam.orientation.yaw) + " Pitch: " + std::to_string(cam.orientation.pitch);
@@ -614,7 +618,7 @@ void sim_frame(const narf::Input &input, narf::timediff dt)
 	if (playerEID != narf::Entity::InvalidID) {
 		narf::EntityRef player(world->entityManager, playerEID);
 
-		if (player.ent && player->antigrav) {
+		if (player.ent && player->has(narf::Entity::Antigrav)) {
 			// if flying, move in the direction of camera including pitch
 			movePitch = cam.orientation.pitch;
 		}
@@ -641,7 +645,7 @@ void sim_frame(const narf::Input &input, narf::timediff dt)
 					vel_rel += narf::Vector3f(0.0f, 0.0f, 8.0f);
 				} else if (player->velocity.z > 0.0f) {
 					// still going up - double jump triggers flying
-					player->antigrav = true;
+					player->set(narf::Entity::Antigrav);
 					narf::console->println("entered antigrav mode");
 				}
 			}
@@ -651,9 +655,13 @@ void sim_frame(const narf::Input &input, narf::timediff dt)
 			player->velocity.y = vel_rel.y;
 			player->velocity.z += vel_rel.z;
 
-			if (player->antigrav) {
+			if (player->has(narf::Entity::Antigrav)) {
 				player->velocity.z = vel_rel.z;
 			}
+
+			if (vel_rel.lengthSquared() > 0.0f) {
+				player->wake();
+			}
 		}
 	}
 
@@ -662,13 +670,13 @@ void sim_frame(const narf::Input &input, narf::timediff dt)
 	if (playerEID != narf::Entity::InvalidID) {
 		narf::EntityRef player(world->entityManager, playerEID);
 		if (player.ent) {
-			if (player->onGround && player->antigrav) {
-				player->antigrav = false;
+			if (player->onGround && player->has(narf::Entity::Antigrav)) {
+				player->set(narf::Entity::Antigrav, false);
 				narf::console->println("left antigrav mode");
 			}
 
 			// lock camera to player
-			cam.position = player->position;
+			cam.position = player->position.toFloat();
 			cam.position.z += 1.6f;
 		}
 	}
@@ -677,23 +685,11 @@ void sim_frame(const narf::Input &input, narf::timediff dt)
 	auto pos = narf::Point3f(cam.position.x, cam.position.y, cam.position.z);
 	auto maxInteractDistance = 7.5f;
 	selectedBlockFace = {};
-	bool traceHitBlock = false;
-	world->rayTrace(pos, cam.orientation,
-		[&](const narf::Point3f& point, const narf::BlockCoord& blockCoord, const narf::BlockFace& face){
-			if (point.distanceTo(pos) >= maxInteractDistance) {
-				return true; // ran out of distance
-			}
-
-			// TODO: stop the trace if it runs off the edge of the world
-			auto block = world->getBlock(blockCoord);
-			if (block && block->id != 0) {
-				// found a solid block
-				selectedBlockFace = {block, blockCoord.x, blockCoord.y, blockCoord.z, face};
-				traceHitBlock = true;
-				return true; // stop the trace
-			}
-			return false; // keep going
-		});
+	narf::RayHit hit;
+	bool traceHitBlock = world->rayCast(pos, cam.orientation, maxInteractDistance, hit);
+	if (traceHitBlock) {
+		selectedBlockFace = {world->getBlock(hit.wbc), hit.wbc.x, hit.wbc.y, hit.wbc.z, hit.face};
+	}
 
 	if (traceHitBlock) {
 		if (input.actionPrimaryBegin() || input.actionSecondaryBegin()) {
@@ -764,8 +760,9 @@ void processConnect(ENetEvent& evt) {
 	connectState = ConnectState::Connected;
 	narf::console->println("Connected to server " + narf::net::to_string(evt.peer->address));
 
-	// reset the world
+	// reset the world; its chunks come from the server from now on
 	newWorld();
+	world->setGenerateChunks(false);
 
 	// TODO: put this somewhere common
 	delete renderer;
@@ -802,13 +799,21 @@ void processPlayerCmd(ENetEvent& evt) {
 
 void processChunk(ENetEvent& evt) {
 	narf::ByteStream bs(evt.packet->data, evt.packet->dataLength);
-	narf::ChunkCoord wcc;
-	world->deserializeChunk(bs, wcc);
+	world->deserializeChunkUpdate(bs);
 }
 
 void processEntity(ENetEvent& evt) {
 	narf::ByteStream bs(evt.packet->data, evt.packet->dataLength);
+	auto lastSnapshotTick = world->entityManager.lastSnapshotTick();
 	world->entityManager.deserializeEntityUpdate(bs);
+
+	// acknowledge snapshots so the server sends changes from the latest one we have
+	if (world->entityManager.lastSnapshotTick() != lastSnapshotTick) {
+		narf::ByteStream ack;
+		ack.write(world->entityManager.lastSnapshotTick(), LE);
+		auto packet = enet_packet_create(ack.data(), ack.size(), 0);
+		enet_peer_send(server, narf::net::CHAN_ENTITY_STATE, packet);
+	}
 }
 
 void processReceive(ENetEvent& evt) {
@@ -823,6 +828,7 @@ void processReceive(ENetEvent& evt) {
 		processChunk(evt);
 		break;
 	case narf::net::CHAN_ENTITY:
+	case narf::net::CHAN_ENTITY_STATE:
 		processEntity(evt);
 		break;
 	}
@@ -947,20 +953,12 @@ void newWorld()
 	playerEID = narf::Entity::InvalidID;
 	bouncyBlockEID = narf::Entity::InvalidID;
 
-	world = new narf::World(WORLD_X_MAX, WORLD_Y_MAX, WORLD_Z_MAX, 16, 16, 16);
+	world = new narf::World(WORLD_X_MAX, WORLD_Y_MAX, WORLD_Z_MAX,
+		narf::DefaultChunkGeometry::SizeX, narf::DefaultChunkGeometry::SizeY, narf::DefaultChunkGeometry::SizeZ);
 
-	world->chunkUpdate = [](const narf::ChunkCoord& cc) {
-		if (renderer) {
-			renderer->chunkUpdate(cc);
-		}
-	};
-
-	world->blockUpdate = [](const narf::BlockCoord& wbc) {
-		if (renderer) {
-			renderer->blockUpdate(wbc);
-		}
-	};
 	world->setGravity(-24.0f);
+	world->setDeterministic(true); // match the server's simulation, so its corrections can be skipped
+	world->particles.setCapacity(100000);
 }
 
 
@@ -1112,6 +1110,7 @@ void cmdSaveConfig(const std::string& args) {
 
 void cmdStats(const std::string& args) {
 	gameLoop->dumpTickTimeHistogram();
+	world->dumpChunkPoolStats();
 }
 
 
@@ -1347,7 +1346,7 @@ extern "C" int main(int argc, char **argv)
 		narf::EntityRef player(world->entityManager, playerEID);
 
 		// initial player position
-		player->position = narf::Vector3f(15.0f, 10.0f, 3.0f * 16.0f);
+		player->position = narf::FixedPoint3(narf::Point3f(15.0f, 10.0f, 3.0f * 16.0f));
 		player->prevPosition = player->position;
 	}
 
@@ -1358,10 +1357,10 @@ extern "C" int main(int argc, char **argv)
 	bouncyBlockEID = world->entityManager.newEntity();
 	{
 		narf::EntityRef bouncyBlock(world->entityManager, bouncyBlockEID);
-		bouncyBlock->position = narf::Vector3f(10.0f, 10.0f, 21.0f);
+		bouncyBlock->position = narf::FixedPoint3(narf::Point3f(10.0f, 10.0f, 21.0f));
 		bouncyBlock->prevPosition = bouncyBlock->position;
-		bouncyBlock->bouncy = true;
-		bouncyBlock->model = true;
+		bouncyBlock->set(narf::Entity::Bouncy);
+		bouncyBlock->set(narf::Entity::Model);
 	}
 
 	if (!init_textures()) {
@@ -1372,6 +1371,7 @@ extern "C" int main(int argc, char **argv)
 	renderer = new narf::Renderer(world, *display, tilesTex);
 
 	config.initInt32("video.renderDistance", 5);
+	config.initBool("video.occlusionCulling", true);
 
 	fpsTextBuffer = new narf::font::TextBuffer(*display, nullptr);
 	blockInfoBuffer = new narf::font::TextBuffer(*display, nullptr);
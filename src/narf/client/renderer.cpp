@@ -84,7 +84,7 @@ static void drawCube(gl::Buffer<BlockVertex>& vbo, const Point3f& c, Vector3f& h
 
 
 ChunkVBO::ChunkVBO(gl::Context& gl, const ChunkCoord& cc) :
-	vbo_(gl, GL_ARRAY_BUFFER, GL_STATIC_DRAW), cc_(cc), dirty_(true) {
+	vbo_(gl, GL_ARRAY_BUFFER, GL_STATIC_DRAW), cc_(cc), dirty_(true), chunkSeq_(0), neighborSeq_() {
 }
 
 
@@ -97,68 +97,167 @@ void ChunkVBO::markDirty() {
 }
 
 
-void ChunkVBO::buildVBO(World* world) {
-	vbo_.clear();
+template<class Geometry>
+static void buildChunkMesh(gl::Buffer<BlockVertex>& vbo, World* world, const Chunk* chunk, const ChunkCoord& cc, const Geometry& g) {
+	auto corner = world->calcBlockCoords(cc);
 
-	auto chunk = world->getChunk(cc_);
-	if (!chunk) {
-		return;
-	}
+	// neighbors inside this chunk are looked up directly; only blocks on the chunk boundary go through World
+	auto opaque = [&](const Chunk::BlockCoord& cbc) {
+		if (cbc.x >= 0 && cbc.y >= 0 && cbc.z >= 0 &&
+			cbc.x < g.sizeX() && cbc.y < g.sizeY() && cbc.z < g.sizeZ()) {
+			return chunk->isOpaque(g, cbc);
+		}
+		// blocks outside the world are not opaque, so faces on the world boundary are drawn
+		return world->isOpaque(corner + cbc);
+	};
+
+	float lightScale = 1.0f / (float)(world->sizeZ() / 2);
 
 	// draw blocks
-	auto corner = world->calcBlockCoords(cc_);
-	ZYXCoordIter<BlockCoord> iter(
-		{corner.x, corner.y, corner.z},
-		{corner.x + world->chunkSizeX(), corner.y + world->chunkSizeY(), corner.z + world->chunkSizeZ()});
-	for (const auto& c : iter) {
-		if (world->isOpaque(c)) {
-			const Block *b = world->getBlock(c);
-
-			float fx = (float)c.x, fy = (float)c.y, fz = (float)c.z;
-			auto type = world->getBlockType(b->id);
-			assert(type != nullptr);
-
-			float light = fz / (float)(world->sizeZ() / 2) + 0.5f; // hax
-
-			// don't render sides of the cube that are obscured by other opaque cubes
-			if (c.y == world->sizeY() - 1 || !world->isOpaque({c.x, c.y + 1, c.z})) {
-				float quad[] = {fx+1,fy+1,fz+0, fx+0,fy+1,fz+0, fx+0,fy+1,fz+1, fx+1,fy+1,fz+1};
-				drawQuad(vbo_, type->texCoords[BlockFace::YPos], quad, light);
-			}
+	for (int32_t z = 0; z < g.sizeZ(); z++) {
+		for (int32_t y = 0; y < g.sizeY(); y++) {
+			for (int32_t x = 0; x < g.sizeX(); x++) {
+				Chunk::BlockCoord cbc(x, y, z);
+				const Block *b = chunk->getBlock(g, cbc);
+				if (b->id == 0) {
+					continue;
+				}
 
-			if (c.y == 0 || !world->isOpaque({c.x, c.y - 1, c.z})) {
-				float quad[] = {fx+0,fy+0,fz+0, fx+1,fy+0,fz+0, fx+1,fy+0,fz+1, fx+0,fy+0,fz+1};
-				drawQuad(vbo_, type->texCoords[BlockFace::YNeg], quad, light);
-			}
+				auto c = corner + cbc;
+				float fx = (float)c.x, fy = (float)c.y, fz = (float)c.z;
+				auto type = world->getBlockType(b->id);
+				assert(type != nullptr);
 
-			if (c.x == world->sizeX() - 1 || !world->isOpaque({c.x + 1, c.y, c.z})) {
-				float quad[] = {fx+1,fy+0,fz+0, fx+1,fy+1,fz+0, fx+1,fy+1,fz+1, fx+1,fy+0,fz+1};
-				drawQuad(vbo_, type->texCoords[BlockFace::XPos], quad, light);
-			}
+				float light = fz * lightScale + 0.5f; // hax
+
+				// don't render sides of the cube that are obscured by other opaque cubes
+				if (!opaque({x, y + 1, z})) {
+					float quad[] = {fx+1,fy+1,fz+0, fx+0,fy+1,fz+0, fx+0,fy+1,fz+1, fx+1,fy+1,fz+1};
+					drawQuad(vbo, type->texCoords[BlockFace::YPos], quad, light);
+				}
+
+				if (!opaque({x, y - 1, z})) {
+					float quad[] = {fx+0,fy+0,fz+0, fx+1,fy+0,fz+0, fx+1,fy+0,fz+1, fx+0,fy+0,fz+1};
+					drawQuad(vbo, type->texCoords[BlockFace::YNeg], quad, light);
+				}
+
+				if (!opaque({x + 1, y, z})) {
+					float quad[] = {fx+1,fy+0,fz+0, fx+1,fy+1,fz+0, fx+1,fy+1,fz+1, fx+1,fy+0,fz+1};
+					drawQuad(vbo, type->texCoords[BlockFace::XPos], quad, light);
+				}
+
+				if (!opaque({x - 1, y, z})) {
+					float quad[] = {fx+0,fy+1,fz+0, fx+0,fy+0,fz+0, fx+0,fy+0,fz+1, fx+0,fy+1,fz+1};
+					drawQuad(vbo, type->texCoords[BlockFace::XNeg], quad, light);
+				}
 
-			if (c.x == 0 || !world->isOpaque({c.x - 1, c.y, c.z})) {
-				float quad[] = {fx+0,fy+1,fz+0, fx+0,fy+0,fz+0, fx+0,fy+0,fz+1, fx+0,fy+1,fz+1};
-				drawQuad(vbo_, type->texCoords[BlockFace::XNeg], quad, light);
+				if (!opaque({x, y, z + 1})) {
+					float quad[] = {fx+0,fy+0,fz+1, fx+1,fy+0,fz+1, fx+1,fy+1,fz+1, fx+0,fy+1,fz+1};
+					drawQuad(vbo, type->texCoords[BlockFace::ZPos], quad, light);
+				}
+
+				if (!opaque({x, y, z - 1})) {
+					float quad[] = {fx+0,fy+1,fz+0, fx+1,fy+1,fz+0, fx+1,fy+0,fz+0, fx+0,fy+0,fz+0};
+					drawQuad(vbo, type->texCoords[BlockFace::ZNeg], quad, light);
+				}
 			}
+		}
+	}
+}
+
+
+// neighboring chunk offsets in BlockFace order
+static const ChunkCoord neighborOffsets[6] = {
+	{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1},
+};
+
 
-			if (c.z == world->sizeZ() - 1 || !world->isOpaque({c.x, c.y, c.z + 1})) {
-				float quad[] = {fx+0,fy+0,fz+1, fx+1,fy+0,fz+1, fx+1,fy+1,fz+1, fx+0,fy+1,fz+1};
-				drawQuad(vbo_, type->texCoords[BlockFace::ZPos], quad, light);
+// journal seq() of a chunk, or 0 if it is not loaded
+static uint64_t loadedSeq(World* world, const ChunkCoord& cc) {
+	auto chunk = world->loadedChunk(cc);
+	return chunk ? chunk->journal().seq() : 0;
+}
+
+
+void ChunkVBO::recordJournalSeqs(World* world) {
+	chunkSeq_ = loadedSeq(world, cc_);
+	for (int i = 0; i < 6; i++) {
+		neighborSeq_[i] = loadedSeq(world, cc_ + neighborOffsets[i]);
+	}
+}
+
+
+// check the journals of this chunk and its neighbors for changes that affect the mesh
+// chunks that are not loaded are not loaded just to check them; a chunk that is unloaded counts as changed,
+// and one loaded again later has a higher seq() than any copy of it seen before, so it does too
+bool ChunkVBO::changed(World* world) {
+	if (loadedSeq(world, cc_) != chunkSeq_) {
+		return true;
+	}
+
+	for (int i = 0; i < 6; i++) {
+		auto neighbor = world->loadedChunk(cc_ + neighborOffsets[i]);
+		if (!neighbor) {
+			if (neighborSeq_[i] != 0) {
+				return true;
 			}
+			continue;
+		}
+		auto& journal = neighbor->journal();
+		if (journal.seq() == neighborSeq_[i]) {
+			continue;
+		}
+		if (!journal.changesSince(neighborSeq_[i], changes_)) {
+			return true;
+		}
 
-			if (c.z == 0 || !world->isOpaque({c.x, c.y, c.z - 1})) {
-				float quad[] = {fx+0,fy+1,fz+0, fx+1,fy+1,fz+0, fx+1,fy+0,fz+0, fx+0,fy+0,fz+0};
-				drawQuad(vbo_, type->texCoords[BlockFace::ZNeg], quad, light);
+		// only blocks on the face shared with this chunk can expose or hide our faces
+		for (const auto& change : changes_) {
+			auto cbc = neighbor->blockCoord(change.index);
+			bool shared;
+			switch (i) {
+			case XPos: shared = cbc.x == 0; break;
+			case XNeg: shared = cbc.x == world->chunkSizeX() - 1; break;
+			case YPos: shared = cbc.y == 0; break;
+			case YNeg: shared = cbc.y == world->chunkSizeY() - 1; break;
+			case ZPos: shared = cbc.z == 0; break;
+			default:   shared = cbc.z == world->chunkSizeZ() - 1; break;
+			}
+			if (shared) {
+				return true;
 			}
 		}
+		neighborSeq_[i] = journal.seq();
 	}
+	return false;
+}
+
+
+void ChunkVBO::buildVBO(World* world) {
+	vbo_.clear();
+
+	auto chunk = world->getChunk(cc_);
+	if (!chunk) {
+		return;
+	}
+
+	if (!chunk->empty()) {
+		if (chunk->hasDefaultGeometry()) {
+			buildChunkMesh(vbo_, world, chunk, cc_, DefaultChunkGeometry());
+		} else {
+			buildChunkMesh(vbo_, world, chunk, cc_, ChunkGeometry({world->chunkSizeX(), world->chunkSizeY(), world->chunkSizeZ()}));
+		}
+	}
+
+	// after building, which may have loaded neighbors to look at their boundary blocks
+	recordJournalSeqs(world);
 
 	vbo_.upload();
 }
 
 
 void ChunkVBO::render(World* world) {
-	if (dirty_) {
+	if (dirty_ || changed(world)) {
 		buildVBO(world);
 		dirty_ = false;
 	}
@@ -188,7 +287,7 @@ void ChunkVBO::render(World* world) {
 
 
 Renderer::Renderer(World* world, gl::Context& gl, gl::Texture* tilesTex) :
-	wireframe(false), backfaceCulling(true), fog(true),
+	wireframe(false), backfaceCulling(true), fog(true), occlusionCulling(true),
 	world_(world), gl(gl), tilesTex_(tilesTex), entityVbo_(gl, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW) {
 }
 
@@ -218,58 +317,6 @@ void Renderer::renderChunk(const ChunkCoord& cc)
 }
 
 
-void Renderer::markChunkDirty(const ChunkCoord& cc) {
-	auto chunkVBO = getChunkVBO(cc);
-	if (chunkVBO) {
-		chunkVBO->markDirty();
-	}
-}
-
-
-void Renderer::chunkUpdate(const ChunkCoord& cc) {
-	markChunkDirty(cc);
-
-	// update neighboring chunk meshes since they may have holes exposed by updating this chunk
-	// or extra faces that are obstructed by updating this chunk
-	markChunkDirty({cc.x - 1, cc.y, cc.z});
-	markChunkDirty({cc.x, cc.y - 1, cc.z});
-	markChunkDirty({cc.x, cc.y, cc.z - 1});
-	markChunkDirty({cc.x + 1, cc.y, cc.z});
-	markChunkDirty({cc.x, cc.y + 1, cc.z});
-	markChunkDirty({cc.x, cc.y, cc.z + 1});
-}
-
-
-void Renderer::blockUpdate(const BlockCoord& wbc) {
-	ChunkCoord cc;
-	Chunk::BlockCoord cbc;
-	world_->calcChunkCoords(wbc, cc, cbc);
-
-	markChunkDirty(cc);
-
-	// update neighboring chunk meshes since they may have holes exposed by removing this block
-	// or extra faces that are obstructed by adding this block
-	if (cbc.x == 0) {
-		markChunkDirty({cc.x - 1, cc.y, cc.z});
-	}
-	if (cbc.y == 0) {
-		markChunkDirty({cc.x, cc.y - 1, cc.z});
-	}
-	if (cbc.z == 0) {
-		markChunkDirty({cc.x, cc.y, cc.z - 1});
-	}
-	if (cbc.x == world_->chunkSizeX() - 1) {
-		markChunkDirty({cc.x + 1, cc.y, cc.z});
-	}
-	if (cbc.y == world_->chunkSizeY() - 1) {
-		markChunkDirty({cc.x, cc.y + 1, cc.z});
-	}
-	if (cbc.z == world_->chunkSizeZ() - 1) {
-		markChunkDirty({cc.x, cc.y, cc.z + 1});
-	}
-}
-
-
 void Renderer::setRenderDistance(int32_t numChunks) {
 	renderDistance_ = numChunks;
 	size_t size = static_cast<size_t>(numChunks * 2);
@@ -304,7 +351,7 @@ void Renderer::render(gl::Context& context, const Camera& cam, float stateBlend,
 	if (fog) {
 		glFogi(GL_FOG_MODE, GL_LINEAR);
 		glHint(GL_FOG_HINT, GL_DONT_CARE);
-		auto renderDistanceBlocks = float(getRenderDistance() - 1) * 16.0f; // TODO - don't hardcore chunk size
+		auto renderDistanceBlocks = float(getRenderDistance() - 1) * (float)world_->chunkSizeX();
 		auto fogStart = std::max(renderDistanceBlocks - 48.0f, 8.0f);
 		auto fogEnd = std::max(renderDistanceBlocks, 16.0f);
 		glFogf(GL_FOG_START, fogStart);
@@ -343,39 +390,51 @@ void Renderer::render(gl::Context& context, const Camera& cam, float stateBlend,
 	glLoadIdentity();
 	glMultMatrixf(camMatrix.arr);
 
-	// get chunk coordinates for the chunk containing the camera
-	int32_t cxCam = (int32_t)(cam.position.x / (float)world_->chunkSizeX());
-	int32_t cyCam = (int32_t)(cam.position.y / (float)world_->chunkSizeY());
-
-	// calculate range of chunks to draw
-	int32_t cxMin = cxCam - renderDistance_;
-	int32_t cxMax = cxCam + renderDistance_;
-
-	int32_t cyMin = cyCam - renderDistance_;
-	int32_t cyMax = cyCam + renderDistance_;
-
-	// clip chunk draw range to world size
-	cxMin = clampi(cxMin, 0, world_->chunksX());
-	cxMax = clampi(cxMax, 0, world_->chunksX());
-
-	cyMin = clampi(cyMin, 0, world_->chunksY());
-	cyMax = clampi(cyMax, 0, world_->chunksY());
-
 	glBindTexture(gl::TEXTURE_2D, tilesTex_);
 
 	// draw chunks
 	chunkRebuildCount_ = 0;
-	if (cxMin < cxMax && cyMin < cyMax) {
-		for (int32_t cy = cyMin; cy < cyMax; cy++) {
-			for (int32_t cx = cxMin; cx < cxMax; cx++) {
-				assert(cx >= 0);
-				assert(cy >= 0);
-				assert(cx < world_->chunksX());
-				assert(cy < world_->chunksY());
-				// TODO: clip any chunks that are completely out of the camera's view before calling Chunk::render()
-				// TODO: clip in a sphere around the camera
-				for (int32_t cz = 0; cz < world_->chunksZ(); cz++) {
-					renderChunk({cx, cy, cz});
+	if (occlusionCulling) {
+		// only draw chunks reachable from the camera through open space
+		world_->findVisibleChunks(cam.position, cam.orientation, renderDistance_, visibleChunks_);
+		for (const auto& cc : visibleChunks_) {
+			renderChunk(cc);
+		}
+	} else {
+		// get chunk coordinates for the chunk containing the camera
+		int32_t cxCam = (int32_t)(cam.position.x / (float)world_->chunkSizeX());
+		int32_t cyCam = (int32_t)(cam.position.y / (float)world_->chunkSizeY());
+		int32_t czCam = (int32_t)(cam.position.z / (float)world_->chunkSizeZ());
+
+		// calculate range of chunks to draw
+		int32_t cxMin = cxCam - renderDistance_;
+		int32_t cxMax = cxCam + renderDistance_;
+
+		int32_t cyMin = cyCam - renderDistance_;
+		int32_t cyMax = cyCam + renderDistance_;
+
+		// clip chunk draw range to world size
+		cxMin = clampi(cxMin, 0, world_->chunksX());
+		cxMax = clampi(cxMax, 0, world_->chunksX());
+
+		cyMin = clampi(cyMin, 0, world_->chunksY());
+		cyMax = clampi(cyMax, 0, world_->chunksY());
+
+		if (cxMin < cxMax && cyMin < cyMax) {
+			for (int32_t cy = cyMin; cy < cyMax; cy++) {
+				for (int32_t cx = cxMin; cx < cxMax; cx++) {
+					assert(cx >= 0);
+					assert(cy >= 0);
+					assert(cx < world_->chunksX());
+					assert(cy < world_->chunksY());
+					// TODO: clip any chunks that are completely out of the camera's view before calling Chunk::render()
+					// clip to the sphere the server streams chunks in, as findVisibleChunks() does
+					for (int32_t cz = 0; cz < world_->chunksZ(); cz++) {
+						auto dx = cx - cxCam, dy = cy - cyCam, dz = cz - czCam;
+						if (dx * dx + dy * dy + dz * dz <= renderDistance_ * renderDistance_) {
+							renderChunk({cx, cy, cz});
+						}
+					}
 				}
 			}
 		}
@@ -384,31 +443,41 @@ void Renderer::render(gl::Context& context, const Camera& cam, float stateBlend,
 	// render entities
 	entityVbo_.clear();
 
+	// entity positions are fixed point; build their vertices relative to the camera so they keep full precision
+	// far from the world origin, and draw them without the camera translation
+	FixedPoint3 camOrigin(cam.position);
+
 	// TODO: add accessor to world to get entity iterator
-	for (auto& ent : world_->entityManager.getEntities()) {
-		if (ent.model) {
-			// temp hack: draw an entity as a cube for physics demo
-			// stateBlend represents how far (time-wise) we are between the previous state and the current state.
-			// If stateBlend is in [0,1], we are interpolating between previous and current state.
-			// If stateBlend is greater than 1, we are extrapolating future state. TODO: does this actually work?
-			// Due to the way this interpolation works, we may be rendering up to a full tick behind the current state.
-			float x = ent.position.x * stateBlend + ent.prevPosition.x * (1.0f - stateBlend);
-			float y = ent.position.y * stateBlend + ent.prevPosition.y * (1.0f - stateBlend);
-			float z = ent.position.z * stateBlend + ent.prevPosition.z * (1.0f - stateBlend);
-			// x, y is the center of the entity; assume all entities are 1x1x1 for now
-			Point3f center(x, y, z);
-			// TODO: entity position should be the center
-			center.z += 0.375f;
-
-			// TODO: this should be a property of entity type
-			Vector3f halfSize(0.375f, 0.375f, 0.375f);
-
-			drawCube(entityVbo_, center, halfSize, world_->getBlockType(6));
-		}
+	for (auto& ent : world_->entityManager.getEntities(Entity::Model)) {
+		// temp hack: draw an entity as a cube for physics demo
+		// stateBlend represents how far (time-wise) we are between the previous state and the current state.
+		// If stateBlend is in [0,1], we are interpolating between previous and current state.
+		// If stateBlend is greater than 1, we are extrapolating future state. TODO: does this actually work?
+		// Due to the way this interpolation works, we may be rendering up to a full tick behind the current state.
+		auto prev = ent.prevPosition.relativeTo(camOrigin);
+		auto cur = ent.position.relativeTo(camOrigin);
+		// x, y is the center of the entity; assume all entities are 1x1x1 for now
+		Point3f center = prev + (cur - prev) * stateBlend + world_->entityManager.renderOffset(ent);
+		// TODO: entity position should be the center
+		center.z += 0.375f;
+
+		// TODO: this should be a property of entity type
+		Vector3f halfSize(0.375f, 0.375f, 0.375f);
+
+		drawCube(entityVbo_, center, halfSize, world_->getBlockType(6));
+	}
+
+	// particles are drawn as small cubes at their current positions (they keep no previous state to blend with)
+	Vector3f particleHalfSize(0.0625f, 0.0625f, 0.0625f);
+	for (uint32_t i = 0; i < world_->particles.size(); i++) {
+		drawCube(entityVbo_, world_->particles.position(i) - cam.position, particleHalfSize, world_->getBlockType(2));
 	}
 
 	entityVbo_.upload();
 
+	glLoadIdentity();
+	glMultMatrixf((translate * pitchMatrix * yawMatrix).arr);
+
 	entityVbo_.bind();
 
 	// TODO: move this stuff into Buffer class
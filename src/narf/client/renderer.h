@@ -63,7 +63,14 @@ private:
 	ChunkCoord cc_;
 	bool dirty_;
 
+	// journal sequence numbers of this chunk and its neighbors (in BlockFace order) as of the last check
+	uint64_t chunkSeq_;
+	uint64_t neighborSeq_[6];
+	std::vector<ChunkJournal::Change> changes_;
+
 	void buildVBO(World* world);
+	void recordJournalSeqs(World* world);
+	bool changed(World* world);
 };
 
 
@@ -77,13 +84,11 @@ public:
 	void render(gl::Context& context, const Camera& cam, float stateBlend);
 	void render(gl::Context& context, const Camera& cam, float stateBlend, Matrix4x4f translate);
 
-	void chunkUpdate(const ChunkCoord& cc);
-	void blockUpdate(const BlockCoord& wbc);
-
 	// debug options
 	bool wireframe;
 	bool backfaceCulling;
 	bool fog;
+	bool occlusionCulling;
 
 	BlockWrapper selectedBlockFace;
 
@@ -93,14 +98,13 @@ private:
 	gl::Context& gl;
 	gl::Texture* tilesTex_;
 	ChunkCache<ChunkCoord, ChunkVBO> vboCache_;
+	std::vector<ChunkCoord> visibleChunks_;
 	gl::Buffer<BlockVertex> entityVbo_; // TODO: for now, entities are just rendered as cubes too
 	int chunkRebuildCount_;
 	static const int chunkRebuildLimit_ = 1; // max chunk VBOs to build/upload per frame
 
 	void renderChunk(const ChunkCoord& cc);
 	ChunkVBO* getChunkVBO(const ChunkCoord& cc);
-
-	void markChunkDirty(const ChunkCoord& cc);
 };
 
 } // namespace narf
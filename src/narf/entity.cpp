@@ -34,18 +34,26 @@
 #include "narf/console.h"
 #include "narf/world.h"
 
+#include <math.h>
+#include <algorithm>
+#include <iterator>
+
 using namespace narf;
 
+// entities moving slower than this (in blocks per second) for SleepTicks updates in a row go to sleep,
+// as long as they are resting on the ground (or do not fall)
+static const float SleepSpeed = 0.05f;
+static const uint8_t SleepTicks = 30;
 
-EntityRef::EntityRef(EntityManager& entMgr, Entity::ID id) :
-	ent(entMgr.getEntityRef(id)), id(id), entMgr(entMgr) {
-}
+// corrections from snapshots of up to MaxBlendedCorrection blocks are blended in,
+// the part of each not yet shown shrinking by CorrectionDecay every update
+static const float MaxBlendedCorrection = 4.0f;
+static const float CorrectionDecay = 0.75f;
+static const float MinCorrection = 1.0f / 256.0f;
 
 
-EntityRef::~EntityRef() {
-	if (ent) {
-		entMgr.releaseEntityRef(id);
-	}
+EntityRef::EntityRef(EntityManager& entMgr, Entity::ID id) :
+	ent(entMgr.getEntity(id)), id(id) {
 }
 
 
@@ -55,19 +63,33 @@ void explode(World* world, const BlockCoord& bc, int32_t radius) {
 	air.id = 0;
 
 	auto radiusSquared = radius * radius;
+	Point3f center((float)bc.x + 0.5f, (float)bc.y + 0.5f, (float)bc.z + 0.5f);
+
+	// remove a block, throwing a piece of debris out from the center if it was actually destroyed
+	auto destroy = [&](const BlockCoord& c) {
+		if (!world->isOpaque(c)) {
+			return;
+		}
+		world->putBlock(&air, c);
+		if (!world->isOpaque(c)) {
+			Point3f p((float)c.x + 0.5f, (float)c.y + 0.5f, (float)c.z + 0.5f);
+			auto v = (p - center).normalize() * 8.0f + Vector3f(0.0f, 0.0f, 4.0f);
+			world->particles.spawn(p, v, 2.0f, ParticleSystem::Collision::Stick);
+		}
+	};
 
 	for (int32_t x = 0; x < radius; x++) {
 		for (int32_t y = 0; y < radius; y++) {
 			for (int32_t z = 0; z < radius; z++) {
 				if (x * x + y * y + z * z < radiusSquared) {
-					world->putBlock(&air, {bc.x + x, bc.y + y, bc.z + z});
-					world->putBlock(&air, {bc.x - x, bc.y + y, bc.z + z});
-					world->putBlock(&air, {bc.x + x, bc.y - y, bc.z + z});
-					world->putBlock(&air, {bc.x - x, bc.y - y, bc.z + z});
-					world->putBlock(&air, {bc.x + x, bc.y + y, bc.z - z});
-					world->putBlock(&air, {bc.x - x, bc.y + y, bc.z - z});
-					world->putBlock(&air, {bc.x + x, bc.y - y, bc.z - z});
-					world->putBlock(&air, {bc.x - x, bc.y - y, bc.z - z});
+					destroy({bc.x + x, bc.y + y, bc.z + z});
+					destroy({bc.x - x, bc.y + y, bc.z + z});
+					destroy({bc.x + x, bc.y - y, bc.z + z});
+					destroy({bc.x - x, bc.y - y, bc.z + z});
+					destroy({bc.x + x, bc.y + y, bc.z - z});
+					destroy({bc.x - x, bc.y + y, bc.z - z});
+					destroy({bc.x + x, bc.y - y, bc.z - z});
+					destroy({bc.x - x, bc.y - y, bc.z - z});
 				}
 			}
 		}
@@ -75,94 +97,77 @@ void explode(World* world, const BlockCoord& bc, int32_t radius) {
 }
 
 
-bool Entity::update(timediff dt)
-{
-	// copy previous state so we can interpolate during render
-	prevPosition = position;
+bool Entity::has(Tag tag) const {
+	assert(id != InvalidID);
+	auto i = index(id);
+	if (tag == Antigrav) {
+		return entMgr_->page(i).antigrav[i & (EntityManager::PageSize - 1)] != 0;
+	}
+	return entMgr_->tags_[tag].contains(i);
+}
+
+
+void Entity::set(Tag tag, bool value) {
+	assert(id != InvalidID);
+	auto i = index(id);
+	if (tag == Antigrav) {
+		entMgr_->page(i).antigrav[i & (EntityManager::PageSize - 1)] = value;
+		wake(); // gravity may now move it
+	} else if (value) {
+		entMgr_->tags_[tag].insert(i);
+	} else {
+		entMgr_->tags_[tag].erase(i);
+	}
+}
+
+
+bool Entity::asleep() const {
+	assert(id != InvalidID);
+	return !entMgr_->awake_.contains(index(id));
+}
+
 
+void Entity::wake() {
+	entMgr_->wake(id);
+}
+
+
+bool Entity::collide(EntityCommandBuffer& cmds)
+{
 	bool alive = true;
-	// cheesy Euler integration
-	auto acceleration = Vector3f(0.0f, 0.0f, antigrav ? 0.0f : world_->getGravity());
-
-	// TODO: once coords are converted to integers, get rid of casts of dt to double
-	velocity += acceleration * (float)dt;
-	position += velocity * (float)dt;
-
-	// TODO: entity AABB should be determined based on its model
-	// for now, make everything 0.75x0.75x0.75
-	Vector3f center(position.x, position.y, position.z + 0.375f);
-	Vector3f halfSize(0.375f, 0.375f, 0.375f);
-	AABB entAABB(center, halfSize);
-
-	// Z coord of the bottom of this entity
-	float bottomZ = position.z;
-	float prevBottomZ = prevPosition.z;
-
-	// check against all blocks that could potentially intersect
-	BlockCoord c(
-			(int32_t)(position.x - halfSize.x),
-			(int32_t)(position.y - halfSize.y),
-			(int32_t)(position.z - halfSize.z));
-
-	// size of entity aabb
-	// + 1 to round up
-	// + 1 since CoordIter iterates up to but not including
-	int32_t sx = 2 + (int32_t)(halfSize.x * 2.0f);
-	int32_t sy = 2 + (int32_t)(halfSize.y * 2.0f);
-	int32_t sz = 2 + (int32_t)(halfSize.z * 2.0f);
-
-	ZYXCoordIter<BlockCoord> iter(
-		{c.x, c.y, c.z},
-		{c.x + sx, c.y + sy, c.z + sz});
-
-	bool collided = false;
-	bool bounced = false;
-	for (const auto& bc : iter) {
-		auto block = world_->getBlock(bc);
-		if (!block) {
-			continue;
-		}
-		AABB blockAABB(world_->getBlockType(block->id)->getAABB(bc));
 
-		if (world_->getBlock(bc)->id != 0 && blockAABB.intersect(entAABB)) {
-			if (explodey) {
-				explode(world_, bc, 5);
-				alive = false;
-				explodey = false;
-				velocity.x = velocity.y = 0.0f;
-			}
+	// sweep the entity's box from where it started this tick along the movement from integration
+	auto delta = position - prevPosition;
+	AABB startAABB(prevPosition.toFloat() + Vector3f(0.0f, 0.0f, halfSize().z), halfSize());
+	SweepResult sweep;
+	world_->sweepAABBPath(startAABB, delta, onGround ? stepHeight : 0.0f, sweep);
+	position = prevPosition + sweep.movement;
+
+	if (sweep.hit[0] || sweep.hit[1] || sweep.hit[2]) {
+		if (has(Explodey)) {
+			cmds.explode(sweep.block, 5);
+			alive = false;
+			velocity.x = velocity.y = 0.0f;
+		}
 
-			if (bouncy) {
-				if (!bounced) {
-					position.z = ceilf(position.z) + (ceilf(position.z) - position.z);
-					velocity.z = -velocity.z;
-					bounced = true; // only apply bounce once...
-				}
-			} else {
-				if (bottomZ < bc.z + 1 && prevBottomZ >= bc.z + 1) {
-					// moving down
-					// and the bottom of the ent is within the block below us
-					// and the bottom of the ent was above the block below us in the previous tick
-					if (velocity.z < 0.0f) {
-						// hit a block below us while falling; zero out vertical velocity and push up
-						position.z = (float)bc.z + 1.0f;
-						velocity.z = 0.0f;
-						onGround = true;
-					}
-				} else {
-					collided = true;
+		if (has(Bouncy)) {
+			if (sweep.hit[0]) velocity.x = -velocity.x;
+			if (sweep.hit[1]) velocity.y = -velocity.y;
+			if (sweep.hit[2]) velocity.z = -velocity.z;
+		} else {
+			// slide along whatever was hit
+			if (sweep.hit[0]) velocity.x = 0.0f;
+			if (sweep.hit[1]) velocity.y = 0.0f;
+			if (sweep.hit[2]) {
+				if (delta.z < 0.0f) {
+					// landed on a block
+					onGround = true;
 				}
+				velocity.z = 0.0f;
 			}
 		}
 	}
 
-	if (collided) {
-		// for now, just teleport back to the previous position
-		// TODO: better collision resolution
-		// TODO: handle blocks above
-		position = prevPosition;
-	}
-
 	if (!almostEqual(velocity.z, 0.0f)) {
 		onGround = false;
 	}
@@ -170,146 +175,563 @@ bool Entity::update(timediff dt)
 	return alive;
 }
 
-void Entity::serialize(ByteStream& s) const {
-	// TODO this could be much more compactly encoded...
-	// do the dumbest possible encoding that works (for now)
-	s.write(position.x, LE);
-	s.write(position.y, LE);
-	s.write(position.z, LE);
-	s.write(velocity.x, LE);
-	s.write(velocity.y, LE);
-	s.write(velocity.z, LE);
-	s.write((uint8_t)model, LE);
+// everything update() depends on is sent, so a client can run the same simulation as the server
+uint32_t Entity::stateFlags() const {
+	uint32_t flags = 0;
+	for (int tag = 0; tag < NumTags; tag++) {
+		if (has((Tag)tag)) {
+			flags |= 1u << tag;
+		}
+	}
+	flags |= (uint32_t)onGround << OnGroundBit;
+	flags |= (uint32_t)asleep() << AsleepBit;
+	flags |= (uint32_t)quietTicks_ << QuietTicksShift;
+	return flags;
 }
 
-void Entity::deserialize(ByteStream& s) {
-	uint8_t tmp8;
+EntityState Entity::state() const {
+	EntityState st;
+	st.position = position.quantized();
+	st.velocity[0] = EntityState::quantizeVelocity(velocity.x);
+	st.velocity[1] = EntityState::quantizeVelocity(velocity.y);
+	st.velocity[2] = EntityState::quantizeVelocity(velocity.z);
+	st.flags = stateFlags();
+	return st;
+}
 
-	if (!s.read(&position.x, LE) ||
-		!s.read(&position.y, LE) ||
-		!s.read(&position.z, LE) ||
-		!s.read(&velocity.x, LE) ||
-		!s.read(&velocity.y, LE) ||
-		!s.read(&velocity.z, LE) ||
-		!s.read(&tmp8)) {
-		narf::console->println("entity deserialize error");
-		assert(0);
+void Entity::setState(const EntityState& st) {
+	position = st.position;
+	velocity = Vector3f(EntityState::velocityToFloat(st.velocity[0]),
+		EntityState::velocityToFloat(st.velocity[1]),
+		EntityState::velocityToFloat(st.velocity[2]));
+	for (int tag = 0; tag < NumTags; tag++) {
+		set((Tag)tag, (st.flags & (1u << tag)) != 0);
+	}
+	onGround = (st.flags & (1u << OnGroundBit)) != 0;
+	quietTicks_ = (uint8_t)(st.flags >> QuietTicksShift);
+	entMgr_->setAsleep(index(id), (st.flags & (1u << AsleepBit)) != 0);
+}
+
+
+int32_t EntityState::quantizeVelocity(float v) {
+	// clamped so that no velocity overflows the wire format
+	const float MaxSpeed = 1048576.0f;
+	return (int32_t)lrintf(std::min(std::max(v, -MaxSpeed), MaxSpeed) * (float)(1 << VelocityFracBits));
+}
+
+
+const EntityState* EntitySnapshot::find(Entity::ID id) const {
+	auto it = std::lower_bound(entities.begin(), entities.end(), id,
+		[](const std::pair<Entity::ID, EntityState>& e, Entity::ID id) { return e.first < id; });
+	return it != entities.end() && it->first == id ? &it->second : nullptr;
+}
+
+
+EntitySnapshot& SnapshotHistory::add(uint64_t tick) {
+	auto& snap = snapshots_[next_];
+	next_ = (next_ + 1) % Capacity;
+	snap.tick = tick;
+	snap.entities.clear();
+	return snap;
+}
+
+
+const EntitySnapshot* SnapshotHistory::find(uint64_t tick) const {
+	if (tick == 0) {
+		return nullptr;
+	}
+	for (auto& snap : snapshots_) {
+		if (snap.tick == tick) {
+			return &snap;
+		}
+	}
+	return nullptr;
+}
+
+
+void SnapshotHistory::clear() {
+	for (auto& snap : snapshots_) {
+		snap.tick = 0;
+		snap.entities.clear();
+	}
+	next_ = 0;
+	acked_ = 0;
+}
+
+
+const Entity::ID Entity::InvalidID;
+const uint32_t Entity::OnGroundBit;
+const uint32_t Entity::AsleepBit;
+const uint32_t Entity::QuietTicksShift;
+const uint32_t EntityManager::PageSize;
+const uint32_t EntitySlotSet::Invalid;
+const int EntityState::VelocityFracBits;
+const size_t SnapshotHistory::Capacity;
+const size_t EntityManager::ChecksumHistory;
+
+
+void EntitySlotSet::insert(uint32_t slot) {
+	if (contains(slot)) {
 		return;
 	}
-	model = tmp8;
+	if (slot >= pos_.size()) {
+		pos_.resize(slot + 1, Invalid);
+	}
+	pos_[slot] = static_cast<uint32_t>(slots_.size());
+	slots_.push_back(slot);
 }
 
 
-EntityIDAllocator::EntityIDAllocator() : firstFreeID_(0) {
+void EntitySlotSet::erase(uint32_t slot) {
+	if (!contains(slot)) {
+		return;
+	}
+	// move the last member into the hole so slots_ stays contiguous
+	auto pos = pos_[slot];
+	auto last = slots_.back();
+	slots_[pos] = last;
+	pos_[last] = pos;
+	slots_.pop_back();
+	pos_[slot] = Invalid;
 }
 
 
-EntityIDAllocator::~EntityIDAllocator() {
+void EntitySlotSet::sort() {
+	std::sort(slots_.begin(), slots_.end());
+	for (uint32_t i = 0; i < slots_.size(); i++) {
+		pos_[slots_[i]] = i;
+	}
 }
 
 
-Entity::ID EntityIDAllocator::get() {
-	Entity::ID id;
-	if (!freeIDPool_.empty()) {
-		id = freeIDPool_.back();
-		freeIDPool_.pop_back();
-		return id;
-	} else {
-		id = firstFreeID_++;
+EntityManager::Page::Page(World* world, EntityManager* entMgr) {
+	for (uint32_t i = 0; i < PageSize; i++) {
+		velocity[i] = Vector3f(0.0f, 0.0f, 0.0f);
+		antigrav[i] = 1;
+		asleep[i] = 0;
+		new (&entities[i]) Entity(world, entMgr, position[i], velocity[i], prevPosition[i]);
 	}
-	return id;
 }
 
 
-void EntityIDAllocator::put(Entity::ID id) {
-	assert(firstFreeID_ > 0);
-	if (id == firstFreeID_ - 1) {
-		--firstFreeID_;
-	} else {
-		freeIDPool_.push_back(id);
+EntityManager::Page::~Page() {
+	for (uint32_t i = 0; i < PageSize; i++) {
+		entity(i).~Entity();
 	}
 }
 
 
 EntityManager::EntityManager(World* world) :
-	world_(world), entityRefs_(0) {
+	world_(world), numSlots_(0), spatialHash_(4.0f), deterministic_(false),
+	skipUpdates_(false), desyncs_(0), lastSnapshotTick_(0) {
+	clearChecksums();
+}
+
+
+void EntityManager::addSlots(uint32_t count) {
+	for (uint32_t i = 0; i < count; i++) {
+		if ((numSlots_ & (PageSize - 1)) == 0) {
+			pages_.emplace_back(new Page(world_, this));
+		}
+		generations_.push_back(0);
+		numSlots_++;
+	}
 }
 
 
 Entity::ID EntityManager::newEntity() {
-	assert(entityRefs_ == 0);
-	if (entityRefs_ != 0) {
-		narf::console->println("!!!! ERROR: newEntity() called while an EntityRef is live");
+	// slots on the free list may have been claimed since by newEntity(id)
+	while (!freeSlots_.empty()) {
+		auto index = freeSlots_.back();
+		freeSlots_.pop_back();
+		if (slot(index).id == Entity::InvalidID) {
+			return newEntity(Entity::makeID(index, generations_[index]));
+		}
 	}
-	auto id = idAllocator_.get();
-	entities_.emplace_back(world_, this, id);
-	return id;
+	assert(numSlots_ < Entity::IndexMask);
+	return newEntity(Entity::makeID(numSlots_, 0));
 }
 
 
 Entity::ID EntityManager::newEntity(Entity::ID id) {
-	assert(entityRefs_ == 0);
-	if (entityRefs_ != 0) {
-		narf::console->println("!!!! ERROR: newEntity() called while an EntityRef is live");
+	auto index = Entity::index(id);
+	assert(index < Entity::IndexMask);
+	if (index >= numSlots_) {
+		addSlots(index + 1 - numSlots_);
 	}
 
-	entities_.emplace_back(world_, this, id);
+	auto& ent = slot(index);
+	if (ent.id != Entity::InvalidID) {
+		// the slot was reused before we heard about the old entity's deletion
+		deleteEntity(ent.id);
+	}
+
+	auto& p = page(index);
+	auto i = index & (PageSize - 1);
+	p.position[i] = p.prevPosition[i] = FixedPoint3();
+	p.velocity[i] = Vector3f(0.0f, 0.0f, 0.0f);
+	p.antigrav[i] = 0;
+	p.asleep[i] = 0;
+	ent.id = id;
+	ent.onGround = false;
+	ent.stepHeight = 0.0f;
+	ent.quietTicks_ = 0;
+
+	generations_[index] = Entity::generation(id);
+	live_.insert(index);
+	awake_.insert(index);
+	spatialHash_.update(index, p.position[i].toFloat());
 	return id;
 }
 
 
 void EntityManager::deleteEntity(Entity::ID id) {
-	assert(entityRefs_ == 0);
-	if (entityRefs_ != 0) {
-		console->println("!!!! ERROR: deleteEntity() called while an EntityRef is live");
+	auto ent = getEntity(id);
+	if (!ent) {
+		return;
 	}
 
-	for (auto entIter = std::begin(entities_); entIter != std::end(entities_); ++entIter) {
-		if (entIter->id == id) {
-			entities_.erase(entIter);
-			idAllocator_.put(id);
-			return;
+	auto index = Entity::index(id);
+	for (auto& tag : tags_) {
+		tag.erase(index);
+	}
+	live_.erase(index);
+	awake_.erase(index);
+	spatialHash_.remove(index);
+	renderOffsets_.erase(index);
+
+	// park the slot so integrate() leaves it alone
+	auto& p = page(index);
+	auto i = index & (PageSize - 1);
+	p.velocity[i] = Vector3f(0.0f, 0.0f, 0.0f);
+	p.antigrav[i] = 1;
+	p.asleep[i] = 0;
+	ent->id = Entity::InvalidID;
+
+	generations_[index] = (Entity::generation(id) + 1) & Entity::GenerationMask;
+	freeSlots_.push_back(index);
+}
+
+
+Entity* EntityManager::getEntity(Entity::ID id) {
+	auto index = Entity::index(id);
+	if (index >= numSlots_) {
+		return nullptr;
+	}
+	auto& ent = slot(index);
+	return ent.id == id ? &ent : nullptr;
+}
+
+
+EntityManager::Entities EntityManager::getEntities(Entity::Tag tag) {
+	assert(tag != Entity::Antigrav);
+	return Entities(this, tags_[tag]);
+}
+
+
+void EntityManager::integrate(timediff dt) {
+	// cheesy Euler integration
+	auto fdt = (float)dt;
+	auto dv = world_->getGravity() * fdt;
+	for (auto& p : pages_) {
+		for (uint32_t i = 0; i < PageSize; i++) {
+			// copy previous state so we can interpolate during render
+			p->prevPosition[i] = p->position[i];
+			p->velocity[i].z += (p->antigrav[i] | p->asleep[i]) ? 0.0f : dv;
+			p->position[i] += p->velocity[i] * (p->asleep[i] ? 0.0f : fdt);
 		}
 	}
 }
 
 
-Entity* EntityManager::getEntityRef(Entity::ID id) {
-	// TODO: if this gets too slow, keep a sorted index of id -> Entity
-	for (auto& ent : entities_) {
-		if (ent.id == id) {
-			entityRefs_++; // debug helper - make sure newEntity() doesn't get called while there is a live entity ref
-			return &ent;
+void EntityManager::setUpdateThreads(size_t numThreads) {
+	if (numThreads <= 1) {
+		workers_.reset();
+	} else if (!workers_ || workers_->size() != numThreads) {
+		workers_.reset(new WorkerPool(numThreads));
+	}
+}
+
+
+void EntityManager::prepareCollision() {
+	for (auto index : awake_.slots()) {
+		auto& ent = slot(index);
+		AABB startAABB(ent.prevPosition.toFloat() + Vector3f(0.0f, 0.0f, Entity::halfSize().z), Entity::halfSize());
+		world_->updateCollision(startAABB, ent.position - ent.prevPosition, ent.onGround ? ent.stepHeight : 0.0f);
+	}
+}
+
+
+void EntityManager::collide(size_t begin, size_t end, EntityCommandBuffer& cmds) {
+	auto& slots = awake_.slots();
+	for (size_t i = begin; i < end; i++) {
+		auto& ent = slot(slots[i]);
+		if (!ent.collide(cmds)) {
+			cmds.deleteEntity(ent.id);
 		}
 	}
-	return nullptr;
 }
 
 
-void EntityManager::releaseEntityRef(Entity::ID id) {
-	entityRefs_--;
+void EntityManager::apply(EntityCommandBuffer& cmds) {
+	for (const auto& explosion : cmds.explosions) {
+		explode(world_, explosion.center, explosion.radius);
+	}
+	for (const auto& set : cmds.tags) {
+		auto ent = getEntity(set.id);
+		if (ent) {
+			ent->set(set.tag, set.value);
+		}
+	}
+	for (const auto& set : cmds.velocities) {
+		auto ent = getEntity(set.id);
+		if (ent) {
+			ent->velocity = set.velocity;
+			ent->wake();
+		}
+	}
+	for (const auto& spawn : cmds.spawns) {
+		auto id = newEntity();
+		auto& ent = *getEntity(id);
+		ent.position = ent.prevPosition = spawn.position;
+		ent.velocity = spawn.velocity;
+		for (int tag = 0; tag < Entity::NumTags; tag++) {
+			if (spawn.tags & (1u << tag)) {
+				ent.set((Entity::Tag)tag);
+			}
+		}
+		positionChanged(id);
+	}
+	for (auto id : cmds.deletions) {
+		if (getEntity(id)) {
+			deleteEntity(id);
+			deleted_.push_back(id);
+		}
+	}
+	cmds.clear();
+}
+
+
+void EntityManager::flush() {
+	apply(commands_);
+	if (!deleted_.empty()) {
+		onEntitiesDeleted.emit(deleted_);
+		deleted_.clear();
+	}
 }
 
 
 void EntityManager::update(timediff dt) {
-	std::vector<Entity::ID> entsToDelete;
-	for (auto& ent : entities_) {
-		if (!ent.update(dt)) {
-			entsToDelete.push_back(ent.id);
+	// awake_ is in an order that depends on the history of sleeping and waking, and the order of the
+	// command buffers decides e.g. which IDs spawned entities get
+	if (deterministic_) {
+		awake_.sort();
+	}
+
+	for (auto it = renderOffsets_.begin(); it != renderOffsets_.end(); ) {
+		it->second = it->second * CorrectionDecay;
+		if (it->second.length() < MinCorrection) {
+			it = renderOffsets_.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	integrate(dt);
+
+	// collide entities against an unchanging world, split into contiguous ranges of awake_
+	// so that applying the command buffers in order gives the same result as a single pass
+	auto n = awake_.size();
+	prepareCollision();
+	if (workers_ && n >= ParallelMinEntities) {
+		auto numRanges = workers_->size() * 4; // a few ranges per thread to even out the load
+		commandBuffers_.resize(numRanges);
+		workers_->run(numRanges, [&](size_t range) {
+			collide(n * range / numRanges, n * (range + 1) / numRanges, commandBuffers_[range]);
+		});
+	} else {
+		commandBuffers_.resize(1);
+		collide(0, n, commandBuffers_[0]);
+	}
+
+	for (auto& ent : getAwakeEntities()) {
+		if (deterministic_) {
+			// what a client is sent, so one that has this state carries on from exactly the same point
+			ent.position = ent.position.quantized();
+			ent.velocity = EntityState::quantized(ent.velocity);
+		}
+		spatialHash_.update(Entity::index(ent.id), ent.position.toFloat());
+	}
+
+	sleepQuietEntities();
+
+	for (auto& cmds : commandBuffers_) {
+		apply(cmds);
+	}
+	flush();
+}
+
+
+void EntityManager::sleepQuietEntities() {
+	// walk backwards so erasing (which moves the last slot into the erased one) does not skip anything
+	auto& slots = awake_.slots();
+	for (size_t n = slots.size(); n-- > 0; ) {
+		auto index = slots[n];
+		auto& ent = slot(index);
+		// an airborne entity can be still for a moment (e.g. at the top of a jump), but is about to fall
+		auto supported = ent.onGround || page(index).antigrav[index & (PageSize - 1)];
+		if (!supported || ent.velocity.lengthSquared() >= SleepSpeed * SleepSpeed) {
+			ent.quietTicks_ = 0;
+		} else if (++ent.quietTicks_ >= SleepTicks) {
+			setAsleep(index, true);
+		}
+	}
+}
+
+
+void EntityManager::setAsleep(uint32_t index, bool asleep) {
+	auto& p = page(index);
+	auto i = index & (PageSize - 1);
+	if (asleep) {
+		p.velocity[i] = Vector3f(0.0f, 0.0f, 0.0f);
+		awake_.erase(index);
+	} else {
+		awake_.insert(index);
+	}
+	p.asleep[i] = asleep;
+}
+
+
+void EntityManager::wake(Entity::ID id) {
+	auto ent = getEntity(id);
+	if (!ent) {
+		return;
+	}
+	auto index = Entity::index(id);
+	ent->quietTicks_ = 0;
+	if (!awake_.contains(index)) {
+		setAsleep(index, false);
+	}
+}
+
+
+void EntityManager::wakeInBox(const Point3f& min, const Point3f& max) {
+	if (awake_.size() == live_.size()) {
+		return; // nobody is asleep
+	}
+	// positions are at the bottom of entity AABBs, so widen the box by a whole entity
+	auto r = Entity::halfSize() * 2.0f;
+	spatialHash_.forEachInBox(min - r, max + r, [&](uint32_t index) {
+		wake(slot(index).id);
+	});
+}
+
+
+void EntityManager::blockChanged(const BlockCoord& wbc) {
+	// also wake entities resting against the block, which may start to fall or slide
+	Point3f min((float)wbc.x - 1.0f, (float)wbc.y - 1.0f, (float)wbc.z - 1.0f);
+	wakeInBox(min, min + Vector3f(3.0f, 3.0f, 3.0f));
+}
+
+
+void EntityManager::chunkChanged(const ChunkCoord& cc) {
+	Vector3f size((float)world_->chunkSizeX(), (float)world_->chunkSizeY(), (float)world_->chunkSizeZ());
+	Point3f min((float)cc.x * size.x - 1.0f, (float)cc.y * size.y - 1.0f, (float)cc.z * size.z - 1.0f);
+	wakeInBox(min, min + size + Vector3f(2.0f, 2.0f, 2.0f));
+}
+
+
+void EntityManager::positionChanged(Entity::ID id) {
+	auto ent = getEntity(id);
+	if (ent) {
+		spatialHash_.update(Entity::index(id), ent->position.toFloat());
+	}
+}
+
+
+void EntityManager::findInRadius(const Point3f& center, float radius, std::vector<Entity::ID>& found) {
+	Vector3f r(radius, radius, radius);
+	spatialHash_.forEachInBox(center - r, center + r, [&](uint32_t index) {
+		auto& ent = slot(index);
+		if ((ent.position.toFloat() - center).lengthSquared() <= radius * radius) {
+			found.push_back(ent.id);
+		}
+	});
+}
+
+
+void EntityManager::findInAABB(const AABB& box, std::vector<Entity::ID>& found) {
+	// positions are at the bottom of entity AABBs, so widen the search by a whole entity
+	auto r = box.halfSize + Entity::halfSize() * 2.0f;
+	spatialHash_.forEachInBox(box.center - r, box.center + r, [&](uint32_t index) {
+		auto& ent = slot(index);
+		if (ent.getAABB().intersect(box)) {
+			found.push_back(ent.id);
+		}
+	});
+}
+
+
+void EntityManager::findNearest(const Point3f& p, size_t k, float maxRadius, std::vector<Entity::ID>& found) {
+	if (k == 0) {
+		return;
+	}
+
+	// search rings of cells moving outward from p's cell until k entities are closer than anything in the
+	// rings not searched yet; once the rings cover more cells than are occupied, look at every entity instead
+	auto center = spatialHash_.cellCoord(p);
+	auto cellSize = spatialHash_.cellSize();
+	auto maxDistSq = maxRadius * maxRadius;
+	std::vector<std::pair<float, Entity::ID>> candidates;
+	auto add = [&](uint32_t index) {
+		auto& ent = slot(index);
+		auto distSq = (ent.position.toFloat() - p).lengthSquared();
+		if (distSq <= maxDistSq) {
+			candidates.emplace_back(distSq, ent.id);
+		}
+	};
+	for (int32_t ring = 0; ; ring++) {
+		auto side = (uint64_t)(2 * ring + 1);
+		if (side * side * side > spatialHash_.numCells()) {
+			candidates.clear();
+			spatialHash_.forEach(add);
+			break;
+		}
+		spatialHash_.forEachInRing(center, ring, add);
+
+		// rings up to this one cover everything within this distance of p
+		auto covered = (float)ring * cellSize;
+		if (covered >= maxRadius) {
+			break;
+		}
+		auto coveredSq = covered * covered;
+		size_t certain = 0;
+		for (const auto& c : candidates) {
+			certain += c.first <= coveredSq ? 1 : 0;
+		}
+		if (certain >= k) {
+			break;
 		}
 	}
 
-	for (auto& eid : entsToDelete) {
-		onEntityDeleted.emit(eid);
-		deleteEntity(eid);
+	auto n = std::min(k, candidates.size());
+	std::partial_sort(candidates.begin(), candidates.begin() + (ptrdiff_t)n, candidates.end());
+	for (size_t i = 0; i < n; i++) {
+		found.push_back(candidates[i].second);
 	}
 }
 
 
-void EntityManager::serializeEntityFullUpdate(ByteStream& s, const Entity& ent) const {
-	s.write((uint8_t)UpdateType::FullUpdate);
-	s.write(ent.id, LE);
-	ent.serialize(s);
+void EntityManager::findOverlaps(std::vector<std::pair<Entity::ID, Entity::ID>>& pairs) {
+	// entities are much smaller than a cell, so overlapping entities are always in the same or adjacent cells
+	assert(Entity::halfSize().maxComponent() * 2.0f < spatialHash_.cellSize());
+	spatialHash_.forEachNearbyPair([&](uint32_t a, uint32_t b) {
+		auto& entA = slot(a);
+		auto& entB = slot(b);
+		if (entA.getAABB().intersect(entB.getAABB())) {
+			pairs.emplace_back(entA.id, entB.id);
+		}
+	});
 }
 
 
@@ -319,6 +741,382 @@ void EntityManager::serializeEntityDelete(ByteStream& s, Entity::ID id) const {
 }
 
 
+void EntityManager::serializeEntityForget(ByteStream& s, Entity::ID id, uint64_t tick) const {
+	s.write((uint8_t)UpdateType::Forgotten);
+	s.write(id, LE);
+	s.write(tick, LE);
+}
+
+
+// checksums are sums of per-entity hashes, so the order entities are visited in does not matter
+// each field is hashed explicitly rather than hashing the storage, which has padding
+static uint64_t entityHash(const Entity& ent) {
+	auto st = ent.state();
+	auto h = mix64(ent.id | (uint64_t)st.flags << 32);
+	h = mix64(h ^ (uint64_t)st.position.x);
+	h = mix64(h ^ (uint64_t)st.position.y);
+	h = mix64(h ^ (uint64_t)st.position.z);
+	h = mix64(h ^ ((uint64_t)(uint32_t)st.velocity[0] | (uint64_t)(uint32_t)st.velocity[1] << 32));
+	return mix64(h ^ (uint32_t)st.velocity[2]);
+}
+
+
+uint64_t EntityManager::checksum() {
+	uint64_t sum = 0;
+	for (auto& ent : getEntities()) {
+		sum += entityHash(ent);
+	}
+	return sum;
+}
+
+
+uint64_t EntityManager::checksum(const std::vector<Entity::ID>& ids) {
+	uint64_t sum = 0;
+	for (auto id : ids) {
+		auto ent = getEntity(id);
+		if (ent) {
+			sum += entityHash(*ent);
+		}
+	}
+	return sum;
+}
+
+
+// snapshots are made of small numbers: IDs as the difference from the previous one and fields as the difference
+// from the baseline, written as varints (7 bits per byte, low bits first) with the sign in the lowest bit
+static void writeVarint(ByteStream& s, uint64_t v) {
+	while (v >= 0x80) {
+		s.write((uint8_t)(v | 0x80));
+		v >>= 7;
+	}
+	s.write((uint8_t)v);
+}
+
+static bool readVarint(ByteStream& s, uint64_t& v) {
+	v = 0;
+	uint8_t b;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (!s.read(&b)) {
+			return false;
+		}
+		v |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+static int64_t& axis(FixedPoint3& p, int i) { return i == 0 ? p.x : i == 1 ? p.y : p.z; }
+static int64_t axis(const FixedPoint3& p, int i) { return i == 0 ? p.x : i == 1 ? p.y : p.z; }
+
+// a mask byte with a bit for each field that changed (position x, y, z, velocity x, y, z, flags), then those fields
+static const int PositionShift = FixedPoint3::FracBits - FixedPoint3::WireFracBits;
+static const uint8_t FlagsChanged = 1 << 6;
+
+static void writeStateDelta(ByteStream& s, const EntityState& from, const EntityState& to) {
+	uint8_t mask = 0;
+	for (int i = 0; i < 3; i++) {
+		if (axis(to.position, i) != axis(from.position, i)) {
+			mask |= (uint8_t)(1 << i);
+		}
+		if (to.velocity[i] != from.velocity[i]) {
+			mask |= (uint8_t)(8 << i);
+		}
+	}
+	if (to.flags != from.flags) {
+		mask |= FlagsChanged;
+	}
+	s.write(mask);
+	for (int i = 0; i < 3; i++) {
+		if (mask & (1 << i)) {
+			writeVarint(s, zigzag((int64_t)((uint64_t)axis(to.position, i) - (uint64_t)axis(from.position, i)) >> PositionShift));
+		}
+	}
+	for (int i = 0; i < 3; i++) {
+		if (mask & (8 << i)) {
+			writeVarint(s, zigzag((int64_t)to.velocity[i] - from.velocity[i]));
+		}
+	}
+	if (mask & FlagsChanged) {
+		writeVarint(s, to.flags);
+	}
+}
+
+static bool readStateDelta(ByteStream& s, const EntityState& from, EntityState& to) {
+	uint8_t mask;
+	uint64_t v;
+	if (!s.read(&mask) || (mask & 0x80)) {
+		return false;
+	}
+	to = from;
+	for (int i = 0; i < 3; i++) {
+		if (mask & (1 << i)) {
+			if (!readVarint(s, v)) {
+				return false;
+			}
+			axis(to.position, i) += (int64_t)((uint64_t)unzigzag(v) << PositionShift);
+		}
+	}
+	for (int i = 0; i < 3; i++) {
+		if (mask & (8 << i)) {
+			if (!readVarint(s, v)) {
+				return false;
+			}
+			to.velocity[i] = (int32_t)(from.velocity[i] + unzigzag(v));
+		}
+	}
+	if (mask & FlagsChanged) {
+		if (!readVarint(s, v)) {
+			return false;
+		}
+		to.flags = (uint32_t)v;
+	}
+	return true;
+}
+
+static bool idLess(const std::pair<Entity::ID, EntityState>& a, const std::pair<Entity::ID, EntityState>& b) {
+	return a.first < b.first;
+}
+
+
+void EntityManager::serializeSnapshot(ByteStream& s, const EntitySnapshot* baseline, EntitySnapshot& snap,
+	const std::vector<Entity::ID>& kept, const std::vector<Entity::ID>& send, uint64_t sum) {
+	s.write((uint8_t)UpdateType::Snapshot);
+	s.write(snap.tick, LE);
+	writeVarint(s, baseline ? snap.tick - baseline->tick : 0);
+	s.write(sum, LE);
+
+	// the snapshot that brought a kept entity, or the state it fell asleep in, may have been lost, and neither
+	// is sent again by the interest set: send those until the receiver has acknowledged them
+	resend_.clear();
+	for (auto id : kept) {
+		if (std::binary_search(send.begin(), send.end(), id)) {
+			continue;
+		}
+		auto base = baseline ? baseline->find(id) : nullptr;
+		auto ent = getEntity(id);
+		assert(ent != nullptr);
+		if (!base || (ent->asleep() && !(*base == ent->state()))) {
+			resend_.push_back(id);
+		}
+	}
+	sending_.clear();
+	std::merge(send.begin(), send.end(), resend_.begin(), resend_.end(), std::back_inserter(sending_));
+
+	// entities the receiver forgot are dropped from its copy of the baseline; the rest is carried over
+	removed_.clear();
+	if (baseline) {
+		for (const auto& e : baseline->entities) {
+			if (std::binary_search(sending_.begin(), sending_.end(), e.first)) {
+				continue;
+			}
+			if (std::binary_search(kept.begin(), kept.end(), e.first)) {
+				snap.entities.push_back(e);
+			} else {
+				removed_.push_back(e.first);
+			}
+		}
+	}
+	writeVarint(s, removed_.size());
+	Entity::ID prev = 0;
+	for (auto id : removed_) {
+		writeVarint(s, id - prev);
+		prev = id;
+	}
+
+	const EntityState none;
+	auto carried = snap.entities.size();
+	writeVarint(s, sending_.size());
+	prev = 0;
+	for (auto id : sending_) {
+		auto ent = getEntity(id);
+		assert(ent != nullptr);
+		auto st = ent->state();
+		auto base = baseline ? baseline->find(id) : nullptr;
+		writeVarint(s, id - prev);
+		prev = id;
+		writeStateDelta(s, base ? *base : none, st);
+		snap.entities.emplace_back(id, st);
+	}
+	std::inplace_merge(snap.entities.begin(), snap.entities.begin() + (ptrdiff_t)carried, snap.entities.end(), idLess);
+}
+
+
+void EntityManager::deserializeSnapshot(ByteStream& s) {
+	uint64_t tick, back, sum, count, delta;
+	if (!s.read(&tick, LE) || !readVarint(s, back) || !s.read(&sum, LE) || back >= tick) {
+		narf::console->println("snapshot deserialize error");
+		assert(0);
+		return;
+	}
+	if (tick <= lastSnapshotTick_) {
+		return; // overtaken by a newer one
+	}
+
+	// the sender only uses snapshots newer than the one add() replaces, as it keeps as many as this end
+	const EntitySnapshot* baseline = back != 0 ? received_.find(tick - back) : nullptr;
+	auto& snap = received_.add(tick);
+	if (back != 0 && (!baseline || baseline == &snap)) {
+		narf::console->println("snapshot baseline " + std::to_string(tick - back) + " missing");
+		assert(0);
+		return;
+	}
+
+	// the first snapshot starts the receiver's clock, and so does one it has fallen too far behind to compare
+	auto now = world_->tick();
+	if (lastSnapshotTick_ == 0 || tick > now + ChecksumHistory) {
+		world_->setTick(tick);
+		clearChecksums();
+		now = tick;
+	}
+	lastSnapshotTick_ = tick;
+	for (auto it = forgotten_.begin(); it != forgotten_.end(); ) {
+		if (it->second < tick) {
+			it = forgotten_.erase(it); // every snapshot still to come is newer
+		} else {
+			++it;
+		}
+	}
+	// only a checksum of the same tick is comparable; without one, the states are applied as if it did not match
+	auto& recorded = checksums_[tick % ChecksumHistory];
+	if (tick == now || recorded.first == tick) {
+		skipUpdates_ = sum == (tick == now ? checksum() : recorded.second);
+		if (!skipUpdates_) {
+			desyncs_++;
+		}
+	} else {
+		skipUpdates_ = false;
+	}
+
+	// every ID takes at least a byte, so a count larger than the rest of the message is an error
+	removed_.clear();
+	Entity::ID id = 0;
+	if (!readVarint(s, count) || count > s.bytesLeft()) {
+		narf::console->println("snapshot deserialize error");
+		assert(0);
+		return;
+	}
+	for (uint64_t i = 0; i < count; i++) {
+		if (!readVarint(s, delta) || (i > 0 && delta == 0) || delta > Entity::InvalidID - id) {
+			narf::console->println("snapshot deserialize error");
+			assert(0);
+			return;
+		}
+		id += (Entity::ID)delta;
+		removed_.push_back(id);
+	}
+
+	const EntityState none;
+	changed_.clear();
+	id = 0;
+	if (!readVarint(s, count) || count > s.bytesLeft()) {
+		narf::console->println("snapshot deserialize error");
+		assert(0);
+		return;
+	}
+	for (uint64_t i = 0; i < count; i++) {
+		EntityState st;
+		if (!readVarint(s, delta) || (i > 0 && delta == 0) || delta > Entity::InvalidID - id) {
+			narf::console->println("snapshot deserialize error");
+			assert(0);
+			return;
+		}
+		id += (Entity::ID)delta;
+		auto base = baseline ? baseline->find(id) : nullptr;
+		if (Entity::index(id) >= Entity::IndexMask || !readStateDelta(s, base ? *base : none, st)) {
+			narf::console->println("snapshot entity " + std::to_string(id) + " deserialize error");
+			assert(0);
+			return;
+		}
+		changed_.emplace_back(id, st);
+	}
+
+	// same as the sender's copy: the baseline without the removed and changed entities, plus the changed ones
+	if (baseline) {
+		for (const auto& e : baseline->entities) {
+			if (!std::binary_search(removed_.begin(), removed_.end(), e.first) &&
+				!std::binary_search(changed_.begin(), changed_.end(), e, idLess)) {
+				snap.entities.push_back(e);
+			}
+		}
+	}
+	auto carried = snap.entities.size();
+	snap.entities.insert(snap.entities.end(), changed_.begin(), changed_.end());
+	std::inplace_merge(snap.entities.begin(), snap.entities.begin() + (ptrdiff_t)carried, snap.entities.end(), idLess);
+
+	auto applied = false;
+	for (const auto& c : changed_) {
+		auto ent = getEntity(c.first);
+		if (ent && skipUpdates_) {
+			continue;
+		}
+		applied = true;
+		if (ent) {
+			// draw the entity where it was and let the offset shrink, unless it is so far off that it should just jump
+			auto index = Entity::index(c.first);
+			auto offset = renderOffset(*ent) + (ent->position - c.second.position);
+			if (offset.length() > MaxBlendedCorrection) {
+				renderOffsets_.erase(index);
+			} else {
+				renderOffsets_[index] = offset;
+			}
+		} else {
+			// sent before the entity was deleted or forgotten, and arrived after
+			if (deletedID(c.first) || forgotten_.count(c.first)) {
+				continue;
+			}
+			narf::console->println("new ent ID " + std::to_string(c.first));
+			newEntity(c.first);
+			ent = getEntity(c.first);
+			assert(ent != nullptr);
+			if (!ent) {
+				return;
+			}
+		}
+		ent->setState(c.second);
+		positionChanged(c.first);
+	}
+	if (applied) {
+		clearChecksums();
+	}
+}
+
+
+void EntityManager::recordChecksum(uint64_t tick) {
+	if (lastSnapshotTick_ != 0) {
+		checksums_[tick % ChecksumHistory] = std::make_pair(tick, checksum());
+	}
+}
+
+
+void EntityManager::clearChecksums() {
+	for (auto& c : checksums_) {
+		c = std::make_pair(0, 0);
+	}
+}
+
+
+Vector3f EntityManager::renderOffset(const Entity& ent) const {
+	auto it = renderOffsets_.find(Entity::index(ent.id));
+	return it != renderOffsets_.end() ? it->second : Vector3f(0.0f, 0.0f, 0.0f);
+}
+
+
+bool EntityManager::deletedID(Entity::ID id) const {
+	auto index = Entity::index(id);
+	if (index >= numSlots_) {
+		return false;
+	}
+	// generations wrap around, so the one in the slot is newer if it is less than half the range ahead
+	auto ahead = (generations_[index] - Entity::generation(id)) & Entity::GenerationMask;
+	return ahead != 0 && ahead <= Entity::GenerationMask / 2;
+}
+
+
 void EntityManager::deserializeEntityUpdate(ByteStream& s) {
 	Entity::ID id;
 	uint8_t tmp8;
@@ -329,38 +1127,64 @@ void EntityManager::deserializeEntityUpdate(ByteStream& s) {
 		return;
 	}
 
-	// for now, all update types have ID next
+	if ((UpdateType)tmp8 == UpdateType::Snapshot) {
+		deserializeSnapshot(s);
+		return;
+	}
+
+	// all other update types have ID next
 	if (!s.read(&id, LE)) {
 		narf::console->println("entity ID deserialize error");
 		assert(0);
 		return;
 	}
 
+	if (Entity::index(id) >= Entity::IndexMask) {
+		narf::console->println("entity ID " + std::to_string(id) + " out of range");
+		assert(0);
+		return;
+	}
+
 	switch ((UpdateType)tmp8) {
-	case UpdateType::FullUpdate:
-		{
-			auto ent = getEntityRef(id);
-			if (!ent) {
-				narf::console->println("new ent ID " + std::to_string(id));
-				newEntity(id);
-				ent = getEntityRef(id);
-				assert(ent != nullptr);
-				if (!ent) {
-					return;
-				}
+	case UpdateType::Deleted:
+		narf::console->println("delete ent ID " + std::to_string(id));
+		if (getEntity(id)) {
+			deleteEntity(id);
+			clearChecksums();
+		} else if (!deletedID(id)) {
+			// deleted before the snapshot that creates it arrived; remember it so that snapshot is ignored
+			if (Entity::index(id) >= numSlots_) {
+				addSlots(Entity::index(id) + 1 - numSlots_);
 			}
+			generations_[Entity::index(id)] = (Entity::generation(id) + 1) & Entity::GenerationMask;
+		}
+		break;
 
-			ent->deserialize(s);
-			releaseEntityRef(id);
-
+	case UpdateType::Forgotten:
+		{
+			uint64_t tick;
+			if (!s.read(&tick, LE)) {
+				narf::console->println("entity forget deserialize error");
+				assert(0);
+				return;
+			}
+			// a newer snapshot that has the entity already brought it back
+			auto latest = received_.find(lastSnapshotTick_);
+			if (tick < lastSnapshotTick_ && latest && latest->find(id)) {
+				break;
+			}
+			if (getEntity(id)) {
+				deleteEntity(id);
+				// the entity still exists on the sender, so its ID stays valid
+				generations_[Entity::index(id)] = Entity::generation(id);
+				clearChecksums();
+			}
+			if (tick > lastSnapshotTick_) {
+				forgotten_[id] = tick;
+			}
 			break;
 		}
 
-	case UpdateType::Deleted:
-		narf::console->println("delete ent ID " + std::to_string(id));
-		deleteEntity(id);
-		break;
-
 	default:
 		narf::console->println("unknown entity update type " + std::to_string(tmp8));
 		assert(0);
@@ -33,117 +33,501 @@
 #ifndef NARF_ENTITY_H
 #define NARF_ENTITY_H
 
+#include "narf/aabb.h"
+#include "narf/block.h"
 #include "narf/bytestream.h"
+#include "narf/chunk.h"
 #include "narf/signal.h"
+#include "narf/spatialhash.h"
+#include "narf/workerpool.h"
 #include "narf/time.h"
+#include "narf/math/fixed.h"
 #include "narf/math/vector.h"
 
+#include <algorithm>
+#include <initializer_list>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
 namespace narf {
 
 class World;
 class EntityManager;
+class EntityCommandBuffer;
+
+// the state of an entity that is sent to clients, at the precision it is sent with
+struct EntityState {
+	static const int VelocityFracBits = 10; // velocity is sent in 1/1024ths of a block per second
+
+	FixedPoint3 position; // FixedPoint3::quantized()
+	int32_t velocity[3];
+	uint32_t flags; // Entity::stateFlags()
+
+	EntityState() : velocity{0, 0, 0}, flags(0) { }
+
+	static int32_t quantizeVelocity(float v);
+	static float velocityToFloat(int32_t v) { return (float)v * (1.0f / (1 << VelocityFracBits)); }
+
+	// velocity rounded to the precision it is sent with
+	static Vector3f quantized(const Vector3f& v)
+	{
+		return Vector3f(velocityToFloat(quantizeVelocity(v.x)), velocityToFloat(quantizeVelocity(v.y)), velocityToFloat(quantizeVelocity(v.z)));
+	}
+
+	bool operator==(const EntityState& rhs) const
+	{
+		return position == rhs.position && velocity[0] == rhs.velocity[0] && velocity[1] == rhs.velocity[1] &&
+			velocity[2] == rhs.velocity[2] && flags == rhs.flags;
+	}
+};
 
 class Entity {
+friend class EntityManager;
 public:
 
+	// IDs are generational handles: the low IndexBits bits select a storage slot and the rest
+	// count how many times that slot has been reused, so an ID of a deleted entity never matches a newer one
 	typedef uint32_t ID;
 	static const ID InvalidID = UINT32_MAX;
 
-	Entity(World* world, EntityManager* entMgr, ID id) : id(id), bouncy(false), explodey(false), model(false), onGround(false), antigrav(false), world_(world), entMgr_(entMgr) { }
+	static const uint32_t IndexBits = 20;
+	static const uint32_t IndexMask = (1u << IndexBits) - 1;
+	static const uint32_t GenerationMask = UINT32_MAX >> IndexBits;
+
+	static uint32_t index(ID id) { return id & IndexMask; }
+	static uint32_t generation(ID id) { return id >> IndexBits; }
+	static ID makeID(uint32_t index, uint32_t generation) { return (generation << IndexBits) | index; }
+
+	// optional per-entity properties (see has() and set())
+	enum Tag {
+		Bouncy,
+		Explodey,
+		Model, // TODO: replace with 3d model object; for now, indicates whether to draw a cube
+		Antigrav, // magic!
+		NumTags
+	};
 
 	ID id;
 
-	Point3f position;
-	Vector3f velocity;
+	// these refer to the structure-of-arrays storage in EntityManager
+	FixedPoint3& position;
+	Vector3f& velocity;
+	FixedPoint3& prevPosition; // TODO: put all state into prev and cur structs
 
-	Point3f prevPosition; // TODO: put all state into prev and cur structs
-
-	// temp hack stuff
-	bool bouncy;
-	bool explodey;
-	bool model; // TODO: replace with 3d model object; for now, indicates whether to draw a cube
 	bool onGround; // on solid ground, i.e. can jump
-	bool antigrav; // magic!
+	float stepHeight; // highest obstacle the entity climbs automatically while walking on the ground
+
+	bool has(Tag tag) const;
+	void set(Tag tag, bool value = true);
 
+	// entities that stay nearly still go to sleep and are skipped by EntityManager::update() until woken,
+	// either explicitly or by a block changing next to them
+	// call wake() after setting the velocity or position of an entity from outside the update
+	bool asleep() const;
+	void wake();
+
+	// TODO: entity AABB should be determined based on its model
+	// for now, make everything 0.75x0.75x0.75, standing on position
+	static Vector3f halfSize() { return Vector3f(0.375f, 0.375f, 0.375f); }
+	AABB getAABB() const { return AABB(position.toFloat() + Vector3f(0.0f, 0.0f, 0.375f), halfSize()); }
+
+	// resolve collisions with the world along the entity's movement from prevPosition to position
+	// changes to the world are recorded in cmds rather than made directly
 	// return true if object is still alive or false if it should be deleted
-	bool update(timediff dt);
+	bool collide(EntityCommandBuffer& cmds);
+
+	// tags, onGround, sleep state and the sleep timer, as sent in EntityState::flags
+	uint32_t stateFlags() const;
 
-	void serialize(ByteStream& s) const;
-	void deserialize(ByteStream& s);
+	EntityState state() const;
+	void setState(const EntityState& state);
+
+	// no copying; entities only exist in EntityManager storage
+	Entity(const Entity&) = delete;
+	Entity& operator=(const Entity&) = delete;
 
 private:
+	// bits of stateFlags() after the one for each Tag
+	static const uint32_t OnGroundBit = NumTags;
+	static const uint32_t AsleepBit = NumTags + 1;
+	static const uint32_t QuietTicksShift = 8;
+
+	Entity(World* world, EntityManager* entMgr, FixedPoint3& position, Vector3f& velocity, FixedPoint3& prevPosition) :
+		id(InvalidID), position(position), velocity(velocity), prevPosition(prevPosition), onGround(false), stepHeight(0.0f),
+		world_(world), entMgr_(entMgr), quietTicks_(0) { }
+
 	World* world_;
 	EntityManager* entMgr_;
+	uint8_t quietTicks_; // consecutive updates spent moving slower than the sleep threshold
 };
 
 
+// changes requested while entities are being iterated over, applied later in one pass
+// so that every entity sees the same world no matter how the pass is split across threads
+// buffers are reused from tick to tick, so recording does not allocate once they have grown
+class EntityCommandBuffer {
+public:
+	struct Explosion {
+		BlockCoord center;
+		int32_t radius;
+	};
+
+	struct Spawn {
+		FixedPoint3 position;
+		Vector3f velocity;
+		uint32_t tags; // bit (1 << tag) for each Entity::Tag to set
+	};
+
+	struct SetTag {
+		Entity::ID id;
+		Entity::Tag tag;
+		bool value;
+	};
+
+	struct SetVelocity {
+		Entity::ID id;
+		Vector3f velocity;
+	};
+
+	void explode(const BlockCoord& center, int32_t radius) { explosions.push_back({center, radius}); }
+	void deleteEntity(Entity::ID id) { deletions.push_back(id); }
+	void set(Entity::ID id, Entity::Tag tag, bool value = true) { tags.push_back({id, tag, value}); }
+	void setVelocity(Entity::ID id, const Vector3f& velocity) { velocities.push_back({id, velocity}); }
+
+	void spawn(const FixedPoint3& position, const Vector3f& velocity, std::initializer_list<Entity::Tag> tags = {})
+	{
+		uint32_t bits = 0;
+		for (auto tag : tags) {
+			bits |= 1u << tag;
+		}
+		spawns.push_back({position, velocity, bits});
+	}
+
+	bool empty() const
+	{
+		return explosions.empty() && spawns.empty() && tags.empty() && velocities.empty() && deletions.empty();
+	}
+
+	void clear()
+	{
+		explosions.clear();
+		spawns.clear();
+		tags.clear();
+		velocities.clear();
+		deletions.clear();
+	}
+
+	// applied in this order: explosions, tags, velocities, spawns, deletions
+	std::vector<Explosion> explosions;
+	std::vector<Spawn> spawns;
+	std::vector<SetTag> tags;
+	std::vector<SetVelocity> velocities;
+	std::vector<Entity::ID> deletions;
+};
+
+
+// pointer to an entity looked up by ID
+// entities never move in memory, so this stays safe to use while other entities are created and deleted
 class EntityRef {
 public:
 	EntityRef(EntityManager& entMgr, Entity::ID id);
-	~EntityRef();
 
 	Entity* ent;
 	Entity::ID id;
-	EntityManager& entMgr;
 
 	Entity* operator ->() { return ent; }
 
-	// no copying
-	EntityRef(const EntityRef&) = delete;
-	EntityRef& operator=(const EntityRef&) = delete;
+	// false if the entity did not exist or has been deleted since the lookup
+	bool valid() const { return ent && ent->id == id; }
 };
 
 
-class EntityIDAllocator {
+// set of entity slots with constant time insert, erase and membership test, and dense iteration
+class EntitySlotSet {
 public:
-	EntityIDAllocator();
-	~EntityIDAllocator();
+	bool contains(uint32_t slot) const { return slot < pos_.size() && pos_[slot] != Invalid; }
+	void insert(uint32_t slot);
+	void erase(uint32_t slot);
+
+	size_t size() const { return slots_.size(); }
+	const std::vector<uint32_t>& slots() const { return slots_; }
 
-	Entity::ID get();
-	void put(Entity::ID id);
+	// put the members in increasing slot order
+	void sort();
 
 private:
-	Entity::ID firstFreeID_;
-	std::vector<Entity::ID> freeIDPool_;
+	static const uint32_t Invalid = UINT32_MAX;
+	std::vector<uint32_t> slots_; // members, in no particular order
+	std::vector<uint32_t> pos_; // slot -> index in slots_
+};
+
+
+// the states of the entities one receiver knows about as of one tick
+struct EntitySnapshot {
+	uint64_t tick;
+	std::vector<std::pair<Entity::ID, EntityState>> entities; // sorted by ID
+
+	EntitySnapshot() : tick(0) { }
+
+	// nullptr if the entity is not in the snapshot
+	const EntityState* find(Entity::ID id) const;
+};
+
+
+// the last few snapshots sent to or received from the other end of a connection,
+// so entity updates can be sent as changes from a snapshot both ends have
+class SnapshotHistory {
+public:
+	static const size_t Capacity = 32;
+
+	SnapshotHistory() : next_(0), acked_(0) { }
+
+	// start a new, empty snapshot, replacing the oldest one once Capacity are kept
+	EntitySnapshot& add(uint64_t tick);
+
+	// nullptr if there is no snapshot of that tick (any more)
+	const EntitySnapshot* find(uint64_t tick) const;
+
+	// sender: newest tick the receiver acknowledged, i.e. the snapshot to send changes from
+	void ack(uint64_t tick) { acked_ = std::max(acked_, tick); }
+	uint64_t acked() const { return acked_; }
+
+	void clear();
+
+private:
+	EntitySnapshot snapshots_[Capacity]; // tick 0 if unused
+	size_t next_;
+	uint64_t acked_;
 };
 
 
 class EntityManager {
+friend class Entity;
 public:
 	EntityManager(World* world);
 
-	Entity* getEntityRef(Entity::ID id);
-	void releaseEntityRef(Entity::ID id);
+	// returns nullptr if there is no live entity with this ID
+	Entity* getEntity(Entity::ID id);
 
 	Entity::ID newEntity();
 	void deleteEntity(Entity::ID id);
 
-	size_t getNumEntities() const { return entities_.size(); }
+	size_t getNumEntities() const { return live_.size(); }
+
+	// iteration over a set of entities, in no particular order
+	class Iterator {
+	public:
+		Iterator(EntityManager* entMgr, const uint32_t* slot) : entMgr_(entMgr), slot_(slot) {}
+		Entity& operator*() const { return entMgr_->slot(*slot_); }
+		Iterator& operator++() { slot_++; return *this; }
+		bool operator!=(const Iterator& other) const { return slot_ != other.slot_; }
+	private:
+		EntityManager* entMgr_;
+		const uint32_t* slot_;
+	};
+
+	class Entities {
+	public:
+		Entities(EntityManager* entMgr, const EntitySlotSet& set) : entMgr_(entMgr), set_(set) {}
+		Iterator begin() const { return Iterator(entMgr_, set_.slots().data()); }
+		Iterator end() const { return Iterator(entMgr_, set_.slots().data() + set_.size()); }
+	private:
+		EntityManager* entMgr_;
+		const EntitySlotSet& set_;
+	};
 
 	// TODO: this shouldn't be public
-	const std::vector<Entity>& getEntities() const { return entities_; }
+	Entities getEntities() { return Entities(this, live_); }
+
+	// all entities that have the given tag
+	Entities getEntities(Entity::Tag tag);
+
+	// entities that are not asleep, i.e. that may have changed during the last update()
+	Entities getAwakeEntities() { return Entities(this, awake_); }
+
+	// wake one entity, or every sleeping entity that could be affected by a change to a block or a whole chunk
+	void wake(Entity::ID id);
+	void blockChanged(const BlockCoord& wbc);
+	void chunkChanged(const ChunkCoord& cc);
 
 	void update(timediff dt);
-	void update(Entity::ID entID, double t, double dt);
+
+	// changes to make at the next sync point: the end of the next update(), or flush()
+	// use this instead of creating or deleting entities while iterating over them
+	EntityCommandBuffer& commands() { return commands_; }
+	void flush();
+
+	// number of threads used by update() when there are many entities (1 = update on the calling thread only)
+	// results do not depend on the number of threads
+	void setUpdateThreads(size_t numThreads);
+
+	// in deterministic mode, update() visits entities in slot order and rounds their positions and velocities to the
+	// precision they are sent with, so managers that start from the same state and are updated with the same dt stay
+	// identical (on the client, the state received from the server)
+	void setDeterministic(bool deterministic) { deterministic_ = deterministic; }
+	bool deterministic() const { return deterministic_; }
+
+	// hash of the state sent to clients: IDs and EntityState
+	// the same for the same set of entities no matter what order they were created in
+	uint64_t checksum();
+
+	// checksum() of just the given entities (IDs of deleted entities are skipped), e.g. the ones a client knows about
+	uint64_t checksum(const std::vector<Entity::ID>& ids);
+
+	// spatial queries, using entity positions as of the last update() or positionChanged()
+	// found entities are appended to found
+	void findInRadius(const Point3f& center, float radius, std::vector<Entity::ID>& found);
+	void findInAABB(const AABB& box, std::vector<Entity::ID>& found);
+
+	// the (at most) k entities closest to p and no further than maxRadius, nearest first
+	void findNearest(const Point3f& p, size_t k, float maxRadius, std::vector<Entity::ID>& found);
+
+	// all pairs of entities whose AABBs overlap
+	void findOverlaps(std::vector<std::pair<Entity::ID, Entity::ID>>& pairs);
+
+	// make an entity's position visible to the spatial queries before the next update()
+	void positionChanged(Entity::ID id);
 
 	void deserializeEntityUpdate(ByteStream& s);
-	void serializeEntityFullUpdate(ByteStream& s, const Entity& ent) const;
 	void serializeEntityDelete(ByteStream& s, Entity::ID id) const;
 
-	Signal<void(Entity::ID id)> onEntityDeleted;
+	// the receiver drops its copy of an entity that still exists but is no longer sent to it (e.g. it left its
+	// interest set) as of the given tick; unlike a deleted one, it comes back with the next snapshot that has it
+	void serializeEntityForget(ByteStream& s, Entity::ID id, uint64_t tick) const;
+
+	// the entities the receiver knows about as of snap.tick (kept and send, both sorted by ID), as changes from
+	// baseline, a snapshot it has acknowledged (nullptr if none): entities in send are written as the fields that
+	// differ from their state in baseline (all of them if they are not in it), the rest of baseline is carried over
+	// and entities in neither list are dropped; kept entities missing from baseline, and sleeping ones whose state
+	// differs from it, are written as if they were in send, so a lost snapshot cannot leave the receiver without
+	// them while the interest set waits for them to change; the resulting snapshot is stored in snap, which is new from
+	// SnapshotHistory::add() (called before looking up baseline, so it cannot replace it)
+	// sum is the checksum() of kept: if it matches the receiver's checksum() as of the same tick (see
+	// recordChecksum()), the states in the snapshot would not change anything and are not applied (new entities
+	// are still created); a mismatch is counted as a desync and the states are applied, and so are the states
+	// of a snapshot whose tick the receiver has no checksum for
+	void serializeSnapshot(ByteStream& s, const EntitySnapshot* baseline, EntitySnapshot& snap,
+		const std::vector<Entity::ID>& kept, const std::vector<Entity::ID>& send, uint64_t sum);
+	uint64_t desyncs() const { return desyncs_; }
+
+	// receiver: remember checksum() as of the given world tick, to compare snapshots of that tick with when they
+	// arrive late; called by World::update(), and does nothing until a snapshot has been received
+	// the first snapshot sets the world tick, so the receiver counts ticks the same way as the sender
+	void recordChecksum(uint64_t tick);
+
+	// tick of the last snapshot received, to acknowledge to the sender
+	// snapshots may be lost or arrive out of order: older ones than this are ignored
+	uint64_t lastSnapshotTick() const { return lastSnapshotTick_; }
+
+	// receiver: where to draw an entity relative to its position, so a correction from a snapshot is blended in
+	// over a few updates instead of making the entity jump
+	Vector3f renderOffset(const Entity& ent) const;
+
+	// emitted once per sync point with every entity deleted by command buffers since the last one
+	Signal<void(const std::vector<Entity::ID>& ids)> onEntitiesDeleted;
 
 private:
 	World* world_;
-	EntityIDAllocator idAllocator_;
-	uint32_t entityRefs_;
-	std::vector<narf::Entity> entities_;
+
+	// entities are stored in fixed-size pages that are never reallocated, indexed by Entity::index(id)
+	// the state touched every tick is kept in structure-of-arrays form so update() streams through it
+	// unused slots hold an Entity with id == InvalidID
+	static const uint32_t PageShift = 8;
+	static const uint32_t PageSize = 1 << PageShift;
+
+	// unused slots are left with zero velocity and antigrav set, so integrate() can run over whole pages
+	struct Page {
+		Page(World* world, EntityManager* entMgr);
+		~Page();
+
+		FixedPoint3 position[PageSize];
+		Vector3f velocity[PageSize];
+		FixedPoint3 prevPosition[PageSize];
+		uint8_t antigrav[PageSize]; // read by every integration step, so not a sparse tag
+		uint8_t asleep[PageSize]; // sleeping entities are not moved by integration
+
+		// Entity objects hold references into the arrays above, so they are constructed in place
+		typename std::aligned_storage<sizeof(Entity), alignof(Entity)>::type entities[PageSize];
+
+		Entity& entity(uint32_t i) { return *reinterpret_cast<Entity*>(&entities[i]); }
+	};
+
+	std::vector<std::unique_ptr<Page>> pages_;
+	uint32_t numSlots_;
+
+	std::vector<uint32_t> generations_; // generation to use for the next entity in each slot
+	std::vector<uint32_t> freeSlots_;
+
+	EntitySlotSet live_;
+	EntitySlotSet awake_; // live entities that are not asleep; only these are updated
+	EntitySlotSet tags_[Entity::NumTags]; // Antigrav is kept in Page instead
+
+	SpatialHash spatialHash_; // live entity slots by position
+
+	Page& page(uint32_t index) { return *pages_[index >> PageShift]; }
+	Entity& slot(uint32_t index) { return page(index).entity(index & (PageSize - 1)); }
+	void addSlots(uint32_t count);
+
+	// parallel update state
+	static const size_t ParallelMinEntities = 1024; // below this, threads cost more than they save
+	std::unique_ptr<WorkerPool> workers_;
+	std::vector<EntityCommandBuffer> commandBuffers_; // one per range of entities
+
+	EntityCommandBuffer commands_;
+	std::vector<Entity::ID> deleted_; // deleted since the last onEntitiesDeleted
+
+	bool deterministic_;
+
+	// received snapshot state
+	SnapshotHistory received_;
+	bool skipUpdates_; // the last checksum matched, so updates of known entities are redundant
+	uint64_t desyncs_;
+	uint64_t lastSnapshotTick_;
+	static const size_t ChecksumHistory = 64;
+	std::pair<uint64_t, uint64_t> checksums_[ChecksumHistory]; // (tick, checksum()) by tick % ChecksumHistory
+	std::vector<Entity::ID> removed_; // scratch for serializeSnapshot() and deserializeSnapshot()
+	std::vector<Entity::ID> resend_, sending_; // scratch for serializeSnapshot()
+	std::vector<std::pair<Entity::ID, EntityState>> changed_;
+	std::unordered_map<uint32_t, Vector3f> renderOffsets_; // by slot, while a correction is being blended in
+	std::unordered_map<Entity::ID, uint64_t> forgotten_; // tick each entity was forgotten at, while older snapshots can arrive
+
+	void deserializeSnapshot(ByteStream& s);
+
+	// the state recorded by recordChecksum() was changed from outside the simulation
+	void clearChecksums();
+
+	// receiver: the ID belongs to an entity that has been deleted on the sender, e.g. one in a snapshot that arrived late
+	bool deletedID(Entity::ID id) const;
+
+	// move every entity by its velocity
+	void integrate(timediff dt);
+
+	// load every chunk an entity could touch in collide() and update its collision geometry, since neither is
+	// thread safe
+	void prepareCollision();
+
+	void collide(size_t begin, size_t end, EntityCommandBuffer& cmds);
+
+	// put entities that have been still for long enough to sleep
+	void sleepQuietEntities();
+
+	// move a slot in or out of awake_, stopping it if it goes to sleep
+	void setAsleep(uint32_t index, bool asleep);
+
+	// wake sleeping entities whose positions lie within the box
+	void wakeInBox(const Point3f& min, const Point3f& max);
+	void apply(EntityCommandBuffer& cmds);
 
 	// internal client-only function - create entity with given ID
 	Entity::ID newEntity(Entity::ID id);
 
 	enum class UpdateType {
-		FullUpdate = 0,
+		Snapshot = 0,
 		Deleted = 1,
+		Forgotten = 2,
 	};
 };
 
@@ -0,0 +1,96 @@
+/*
+ * NarfBlock entity interest management
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "narf/interest.h"
+
+#include <algorithm>
+
+using namespace narf;
+
+
+uint64_t InterestSet::updateInterval(float distance, float radius) {
+	auto quarter = (int)(distance * 4.0f / radius);
+	return 1ull << std::min(std::max(quarter, 0), 3);
+}
+
+
+void InterestSet::clear() {
+	known_.clear();
+	left_.clear();
+	kept_.clear();
+	send_.clear();
+}
+
+
+void InterestSet::update(EntityManager& entMgr, const Point3f& center, float radius, uint64_t tick) {
+	nearby_.clear();
+	entMgr.findInRadius(center, radius, nearby_);
+	std::sort(nearby_.begin(), nearby_.end());
+
+	left_.clear();
+	kept_.clear();
+	send_.clear();
+
+	// deleted entities are not found either, so they leave too
+	for (auto it = known_.begin(); it != known_.end(); ) {
+		if (std::binary_search(nearby_.begin(), nearby_.end(), it->first)) {
+			kept_.push_back(it->first);
+			++it;
+		} else {
+			left_.push_back(it->first);
+			it = known_.erase(it);
+		}
+	}
+	std::sort(kept_.begin(), kept_.end());
+
+	for (auto id : nearby_) {
+		auto& ent = *entMgr.getEntity(id);
+		auto asleep = ent.asleep();
+		auto found = known_.find(id);
+		if (found == known_.end()) {
+			known_[id] = {tick, asleep};
+			send_.push_back(id);
+			continue;
+		}
+		auto& known = found->second;
+		if (asleep) {
+			// one last update with the state it came to rest in
+			if (!known.asleep) {
+				known = {tick, true};
+				send_.push_back(id);
+			}
+		} else if (known.asleep || tick - known.lastSent >= updateInterval((ent.position.toFloat() - center).length(), radius)) {
+			known = {tick, false};
+			send_.push_back(id);
+		}
+	}
+}
@@ -0,0 +1,92 @@
+/*
+ * NarfBlock entity interest management
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NARF_INTEREST_H
+#define NARF_INTEREST_H
+
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "narf/entity.h"
+#include "narf/math/vector.h"
+
+namespace narf {
+
+// the entities one observer (e.g. a connected client) has been told about, limited to those within
+// a radius of a point, so that what is sent to it depends on how crowded its surroundings are
+// rather than on how many entities the world holds
+class InterestSet {
+public:
+	// find the entities within radius of center and work out what to send as of the given tick
+	// awake entities are sent every tick near the center and less often further out
+	// (see updateInterval()), sleeping ones once when they enter and once after falling asleep
+	// (EntityManager::serializeSnapshot() sends those again if the receiver has not acknowledged them)
+	void update(EntityManager& entMgr, const Point3f& center, float radius, uint64_t tick);
+
+	// known entities that were deleted or went out of range during the last update(); they are now forgotten
+	const std::vector<Entity::ID>& left() const { return left_; }
+
+	// entities the observer already knew about and still does, i.e. whose state it should have now
+	// (sorted by ID, as is send())
+	const std::vector<Entity::ID>& kept() const { return kept_; }
+
+	// entities to send the state of: those that entered the area and those due for an update
+	const std::vector<Entity::ID>& send() const { return send_; }
+
+	size_t size() const { return known_.size(); }
+
+	// forget everything, e.g. when a new observer takes over
+	void clear();
+
+	// ticks between updates of an awake entity at the given distance: 1 within a quarter of the radius,
+	// doubling for each further quarter
+	static uint64_t updateInterval(float distance, float radius);
+
+private:
+	struct Known {
+		uint64_t lastSent; // tick of the last update sent
+		bool asleep; // the last update sent was of a sleeping entity
+	};
+
+	std::unordered_map<Entity::ID, Known> known_;
+
+	std::vector<Entity::ID> nearby_; // scratch: result of the spatial query, sorted
+	std::vector<Entity::ID> left_;
+	std::vector<Entity::ID> kept_;
+	std::vector<Entity::ID> send_;
+};
+
+} // namespace narf
+
+#endif // NARF_INTEREST_H
@@ -0,0 +1,133 @@
+#ifndef NARF_MATH_FIXED_H
+#define NARF_MATH_FIXED_H
+
+#include <stdint.h>
+
+#include "narf/bytestream.h"
+#include "narf/math/vector.h"
+
+namespace narf {
+
+	// point in world space stored as 32.32 fixed point per axis
+	// the integer part is a block coordinate, so precision is the same everywhere in the world,
+	// unlike Point3f which loses sub-block precision far from the origin
+	class FixedPoint3 {
+	public:
+		static const int FracBits = 32;
+		static const int WireFracBits = 16; // fraction bits kept by serialize() and quantized()
+
+		int64_t x, y, z;
+
+		FixedPoint3() : x(0), y(0), z(0) { }
+		explicit FixedPoint3(const Point3f& p) : x(fromFloat(p.x)), y(fromFloat(p.y)), z(fromFloat(p.z)) { }
+
+		// scaling by a power of two is exact, so these only round in the int/float conversion
+		static int64_t fromFloat(float v) { return (int64_t)(v * 4294967296.0f); }
+		static float toFloat(int64_t v) { return (float)v * (1.0f / 4294967296.0f); }
+
+		Point3f toFloat() const {
+			return Point3f(toFloat(x), toFloat(y), toFloat(z));
+		}
+
+		// offset from origin, e.g. for rendering relative to the camera
+		// the subtraction is exact, so this is as precise as a float allows no matter where both points are
+		Vector3f relativeTo(const FixedPoint3& origin) const {
+			return Vector3f(toFloat(x - origin.x), toFloat(y - origin.y), toFloat(z - origin.z));
+		}
+
+		// block containing the point
+		Point3<int32_t> floor() const {
+			return Point3<int32_t>((int32_t)(x >> FracBits), (int32_t)(y >> FracBits), (int32_t)(z >> FracBits));
+		}
+
+		const Vector3f operator-(const FixedPoint3& origin) const {
+			return relativeTo(origin);
+		}
+
+		const FixedPoint3 operator+(const Vector3f& d) const {
+			FixedPoint3 p(*this);
+			return p += d;
+		}
+
+		FixedPoint3& operator+=(const Vector3f& d) {
+			x += fromFloat(d.x);
+			y += fromFloat(d.y);
+			z += fromFloat(d.z);
+			return *this;
+		}
+
+		bool operator==(const FixedPoint3& rhs) const {
+			return x == rhs.x && y == rhs.y && z == rhs.z;
+		}
+
+		bool operator!=(const FixedPoint3& rhs) const {
+			return !(*this == rhs);
+		}
+
+		// the point rounded to the precision serialize() sends, so deserialize() gives it back exactly
+		FixedPoint3 quantized() const {
+			FixedPoint3 p;
+			p.x = quantize(x);
+			p.y = quantize(y);
+			p.z = quantize(z);
+			return p;
+		}
+
+		// network encoding: per axis, the block coordinate as a zigzag varint followed by
+		// a 16-bit fraction, i.e. 3 bytes per axis within 64 blocks of the origin
+		void serialize(ByteStream& s) const {
+			writeAxis(s, x);
+			writeAxis(s, y);
+			writeAxis(s, z);
+		}
+
+		bool deserialize(ByteStream& s) {
+			return readAxis(s, x) && readAxis(s, y) && readAxis(s, z);
+		}
+
+	private:
+		static int64_t round(int64_t v) {
+			return (v + (1ll << (FracBits - WireFracBits - 1))) >> (FracBits - WireFracBits);
+		}
+
+		static int64_t quantize(int64_t v) {
+			return (int64_t)((uint64_t)round(v) << (FracBits - WireFracBits));
+		}
+
+		static void writeAxis(ByteStream& s, int64_t v) {
+			auto rounded = round(v);
+			auto block = rounded >> WireFracBits;
+			auto zigzag = ((uint64_t)block << 1) ^ (uint64_t)(block >> 63);
+			while (zigzag >= 0x80) {
+				s.write((uint8_t)(zigzag | 0x80));
+				zigzag >>= 7;
+			}
+			s.write((uint8_t)zigzag);
+			s.write((uint16_t)(rounded & 0xFFFF), LE);
+		}
+
+		static bool readAxis(ByteStream& s, int64_t& v) {
+			uint64_t zigzag = 0;
+			uint8_t b;
+			for (int shift = 0; ; shift += 7) {
+				if (shift > 35 || !s.read(&b)) {
+					return false; // out of range for a block coordinate, or ran out of data
+				}
+				zigzag |= (uint64_t)(b & 0x7F) << shift;
+				if (!(b & 0x80)) {
+					break;
+				}
+			}
+			uint16_t frac;
+			if (!s.read(&frac, LE)) {
+				return false;
+			}
+			auto block = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+			v = (int64_t)((uint64_t)block << FracBits) | ((int64_t)frac << (FracBits - WireFracBits));
+			return true;
+		}
+	};
+
+} // namespace narf
+
+#endif // NARF_MATH_FIXED_H
@@ -7,6 +7,11 @@ namespace narf {
 	uint32_t ilog2(uint32_t v);
 	int32_t ilog2(int32_t v);
 
+	// ilog2() usable in constant expressions
+	constexpr int32_t constIlog2(int32_t v) {
+		return v > 1 ? 1 + constIlog2(v >> 1) : 0;
+	}
+
 	static inline int32_t clampi(int32_t v, int32_t minV, int32_t maxV) {
 		if (v <= minV) {
 			return minV;
@@ -20,6 +25,13 @@ namespace narf {
 	static inline bool almostEqual(int a, int b) {
 		return a == b;
 	}
+
+	// splitmix64 finalizer: every input bit affects every output bit, for cheap hashes of integer state
+	static inline uint64_t mix64(uint64_t v) {
+		v = (v ^ (v >> 30)) * 0xBF58476D1CE4E5B9ull;
+		v = (v ^ (v >> 27)) * 0x94D049BB133111EBull;
+		return v ^ (v >> 31);
+	}
 }
 
 #endif
@@ -10,7 +10,8 @@ namespace narf {
 		const uint8_t CHAN_PLAYERCMD	= 1;
 		const uint8_t CHAN_CHUNK		= 2;
 		const uint8_t CHAN_ENTITY		= 3;
-		const size_t MAX_CHANNELS		= 4;
+		const uint8_t CHAN_ENTITY_STATE	= 4; // unreliable: entity snapshots, where a stale one is dropped, and their acks
+		const size_t MAX_CHANNELS		= 5;
 
 		const uint16_t DEFAULT_PORT = 8686;
 
@@ -3,6 +3,8 @@
 #include "narf/net/protocol.h"
 #include "narf/net/server.h"
 
+#include <thread>
+
 // TODO: move these
 #define WORLD_X_MAX 64
 #define WORLD_Y_MAX 64
@@ -10,6 +12,18 @@
 
 using namespace narf;
 
+// time each tick may spend on queued pathfinding requests
+static const timediff PathfindingBudget(0.002);
+
+// see Server::setInterestRadius()
+static const float DefaultInterestRadius = 64.0f;
+
+// see Server::setChunkRadius(); a chunk more than the client's default render distance
+static const int32_t DefaultChunkRadius = 6;
+
+// new chunks sent to each client per tick stop once this many bytes have gone out (at least one is always sent)
+static const size_t ChunkBytesPerTick = 64 * 1024;
+
 
 std::string net::to_string(const ENetAddress& address) {
 	char buf[3 * 4 + 3 + 1 + 5 + 1]; // 3-digit octet * 4 octets + 3 dots + colon + 5-digit port + terminator
@@ -19,7 +33,8 @@ std::string net::to_string(const ENetAddress& address) {
 }
 
 
-net::Server::Server(size_t maxClients, uint16_t port) : maxClients(maxClients) {
+net::Server::Server(size_t maxClients, uint16_t port) : maxClients(maxClients), interestRadius(DefaultInterestRadius),
+	chunkRadius(DefaultChunkRadius) {
 	if (enet_initialize() != 0) {
 		console->println("Error initializing ENet");
 		// TODO throw
@@ -55,15 +70,7 @@ net::Server::~Server() {
 
 
 void net::Server::chunkUpdate(const ChunkCoord& cc) {
-	// TODO: total hax
-	auto chunkState = chunkCache.get(cc);
-	if (!chunkState) {
-		chunkCache.put(cc, ChunkState());
-		chunkState = chunkCache.get(cc);
-	}
-	if (chunkState) {
-		chunkState->dirty = true;
-	}
+	changedChunks.insert(cc);
 }
 
 
@@ -76,21 +83,24 @@ void net::Server::blockUpdate(const BlockCoord& wbc) {
 
 
 void net::Server::genWorld() {
-	world = new World(WORLD_X_MAX, WORLD_Y_MAX, WORLD_Z_MAX, 16, 16, 16);
+	world = new World(WORLD_X_MAX, WORLD_Y_MAX, WORLD_Z_MAX,
+		DefaultChunkGeometry::SizeX, DefaultChunkGeometry::SizeY, DefaultChunkGeometry::SizeZ);
 	world->setGravity(-24.0f);
+	world->setDeterministic(true);
+	world->entityManager.setUpdateThreads(std::max(std::thread::hardware_concurrency(), 1u));
 
 	world->chunkUpdate = [this](const ChunkCoord& cc) { chunkUpdate(cc); };
 	world->blockUpdate = [this](const BlockCoord& wbc) { blockUpdate(wbc); };
-	world->entityManager.onEntityDeleted += [this](Entity::ID id) { onEntityDeleted(id); };
+	world->entityManager.onEntitiesDeleted += [this](const std::vector<Entity::ID>& ids) { onEntitiesDeleted(ids); };
 
 	// add test entity
 	auto bouncyBlockEID = world->entityManager.newEntity();
 	{
 		EntityRef bouncyBlock(world->entityManager, bouncyBlockEID);
-		bouncyBlock->position = Vector3f(10.0f, 10.0f, 21.0f);
+		bouncyBlock->position = FixedPoint3(Point3f(10.0f, 10.0f, 21.0f));
 		bouncyBlock->prevPosition = bouncyBlock->position;
-		bouncyBlock->bouncy = true;
-		bouncyBlock->model = true;
+		bouncyBlock->set(Entity::Bouncy);
+		bouncyBlock->set(Entity::Model);
 	}
 }
 
@@ -119,66 +129,107 @@ void net::Server::tellAll(const Client* from, const std::string& text) {
 }
 
 
-bool net::Server::clientChunkDirty(const Client* client, const ChunkCoord& cc) {
-	auto chunkState = chunkCache.get(cc);
-	if (chunkState) {
-		return chunkState->dirty;
-	}
-	return false;
+size_t net::Server::sendChunkUpdate(Client* to, const ChunkCoord& wcc) {
+	ByteStream bs;
+	world->serializeChunkUpdate(bs, wcc, to->chunks.version(wcc));
+	auto packet = enet_packet_create(bs.data(), bs.size(), ENET_PACKET_FLAG_RELIABLE);
+	enet_peer_send(to->peer, CHAN_CHUNK, packet);
+	to->chunks.sent(wcc, world->getChunk(wcc)->journal().seq());
+	return bs.size();
 }
 
 
-void net::Server::markClientChunkClean(const Client* client, const ChunkCoord& cc) {
-	auto chunkState = chunkCache.get(cc);
-	if (chunkState && chunkState->dirty) {
-		chunkState->dirty = false;
+void net::Server::sendChangedChunks() {
+	// only chunks that changed are looked at, and each client is sent the ones it has an older version of
+	for (const auto& wcc : changedChunks) {
+		auto version = world->getChunk(wcc)->journal().seq();
+		for (size_t i = 0; i < maxClients; i++) {
+			auto client = &clients[i];
+			if (client->peer && client->chunks.outdated(wcc, version)) {
+				sendChunkUpdate(client, wcc);
+			}
+		}
 	}
+	changedChunks.clear();
 }
 
 
-void net::Server::sendChunkUpdate(const Client* to, const ChunkCoord& wcc, bool dirtyOnly) {
-	auto chunk = world->getChunk(wcc);
-	if (!dirtyOnly || clientChunkDirty(to, wcc)) {
-		ByteStream bs;
-		world->serializeChunk(bs, wcc);
-		auto packet = enet_packet_create(bs.data(), bs.size(), ENET_PACKET_FLAG_RELIABLE);
-		enet_peer_send(to->peer, CHAN_CHUNK, packet);
-	}
+void net::Server::sendChunkUnload(const Client* to, const ChunkCoord& wcc) {
+	ByteStream bs;
+	world->serializeChunkUnload(bs, wcc);
+	auto packet = enet_packet_create(bs.data(), bs.size(), ENET_PACKET_FLAG_RELIABLE);
+	enet_peer_send(to->peer, CHAN_CHUNK, packet);
 }
 
 
-void net::Server::markChunksClean() {
-	ZYXCoordIter<ChunkCoord> iter({ 0, 0, 0 }, { world->chunksX(), world->chunksY(), world->chunksZ() });
-	for (const auto& wcc : iter) {
-		for (size_t i = 0; i < maxClients; i++) {
-			auto client = &clients[i];
-			if (client->peer) {
-				markClientChunkClean(client, wcc);
-			}
-		}
+void net::Server::streamChunks(Client* to) {
+	auto player = world->entityManager.getEntity(to->entityID);
+	if (!player) {
+		return;
+	}
+	auto p = player->position.floor();
+	BlockCoord wbc(clampi(p.x, 0, world->sizeX() - 1), clampi(p.y, 0, world->sizeY() - 1), clampi(p.z, 0, world->sizeZ() - 1));
+	ChunkCoord center;
+	Chunk::BlockCoord cbc;
+	world->calcChunkCoords(wbc, center, cbc);
+
+	auto& chunks = to->chunks;
+	chunks.update(*world, center, chunkRadius);
+	for (const auto& wcc : chunks.unloaded()) {
+		sendChunkUnload(to, wcc);
+	}
+
+	size_t bytes = 0;
+	ChunkCoord wcc;
+	while (bytes < ChunkBytesPerTick && chunks.next(wcc)) {
+		bytes += sendChunkUpdate(to, wcc);
 	}
 }
 
 
-void net::Server::sendEntityUpdate(const Client* to, const Entity& ent) {
+void net::Server::sendSnapshot(Client* to) {
+	auto& interest = to->interest;
+	auto& snap = to->snapshots.add(world->tick());
 	ByteStream bs;
-	world->entityManager.serializeEntityFullUpdate(bs, ent);
-	auto packet = enet_packet_create(bs.data(), bs.size(), ENET_PACKET_FLAG_RELIABLE);
-	enet_peer_send(to->peer, CHAN_ENTITY, packet);
+	// the checksum covers the entities the client keeps, so it can compare it with the state the snapshot would correct
+	world->entityManager.serializeSnapshot(bs, to->snapshots.find(to->snapshots.acked()), snap,
+		interest.kept(), interest.send(), world->entityManager.checksum(interest.kept()));
+	// a lost snapshot is not resent: the next one is sent as changes from the last one the client acknowledged
+	auto packet = enet_packet_create(bs.data(), bs.size(), 0);
+	enet_peer_send(to->peer, CHAN_ENTITY_STATE, packet);
 }
 
 
-void net::Server::sendDeletedEntityUpdate(const Client* to, Entity::ID id) {
+void net::Server::sendEntityLeft(const Client* to, Entity::ID id) {
 	ByteStream bs;
-	world->entityManager.serializeEntityDelete(bs, id);
+	if (world->entityManager.getEntity(id)) {
+		world->entityManager.serializeEntityForget(bs, id, world->tick()); // out of range; may come back
+	} else {
+		world->entityManager.serializeEntityDelete(bs, id);
+	}
 	auto packet = enet_packet_create(bs.data(), bs.size(), ENET_PACKET_FLAG_RELIABLE);
 	enet_peer_send(to->peer, CHAN_ENTITY, packet);
 }
 
 
-void net::Server::onEntityDeleted(Entity::ID id) {
-	console->println("entity " + std::to_string(id) + " deleted");
-	deletedEntities.push_back(id);
+void net::Server::onEntitiesDeleted(const std::vector<Entity::ID>& ids) {
+	// clients that knew about them find out when they drop out of their interest sets
+	console->println(std::to_string(ids.size()) + " entities deleted");
+}
+
+
+void net::Server::sendEntityUpdates(Client* to) {
+	auto player = world->entityManager.getEntity(to->entityID);
+	if (!player) {
+		return;
+	}
+	auto& interest = to->interest;
+	interest.update(world->entityManager, player->position.toFloat(), interestRadius, world->tick());
+
+	for (auto id : interest.left()) {
+		sendEntityLeft(to, id);
+	}
+	sendSnapshot(to);
 }
 
 
@@ -213,6 +264,9 @@ void net::Server::processConnect(ENetEvent& evt) {
 	}
 
 	client->peer = evt.peer;
+	client->interest.clear();
+	client->snapshots.clear();
+	client->chunks.clear();
 
 	// store Client pointer in peer data
 	evt.peer->data = client;
@@ -226,16 +280,13 @@ void net::Server::processConnect(ENetEvent& evt) {
 		EntityRef player(world->entityManager, client->entityID);
 
 		// initial player position
-		player->position = Vector3f(15.0f, 10.0f, 3.0f * 16.0f);
+		player->position = FixedPoint3(Point3f(15.0f, 10.0f, 3.0f * 16.0f));
 		player->prevPosition = player->position;
 	}
+	world->entityManager.positionChanged(client->entityID);
 	sendPlayerCameraUpdate(client, client->entityID);
 
-	// send all chunks (!!)
-	ZYXCoordIter<ChunkCoord> iter({ 0, 0, 0 }, { world->chunksX(), world->chunksY(), world->chunksZ() });
-	for (const auto& wcc : iter) {
-		sendChunkUpdate(client, wcc, false);
-	}
+	// chunks and entities are sent as they come within range, starting with the next tick
 }
 
 
@@ -281,6 +332,18 @@ void net::Server::processPlayerCommand(ENetEvent& evt, Client* client) {
 }
 
 
+void net::Server::processSnapshotAck(ENetEvent& evt, Client* client) {
+	ByteStream bs(evt.packet->data, evt.packet->dataLength);
+	uint64_t tick;
+	if (!bs.read(&tick, LE)) {
+		console->println("snapshot ack deserialize error");
+		return;
+	}
+	// acks of snapshots that are no longer kept are harmless: the next snapshot is sent in full
+	client->snapshots.ack(tick);
+}
+
+
 void net::Server::processReceive(ENetEvent& evt) {
 	auto client = static_cast<Client*>(evt.peer->data);
 	switch (evt.channelID) {
@@ -290,6 +353,9 @@ void net::Server::processReceive(ENetEvent& evt) {
 	case CHAN_PLAYERCMD:
 		processPlayerCommand(evt, client);
 		break;
+	case CHAN_ENTITY_STATE:
+		processSnapshotAck(evt, client);
+		break;
 	default:
 		console->println("Got unexpected packet from " + to_string(evt.peer->address) + " channel " + std::to_string(evt.channelID) + " size " + std::to_string(evt.packet->dataLength));
 		break;
@@ -324,25 +390,15 @@ void net::Server::tick(timediff dt) {
 	}
 
 	world->update(dt);
+	world->pathfinder.update(PathfindingBudget);
 
 	// send chunk and entity updates to all clients
+	sendChangedChunks();
 	for (size_t i = 0; i < maxClients; i++) {
 		auto client = &clients[i];
 		if (client->peer) {
-			ZYXCoordIter<ChunkCoord> iter({ 0, 0, 0 }, { world->chunksX(), world->chunksY(), world->chunksZ() });
-			for (const auto& wcc : iter) {
-				sendChunkUpdate(client, wcc, true);
-			}
-			for (const auto& ent : world->entityManager.getEntities()) {
-				sendEntityUpdate(client, ent);
-			}
-
-			while (deletedEntities.size()) {
-				auto id = deletedEntities.front();
-				deletedEntities.pop_front();
-				sendDeletedEntityUpdate(client, id);
-			}
+			streamChunks(client);
+			sendEntityUpdates(client);
 		}
 	}
-	markChunksClean();
 }
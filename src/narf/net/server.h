@@ -1,12 +1,14 @@
 #ifndef NARF_NET_SERVER_H
 #define NARF_NET_SERVER_H
 
-#include "narf/chunkcache.h"
+#include "narf/chunkstream.h"
 #include "narf/entity.h"
+#include "narf/interest.h"
 #include "narf/world.h"
 #include "narf/net.h"
 
 #include <queue>
+#include <unordered_set>
 
 #include <enet/enet.h>
 
@@ -26,16 +28,15 @@ namespace narf {
 
 			// entity this player is controlling/spectating
 			Entity::ID entityID;
-		};
 
-		// server chunk state
-		// TODO: track which clients have received which chunks
-		class ChunkState {
-		public:
-			ChunkState() : dirty(true) {}
-			~ChunkState() {}
+			// entities around entityID that this client is kept up to date on
+			InterestSet interest;
+
+			// entity states recently sent to this client, to send the next ones as changes from
+			SnapshotHistory snapshots;
 
-			bool dirty;
+			// chunks around entityID that this client has been sent or is waiting for
+			ChunkStream chunks;
 		};
 
 		class Server {
@@ -51,24 +52,32 @@ namespace narf {
 
 			World* world; // TODO: this should probably be private
 
+			// clients are only sent entities within this many blocks of their player
+			void setInterestRadius(float radius) { interestRadius = radius; }
+
+			// clients are sent the chunks within this many chunks of their player
+			void setChunkRadius(int32_t radius) { chunkRadius = radius; }
+
 		private:
 			void genWorld();
 
 			void chunkUpdate(const ChunkCoord& cc);
 			void blockUpdate(const BlockCoord& wbc);
-			bool clientChunkDirty(const Client* client, const ChunkCoord& cc);
-			void markClientChunkClean(const Client* client, const ChunkCoord& cc);
-			void markChunksClean();
-			void sendChunkUpdate(const Client* to, const ChunkCoord& wcc, bool dirtyOnly);
-			void sendEntityUpdate(const Client* to, const Entity& ent);
-			void sendDeletedEntityUpdate(const Client* to, Entity::ID id);
-			void onEntityDeleted(Entity::ID id);
+			size_t sendChunkUpdate(Client* to, const ChunkCoord& wcc);
+			void sendChangedChunks();
+			void sendChunkUnload(const Client* to, const ChunkCoord& wcc);
+			void streamChunks(Client* to);
+			void sendEntityLeft(const Client* to, Entity::ID id);
+			void sendSnapshot(Client* to);
+			void sendEntityUpdates(Client* to);
+			void onEntitiesDeleted(const std::vector<Entity::ID>& ids);
 			void sendPlayerCameraUpdate(const Client* to, Entity::ID followID);
 
 			void processConnect(ENetEvent& evt);
 			void processDisconnect(ENetEvent& evt);
 			void processChat(ENetEvent& evt, net::Client* client);
 			void processPlayerCommand(ENetEvent& evt, net::Client* client);
+			void processSnapshotAck(ENetEvent& evt, net::Client* client);
 			void processReceive(ENetEvent& evt);
 			void processNetEvent(ENetEvent& evt);
 
@@ -76,8 +85,9 @@ namespace narf {
 			size_t maxClients;
 			Client* clients;
 
-			std::deque<Entity::ID> deletedEntities;
-			ChunkCache<ChunkCoord, ChunkState> chunkCache;
+			float interestRadius;
+			int32_t chunkRadius;
+			std::unordered_set<ChunkCoord> changedChunks; // since the last tick
 		};
 	}
 }
@@ -0,0 +1,245 @@
+/*
+ * NarfBlock particle system
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "narf/particles.h"
+#include "narf/platform.h"
+#include "narf/world.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+
+// fraction of speed kept by Collision::Bounce particles
+static const float Restitution = 0.5f;
+
+
+narf::ParticleSystem::ParticleSystem(World* world) :
+	world_(world), capacity_(0), count_(0) {
+}
+
+
+void narf::ParticleSystem::setCapacity(uint32_t capacity) {
+	capacity_ = (capacity + 3) & ~3u;
+	count_ = std::min(count_, capacity_);
+	for (auto a : {&x_, &y_, &z_, &vx_, &vy_, &vz_, &gravity_, &life_}) {
+		a->resize(capacity_, 0.0f);
+	}
+	collision_.resize(capacity_, Collision::Die);
+	user_.resize(capacity_, 0);
+	changed_.resize(capacity_ / 4);
+	dead_.reserve(capacity_);
+}
+
+
+bool narf::ParticleSystem::spawn(const Point3f& position, const Vector3f& velocity, float lifetime,
+	Collision collision, float gravityScale, uint32_t user) {
+	if (count_ == capacity_) {
+		return false;
+	}
+	auto i = count_++;
+	x_[i] = position.x;
+	y_[i] = position.y;
+	z_[i] = position.z;
+	vx_[i] = velocity.x;
+	vy_[i] = velocity.y;
+	vz_[i] = velocity.z;
+	gravity_[i] = gravityScale;
+	life_[i] = lifetime;
+	collision_[i] = collision;
+	user_[i] = user;
+	return true;
+}
+
+
+uint32_t narf::ParticleSystem::integrate(float dt) {
+	auto dv = world_->getGravity() * dt;
+	auto groups = (count_ + 3) / 4;
+
+#if NARF_SSE2
+	auto vdt = _mm_set1_ps(dt);
+	auto vdv = _mm_set1_ps(dv);
+	auto zero = _mm_setzero_ps();
+	for (uint32_t g = 0; g < groups; g++) {
+		auto i = g * 4;
+		auto x = _mm_loadu_ps(&x_[i]);
+		auto y = _mm_loadu_ps(&y_[i]);
+		auto z = _mm_loadu_ps(&z_[i]);
+		auto vx = _mm_loadu_ps(&vx_[i]);
+		auto vy = _mm_loadu_ps(&vy_[i]);
+		auto vz = _mm_add_ps(_mm_loadu_ps(&vz_[i]), _mm_mul_ps(_mm_loadu_ps(&gravity_[i]), vdv));
+		auto life = _mm_sub_ps(_mm_loadu_ps(&life_[i]), vdt);
+
+		auto nx = _mm_add_ps(x, _mm_mul_ps(vx, vdt));
+		auto ny = _mm_add_ps(y, _mm_mul_ps(vy, vdt));
+		auto nz = _mm_add_ps(z, _mm_mul_ps(vz, vdt));
+
+		// truncation is only floor() for positive coordinates, so also flag anything that went negative
+		auto moved = _mm_or_si128(
+			_mm_or_si128(
+				_mm_xor_si128(_mm_cvttps_epi32(x), _mm_cvttps_epi32(nx)),
+				_mm_xor_si128(_mm_cvttps_epi32(y), _mm_cvttps_epi32(ny))),
+			_mm_xor_si128(_mm_cvttps_epi32(z), _mm_cvttps_epi32(nz)));
+		auto changed = _mm_or_ps(
+			_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_cmpeq_epi32(moved, _mm_setzero_si128()), _mm_setzero_si128())),
+			_mm_or_ps(_mm_cmple_ps(life, zero),
+				_mm_or_ps(_mm_cmplt_ps(nx, zero), _mm_or_ps(_mm_cmplt_ps(ny, zero), _mm_cmplt_ps(nz, zero)))));
+		changed_[g] = (uint8_t)_mm_movemask_ps(changed);
+
+		_mm_storeu_ps(&x_[i], nx);
+		_mm_storeu_ps(&y_[i], ny);
+		_mm_storeu_ps(&z_[i], nz);
+		_mm_storeu_ps(&vz_[i], vz);
+		_mm_storeu_ps(&life_[i], life);
+	}
+#else
+	for (uint32_t g = 0; g < groups; g++) {
+		uint8_t changed = 0;
+		for (uint32_t j = 0; j < 4; j++) {
+			auto i = g * 4 + j;
+			vz_[i] += gravity_[i] * dv;
+			life_[i] -= dt;
+			auto nx = x_[i] + vx_[i] * dt;
+			auto ny = y_[i] + vy_[i] * dt;
+			auto nz = z_[i] + vz_[i] * dt;
+			if ((int32_t)nx != (int32_t)x_[i] || (int32_t)ny != (int32_t)y_[i] || (int32_t)nz != (int32_t)z_[i] ||
+				life_[i] <= 0.0f || nx < 0.0f || ny < 0.0f || nz < 0.0f) {
+				changed |= (uint8_t)(1 << j);
+			}
+			x_[i] = nx;
+			y_[i] = ny;
+			z_[i] = nz;
+		}
+		changed_[g] = changed;
+	}
+#endif
+
+	return groups;
+}
+
+
+bool narf::ParticleSystem::collide(uint32_t i, float dt) {
+	if (life_[i] <= 0.0f) {
+		return false;
+	}
+
+	BlockCoord bc((int32_t)floorf(x_[i]), (int32_t)floorf(y_[i]), (int32_t)floorf(z_[i]));
+	if (!world_->validCoords(bc)) {
+		return false;
+	}
+	if (!world_->isOpaqueUnchecked(bc)) {
+		return true;
+	}
+
+	// back out of the block to where the particle was at the start of the tick
+	Point3f prev(x_[i] - vx_[i] * dt, y_[i] - vy_[i] * dt, z_[i] - vz_[i] * dt);
+
+	switch (collision_[i]) {
+	case Collision::Die:
+		hits_.push_back({user_[i], bc, prev});
+		return false;
+
+	case Collision::Stick:
+		vx_[i] = vy_[i] = vz_[i] = 0.0f;
+		gravity_[i] = 0.0f;
+		break;
+
+	case Collision::Bounce:
+		{
+			// reflect along each axis where moving alone would have entered the block
+			BlockCoord pc((int32_t)floorf(prev.x), (int32_t)floorf(prev.y), (int32_t)floorf(prev.z));
+			bool hitX = pc.x != bc.x && world_->isOpaque({bc.x, pc.y, pc.z});
+			bool hitY = pc.y != bc.y && world_->isOpaque({pc.x, bc.y, pc.z});
+			bool hitZ = pc.z != bc.z && world_->isOpaque({pc.x, pc.y, bc.z});
+			if (!hitX && !hitY && !hitZ) {
+				// only the diagonal is blocked
+				hitX = pc.x != bc.x;
+				hitY = pc.y != bc.y;
+				hitZ = pc.z != bc.z;
+			}
+			vx_[i] *= hitX ? -Restitution : Restitution;
+			vy_[i] *= hitY ? -Restitution : Restitution;
+			vz_[i] *= hitZ ? -Restitution : Restitution;
+			break;
+		}
+	}
+
+	x_[i] = prev.x;
+	y_[i] = prev.y;
+	z_[i] = prev.z;
+	return true;
+}
+
+
+void narf::ParticleSystem::remove(uint32_t i) {
+	auto last = --count_;
+	x_[i] = x_[last];
+	y_[i] = y_[last];
+	z_[i] = z_[last];
+	vx_[i] = vx_[last];
+	vy_[i] = vy_[last];
+	vz_[i] = vz_[last];
+	gravity_[i] = gravity_[last];
+	life_[i] = life_[last];
+	collision_[i] = collision_[last];
+	user_[i] = user_[last];
+
+	// park the vacated slot so integrating it does nothing interesting
+	vx_[last] = vy_[last] = vz_[last] = 0.0f;
+	gravity_[last] = 0.0f;
+}
+
+
+void narf::ParticleSystem::update(timediff dt) {
+	hits_.clear();
+	dead_.clear();
+
+	auto fdt = (float)dt;
+	auto groups = integrate(fdt);
+
+	for (uint32_t g = 0; g < groups; g++) {
+		if (!changed_[g]) {
+			continue;
+		}
+		for (uint32_t j = 0; j < 4; j++) {
+			auto i = g * 4 + j;
+			if ((changed_[g] & (1 << j)) && i < count_ && !collide(i, fdt)) {
+				dead_.push_back(i);
+			}
+		}
+	}
+
+	// remove from the end so that moving the last particle into a hole never moves a dead one
+	for (auto it = dead_.rbegin(); it != dead_.rend(); ++it) {
+		remove(*it);
+	}
+}
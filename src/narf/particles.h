@@ -0,0 +1,122 @@
+/*
+ * NarfBlock particle system
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NARF_PARTICLES_H
+#define NARF_PARTICLES_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "narf/block.h"
+#include "narf/time.h"
+#include "narf/math/vector.h"
+
+namespace narf {
+
+class World;
+
+/*
+ * ParticleSystem moves large numbers of small, short-lived objects (explosion
+ * debris, sparks, projectiles) that do not need to be full entities.
+ * Particles are points stored in structure-of-arrays form in buffers allocated
+ * once by setCapacity(), so spawning and dying never allocate. Integration is
+ * vectorized; collision only looks at the world for particles that crossed
+ * into a different block this tick.
+ */
+class ParticleSystem {
+public:
+	// what a particle does when it moves into an opaque block
+	enum class Collision : uint8_t {
+		Die, // removed, and reported in hits() (e.g. projectiles)
+		Stick, // stops where it is (e.g. debris)
+		Bounce, // reflects off the face it hit, losing some speed
+	};
+
+	struct Hit {
+		uint32_t user; // the user value the particle was spawned with
+		BlockCoord block;
+		Point3f position; // last position outside the block
+	};
+
+	ParticleSystem(World* world);
+
+	// allocate room for at least capacity particles; live particles beyond the new capacity are dropped
+	void setCapacity(uint32_t capacity);
+	uint32_t capacity() const { return capacity_; }
+	uint32_t size() const { return count_; }
+
+	// add a particle that lives for lifetime seconds
+	// gravityScale multiplies the world's gravity for this particle (0 for particles that fly straight)
+	// returns false if the system is full
+	bool spawn(const Point3f& position, const Vector3f& velocity, float lifetime,
+		Collision collision, float gravityScale = 1.0f, uint32_t user = 0);
+
+	void clear() { count_ = 0; }
+
+	void update(timediff dt);
+
+	// particles with Collision::Die that hit a block during the last update()
+	const std::vector<Hit>& hits() const { return hits_; }
+
+	// particles are stored densely in [0, size()); indices change when particles die
+	Point3f position(uint32_t i) const { return Point3f(x_[i], y_[i], z_[i]); }
+	Vector3f velocity(uint32_t i) const { return Vector3f(vx_[i], vy_[i], vz_[i]); }
+
+private:
+	World* world_;
+	uint32_t capacity_; // multiple of 4, so integration can always work on whole groups
+	uint32_t count_;
+
+	std::vector<float> x_, y_, z_;
+	std::vector<float> vx_, vy_, vz_;
+	std::vector<float> gravity_; // gravity scale
+	std::vector<float> life_; // seconds left
+	std::vector<Collision> collision_;
+	std::vector<uint32_t> user_;
+
+	std::vector<uint8_t> changed_; // per group of 4: bit i set if particle i died or changed blocks
+	std::vector<uint32_t> dead_;
+	std::vector<Hit> hits_;
+
+	// move every particle and fill changed_; returns the number of groups
+	uint32_t integrate(float dt);
+
+	// handle a particle that changed blocks or ran out of time; returns false if it died
+	bool collide(uint32_t i, float dt);
+
+	void remove(uint32_t i);
+};
+
+} // namespace narf
+
+#endif // NARF_PARTICLES_H
@@ -0,0 +1,621 @@
+/*
+ * NarfBlock pathfinding
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "narf/pathfinder.h"
+#include "narf/world.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+const uint16_t narf::Pathfinder::NoRegion;
+const uint8_t narf::Pathfinder::Walk;
+const uint8_t narf::Pathfinder::Headroom;
+
+static const float Sqrt2 = 1.41421356f;
+
+// the block search is already confined to the regions on the abstract path, so trading a little path length
+// for not exploring all of them is worth it; paths are at most this much longer than the best one through the corridor
+static const float BlockHeuristicWeight = 1.5f;
+
+const uint32_t narf::Pathfinder::BlockChecks;
+
+// deadline for findPath(), which runs a search to completion
+static const narf::timediff Unlimited((int64_t)1 << 60);
+
+// lower bound on the cost of moving between two blocks: every move costs at least its horizontal distance
+static float estimate(const narf::BlockCoord& a, const narf::BlockCoord& b) {
+	auto dx = (float)abs(a.x - b.x);
+	auto dy = (float)abs(a.y - b.y);
+	return std::max(dx, dy) + (Sqrt2 - 1.0f) * std::min(dx, dy);
+}
+
+
+narf::Pathfinder::Pathfinder(World* world) : world_(world), nextVersion_(1), regionBuilds_(0), expansions_(0), nextRequestID_(1) {
+}
+
+
+uint32_t narf::Pathfinder::chunkIndex(const ChunkCoord& cc) const {
+	return (uint32_t)(((cc.z * world_->chunksY()) + cc.y) * world_->chunksX() + cc.x);
+}
+
+
+narf::ChunkCoord narf::Pathfinder::chunkCoord(uint32_t index) const {
+	auto i = (int32_t)index;
+	return ChunkCoord(i % world_->chunksX(), (i / world_->chunksX()) % world_->chunksY(), i / (world_->chunksX() * world_->chunksY()));
+}
+
+
+narf::Pathfinder::RequestID narf::Pathfinder::request(const BlockCoord& from, const BlockCoord& to, Callback callback) {
+	auto id = nextRequestID_++;
+	requests_.push_back({id, from, to, callback});
+	return id;
+}
+
+
+bool narf::Pathfinder::cancel(RequestID id) {
+	auto it = std::find_if(requests_.begin(), requests_.end(), [id](const Request& r) { return r.id == id; });
+	if (it == requests_.end()) {
+		return false;
+	}
+	if (it == requests_.begin()) {
+		search_.phase = Phase::Idle;
+	}
+	requests_.erase(it);
+	return true;
+}
+
+
+void narf::Pathfinder::update(timediff budget) {
+	auto deadline = time::now() + budget;
+	while (!requests_.empty()) {
+		auto& front = requests_.front();
+		auto status = runSearch(front.from, front.to, deadline, path_);
+		if (status == Status::Running) {
+			break;
+		}
+		auto req = std::move(front);
+		requests_.pop_front();
+		req.callback(req.id, status == Status::Found, path_);
+		if (time::now() >= deadline) {
+			break;
+		}
+	}
+}
+
+
+void narf::Pathfinder::blockChanged(const BlockCoord& wbc) {
+	ChunkCoord cc;
+	Chunk::BlockCoord cbc;
+	world_->calcChunkCoords(wbc, cc, cbc);
+	searchChanged(cc);
+}
+
+
+void narf::Pathfinder::chunkChanged(const ChunkCoord& cc) {
+	// the journal of a replacement chunk, or of the empty chunk standing in for an unloaded one, does not follow
+	// on from the old chunk's, so rebuild its regions and those of the chunks above and below, which depend on it
+	for (int32_t dz = -1; dz <= 1; dz++) {
+		ChunkCoord n(cc.x, cc.y, cc.z + dz);
+		if (world_->validChunkCoords(n) && chunkIndex(n) < nav_.size()) {
+			nav_[chunkIndex(n)].built = false;
+		}
+	}
+	searchChanged(cc);
+}
+
+
+void narf::Pathfinder::searchChanged(const ChunkCoord& cc) {
+	if (search_.phase == Phase::Idle || search_.stale) {
+		return;
+	}
+	for (int32_t dz = -1; dz <= 1; dz++) {
+		for (int32_t dy = -1; dy <= 1; dy++) {
+			for (int32_t dx = -1; dx <= 1; dx++) {
+				ChunkCoord n(cc.x + dx, cc.y + dy, cc.z + dz);
+				if (world_->validChunkCoords(n) && search_.chunks.count(chunkIndex(n))) {
+					search_.stale = true;
+					return;
+				}
+			}
+		}
+	}
+}
+
+
+bool narf::Pathfinder::walkable(const BlockCoord& wbc) {
+	if (!world_->validCoords(wbc)) {
+		return false;
+	}
+	nav_.resize((size_t)(world_->chunksX() * world_->chunksY() * world_->chunksZ()));
+	ChunkCoord cc;
+	Chunk::BlockCoord cbc;
+	world_->calcChunkCoords(wbc, cc, cbc);
+	updateRegions(chunkIndex(cc));
+	return (flags(wbc) & Walk) != 0;
+}
+
+
+void narf::Pathfinder::updateRegions(uint32_t ci) {
+	auto cc = chunkCoord(ci);
+	auto chunk = world_->getChunk(cc);
+	uint64_t seq[3] = {
+		chunk->journal().seq(),
+		cc.z > 0 ? world_->getChunk({cc.x, cc.y, cc.z - 1})->journal().seq() : 0,
+		cc.z + 1 < world_->chunksZ() ? world_->getChunk({cc.x, cc.y, cc.z + 1})->journal().seq() : 0,
+	};
+	auto& nav = nav_[ci];
+	if (nav.built && std::equal(seq, seq + 3, nav.seq)) {
+		return;
+	}
+	std::copy(seq, seq + 3, nav.seq);
+	buildRegions(ci, chunk);
+}
+
+
+void narf::Pathfinder::buildRegions(uint32_t ci, Chunk* chunk) {
+	auto& nav = nav_[ci];
+	auto sx = world_->chunkSizeX(), sy = world_->chunkSizeY(), sz = world_->chunkSizeZ();
+	auto origin = world_->calcBlockCoords(chunkCoord(ci));
+	auto size = (size_t)(sx * sy * sz);
+	nav.regions.clear();
+	nav.built = true;
+	nav.version = nextVersion_++;
+	nav.edgesBuilt = false;
+	regionBuilds_++;
+
+	// nothing to walk on inside solid ground; flags() treats chunks without flags as having no walkable blocks
+	if (chunk->full()) {
+		nav.flags.clear();
+		nav.region.clear();
+		return;
+	}
+	nav.flags.assign(size, 0);
+	nav.region.assign(size, NoRegion);
+
+	// opacity of each column from one block below the chunk to two above it
+	std::vector<bool> opaque((size_t)(sz + 3));
+	for (int32_t y = 0; y < sy; y++) {
+		for (int32_t x = 0; x < sx; x++) {
+			for (int32_t z = -1; z < sz + 2; z++) {
+				opaque[(size_t)(z + 1)] = (z >= 0 && z < sz) ?
+					chunk->isOpaque({x, y, z}) :
+					world_->isOpaque({origin.x + x, origin.y + y, origin.z + z});
+			}
+			for (int32_t z = 0; z < sz; z++) {
+				uint8_t f = 0;
+				if (opaque[(size_t)z] && !opaque[(size_t)(z + 1)] && !opaque[(size_t)(z + 2)]) {
+					f |= Walk;
+				}
+				if (!opaque[(size_t)(z + 3)]) {
+					f |= Headroom;
+				}
+				nav.flags[(size_t)((z * sy + y) * sx + x)] = f;
+			}
+		}
+	}
+
+	// flood fill regions using only moves that stay inside this chunk
+	auto& cells = stack_;
+	for (uint32_t i = 0; i < size; i++) {
+		if (!(nav.flags[i] & Walk) || nav.region[i] != NoRegion) {
+			continue;
+		}
+		auto r = (uint16_t)nav.regions.size();
+		nav.region[i] = r;
+		cells.clear();
+		cells.push_back(i);
+		float sum[3] = {0.0f, 0.0f, 0.0f};
+		for (size_t head = 0; head < cells.size(); head++) {
+			auto li = (int32_t)cells[head];
+			BlockCoord c(origin.x + li % sx, origin.y + (li / sx) % sy, origin.z + li / (sx * sy));
+			sum[0] += (float)c.x;
+			sum[1] += (float)c.y;
+			sum[2] += (float)c.z;
+			forEachMove(c, [&](const BlockCoord& t, float) {
+				BlockCoord lt(t.x - origin.x, t.y - origin.y, t.z - origin.z);
+				if (lt.x < 0 || lt.y < 0 || lt.z < 0 || lt.x >= sx || lt.y >= sy || lt.z >= sz) {
+					return;
+				}
+				auto ti = (uint32_t)((lt.z * sy + lt.y) * sx + lt.x);
+				if (nav.region[ti] == NoRegion) {
+					nav.region[ti] = r;
+					cells.push_back(ti);
+				}
+			});
+		}
+
+		// representative block: the one closest to the average position
+		auto n = (float)cells.size();
+		Region region;
+		float best = 0.0f;
+		for (auto li : cells) {
+			BlockCoord c(origin.x + (int32_t)li % sx, origin.y + ((int32_t)li / sx) % sy, origin.z + (int32_t)li / (sx * sy));
+			auto dx = (float)c.x - sum[0] / n, dy = (float)c.y - sum[1] / n, dz = (float)c.z - sum[2] / n;
+			auto d = dx * dx + dy * dy + dz * dz;
+			if (li == cells[0] || d < best) {
+				best = d;
+				region.rep = c;
+			}
+		}
+		nav.regions.push_back(region);
+	}
+}
+
+
+void narf::Pathfinder::updateEdges(uint32_t ci) {
+	updateRegions(ci);
+	auto cc = chunkCoord(ci);
+	uint64_t deps[27];
+	int k = 0;
+	for (int32_t dz = -1; dz <= 1; dz++) {
+		for (int32_t dy = -1; dy <= 1; dy++) {
+			for (int32_t dx = -1; dx <= 1; dx++) {
+				ChunkCoord n(cc.x + dx, cc.y + dy, cc.z + dz);
+				deps[k] = 0;
+				if (world_->validChunkCoords(n)) {
+					auto ni = chunkIndex(n);
+					updateRegions(ni);
+					deps[k] = nav_[ni].version;
+				}
+				k++;
+			}
+		}
+	}
+
+	auto& nav = nav_[ci];
+	if (nav.edgesBuilt && std::equal(deps, deps + 27, nav.edgeDeps)) {
+		return;
+	}
+	std::copy(deps, deps + 27, nav.edgeDeps);
+
+	for (auto& region : nav.regions) {
+		region.edges.clear();
+	}
+
+	if (nav.flags.empty()) {
+		nav.edgesBuilt = true;
+		return;
+	}
+
+	// only blocks on the chunk's faces can move into another chunk
+	auto sx = world_->chunkSizeX(), sy = world_->chunkSizeY(), sz = world_->chunkSizeZ();
+	auto origin = world_->calcBlockCoords(cc);
+	for (int32_t z = 0; z < sz; z++) {
+		for (int32_t y = 0; y < sy; y++) {
+			for (int32_t x = 0; x < sx; x++) {
+				if (x != 0 && y != 0 && z != 0 && x != sx - 1 && y != sy - 1 && z != sz - 1) {
+					continue;
+				}
+				auto r = nav.region[(size_t)((z * sy + y) * sx + x)];
+				if (r == NoRegion) {
+					continue;
+				}
+				auto& region = nav.regions[r];
+				forEachMove({origin.x + x, origin.y + y, origin.z + z}, [&](const BlockCoord& t, float) {
+					ChunkCoord tcc;
+					Chunk::BlockCoord tcbc;
+					world_->calcChunkCoords(t, tcc, tcbc);
+					if (tcc == cc) {
+						return;
+					}
+					auto tci = chunkIndex(tcc);
+					auto& target = nav_[tci];
+					auto tr = target.region[(size_t)((tcbc.z * sy + tcbc.y) * sx + tcbc.x)];
+					for (const auto& e : region.edges) {
+						if (e.chunk == tci && e.region == tr) {
+							return;
+						}
+					}
+					region.edges.push_back({tci, tr, estimate(region.rep, target.regions[tr].rep)});
+				});
+			}
+		}
+	}
+	nav.edgesBuilt = true;
+}
+
+
+bool narf::Pathfinder::updateNeighborRegions(uint32_t ci, const time& deadline) {
+	auto cc = chunkCoord(ci);
+	for (int32_t dz = -1; dz <= 1; dz++) {
+		for (int32_t dy = -1; dy <= 1; dy++) {
+			for (int32_t dx = -1; dx <= 1; dx++) {
+				ChunkCoord n(cc.x + dx, cc.y + dy, cc.z + dz);
+				if (!world_->validChunkCoords(n)) {
+					continue;
+				}
+				auto builds = regionBuilds_;
+				updateRegions(chunkIndex(n));
+				if (regionBuilds_ != builds && time::now() >= deadline) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+
+uint8_t narf::Pathfinder::flags(const BlockCoord& wbc) const {
+	if (!world_->validCoords(wbc)) {
+		return 0;
+	}
+	ChunkCoord cc;
+	Chunk::BlockCoord cbc;
+	world_->calcChunkCoords(wbc, cc, cbc);
+	const auto& nav = nav_[chunkIndex(cc)];
+	if (nav.flags.empty()) {
+		return 0;
+	}
+	return nav.flags[(size_t)((cbc.z * world_->chunkSizeY() + cbc.y) * world_->chunkSizeX() + cbc.x)];
+}
+
+
+uint64_t narf::Pathfinder::regionKey(const BlockCoord& wbc) const {
+	ChunkCoord cc;
+	Chunk::BlockCoord cbc;
+	world_->calcChunkCoords(wbc, cc, cbc);
+	auto ci = chunkIndex(cc);
+	auto r = nav_[ci].region[(size_t)((cbc.z * world_->chunkSizeY() + cbc.y) * world_->chunkSizeX() + cbc.x)];
+	return ((uint64_t)ci << 16) | r;
+}
+
+
+uint64_t narf::Pathfinder::blockKey(const BlockCoord& c) const {
+	return ((uint64_t)c.z * (uint64_t)world_->sizeY() + (uint64_t)c.y) * (uint64_t)world_->sizeX() + (uint64_t)c.x;
+}
+
+
+narf::BlockCoord narf::Pathfinder::blockCoord(uint64_t key) const {
+	auto sx = (uint64_t)world_->sizeX(), sy = (uint64_t)world_->sizeY();
+	return BlockCoord((int32_t)(key % sx), (int32_t)(key / sx % sy), (int32_t)(key / (sx * sy)));
+}
+
+
+template <typename F>
+void narf::Pathfinder::forEachMove(const BlockCoord& c, F f) const {
+	static const int32_t dirs[8][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}, {1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
+	auto here = flags(c);
+	for (int d = 0; d < 4; d++) {
+		BlockCoord t(c.x + dirs[d][0], c.y + dirs[d][1], c.z);
+		if (flags(t) & Walk) {
+			f(t, 1.0f);
+			continue;
+		}
+		// stepping up or down needs room for the entity's head above the lower block
+		BlockCoord up(t.x, t.y, t.z + 1), down(t.x, t.y, t.z - 1);
+		if ((here & Headroom) && (flags(up) & Walk)) {
+			f(up, Sqrt2);
+		}
+		if ((flags(down) & (Walk | Headroom)) == (Walk | Headroom)) {
+			f(down, Sqrt2);
+		}
+	}
+	// diagonal moves only on level ground, and not around corners
+	for (int d = 4; d < 8; d++) {
+		BlockCoord t(c.x + dirs[d][0], c.y + dirs[d][1], c.z);
+		if ((flags(t) & Walk) && (flags({t.x, c.y, c.z}) & Walk) && (flags({c.x, t.y, c.z}) & Walk)) {
+			f(t, Sqrt2);
+		}
+	}
+}
+
+
+bool narf::Pathfinder::ground(BlockCoord& c) {
+	for (int i = 0; i < 3; i++, c.z--) {
+		if (walkable(c)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+bool narf::Pathfinder::findPath(const BlockCoord& from, const BlockCoord& to, std::vector<BlockCoord>& path) {
+	search_.phase = Phase::Idle;
+	return runSearch(from, to, time::now() + Unlimited, path) == Status::Found;
+}
+
+
+bool narf::Pathfinder::startSearch(const BlockCoord& from, const BlockCoord& to) {
+	auto& s = search_;
+	s.from = from;
+	s.to = to;
+	s.start = from;
+	s.goal = to;
+	s.chunks.clear();
+	s.stale = false;
+	s.phase = Phase::Idle;
+	if (!ground(s.start) || !ground(s.goal)) {
+		return false;
+	}
+	s.startKey = regionKey(s.start);
+	s.goalKey = regionKey(s.goal);
+	s.chunks.insert((uint32_t)(s.startKey >> 16));
+	s.chunks.insert((uint32_t)(s.goalKey >> 16));
+
+	auto rep = nav_[s.startKey >> 16].regions[s.startKey & 0xFFFF].rep;
+	nodes_.clear();
+	open_.clear();
+	nodes_[s.startKey] = {0.0f, s.startKey, false};
+	open_.push_back({estimate(rep, s.goal), 0.0f, s.startKey});
+	s.phase = Phase::Abstract;
+	return true;
+}
+
+
+narf::Pathfinder::Status narf::Pathfinder::runSearch(const BlockCoord& from, const BlockCoord& to, const time& deadline, std::vector<BlockCoord>& path) {
+	path.clear();
+	auto& s = search_;
+	if (s.phase == Phase::Idle || s.stale || s.from != from || s.to != to) {
+		if (!startSearch(from, to)) {
+			return Status::NotFound;
+		}
+	}
+
+	if (s.phase == Phase::Abstract) {
+		auto status = findAbstractPath(deadline);
+		if (status == Status::NotFound) {
+			s.phase = Phase::Idle;
+		}
+		if (status != Status::Found) {
+			return status;
+		}
+		startBlockPath();
+	}
+
+	auto status = findBlockPath(deadline, path);
+	if (status != Status::Running) {
+		s.phase = Phase::Idle;
+	}
+	return status;
+}
+
+
+narf::Pathfinder::Status narf::Pathfinder::findAbstractPath(const time& deadline) {
+	auto rep = [this](uint64_t key) -> const BlockCoord& {
+		return nav_[key >> 16].regions[key & 0xFFFF].rep;
+	};
+
+	auto& s = search_;
+	for (uint32_t steps = 0; !open_.empty(); steps++) {
+		if (steps > 0 && time::now() >= deadline) {
+			return Status::Running;
+		}
+		std::pop_heap(open_.begin(), open_.end());
+		auto o = open_.back();
+		open_.pop_back();
+		auto& node = nodes_[o.key];
+		if (node.closed) {
+			continue;
+		}
+		node.closed = true;
+
+		// building the regions around a chunk for the first time is slow enough to spread over several updates
+		auto ci = (uint32_t)(o.key >> 16);
+		s.chunks.insert(ci);
+		if (!updateNeighborRegions(ci, deadline)) {
+			node.closed = false;
+			open_.push_back(o);
+			std::push_heap(open_.begin(), open_.end());
+			return Status::Running;
+		}
+		expansions_++;
+
+		if (o.key == s.goalKey) {
+			abstractPath_.clear();
+			for (auto key = s.goalKey; ; key = nodes_[key].parent) {
+				abstractPath_.push_back(key);
+				if (key == s.startKey) {
+					break;
+				}
+			}
+			return Status::Found;
+		}
+
+		updateEdges(ci);
+		for (const auto& e : nav_[ci].regions[o.key & 0xFFFF].edges) {
+			auto key = ((uint64_t)e.chunk << 16) | e.region;
+			auto g = o.g + e.cost;
+			auto it = nodes_.find(key);
+			if (it == nodes_.end() || (!it->second.closed && g < it->second.g)) {
+				nodes_[key] = {g, o.key, false};
+				open_.push_back({g + estimate(rep(key), s.goal), g, key});
+				std::push_heap(open_.begin(), open_.end());
+			}
+		}
+	}
+	return Status::NotFound;
+}
+
+
+void narf::Pathfinder::startBlockPath() {
+	auto& s = search_;
+	updateEdges((uint32_t)(s.goalKey >> 16)); // the region search stops before linking the goal's regions
+	corridor_.clear();
+	corridor_.insert(abstractPath_.begin(), abstractPath_.end());
+
+	auto start = blockKey(s.start);
+	nodes_.clear();
+	open_.clear();
+	nodes_[start] = {0.0f, start, false};
+	open_.push_back({BlockHeuristicWeight * estimate(s.start, s.goal), 0.0f, start});
+	s.phase = Phase::Block;
+}
+
+
+narf::Pathfinder::Status narf::Pathfinder::findBlockPath(const time& deadline, std::vector<BlockCoord>& path) {
+	auto& s = search_;
+	auto start = blockKey(s.start), goal = blockKey(s.goal);
+	for (uint32_t steps = 1; !open_.empty(); steps++) {
+		if (steps % BlockChecks == 0 && time::now() >= deadline) {
+			return Status::Running;
+		}
+		std::pop_heap(open_.begin(), open_.end());
+		auto o = open_.back();
+		open_.pop_back();
+		auto& node = nodes_[o.key];
+		if (node.closed) {
+			continue;
+		}
+		node.closed = true;
+		expansions_++;
+
+		if (o.key == goal) {
+			for (auto key = goal; ; key = nodes_[key].parent) {
+				path.push_back(blockCoord(key));
+				if (key == start) {
+					break;
+				}
+			}
+			std::reverse(path.begin(), path.end());
+			return Status::Found;
+		}
+
+		forEachMove(blockCoord(o.key), [&](const BlockCoord& t, float cost) {
+			if (!corridor_.count(regionKey(t))) {
+				return;
+			}
+			auto key = blockKey(t);
+			auto g = o.g + cost;
+			auto it = nodes_.find(key);
+			if (it == nodes_.end() || (!it->second.closed && g < it->second.g)) {
+				nodes_[key] = {g, o.key, false};
+				open_.push_back({g + BlockHeuristicWeight * estimate(t, s.goal), g, key});
+				std::push_heap(open_.begin(), open_.end());
+			}
+		});
+	}
+	return Status::NotFound;
+}
@@ -0,0 +1,262 @@
+/*
+ * NarfBlock pathfinding
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NARF_PATHFINDER_H
+#define NARF_PATHFINDER_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "narf/block.h"
+#include "narf/chunk.h"
+#include "narf/time.h"
+
+namespace narf {
+
+class World;
+
+/*
+ * Pathfinder finds walking paths for entities two blocks tall.
+ * A block is walkable if it and the block above it are not opaque and the
+ * block below it is. From a walkable block an entity can move to any of the
+ * 8 horizontally adjacent walkable blocks, stepping up or down one block
+ * (orthogonal moves only) if there is headroom.
+ *
+ * Searching block by block over long distances is too slow, so each chunk
+ * is divided into regions of walkable blocks connected within that chunk,
+ * and regions are linked to the regions of neighboring chunks they have
+ * moves into. A path is found by A* over the region graph first, and then by
+ * A* over blocks restricted to the regions along that path.
+ *
+ * Region data is built when a search first touches a chunk and rebuilt when
+ * the chunk's journal shows it (or the chunk above or below it) has changed,
+ * so modifying the world only costs the chunks that are searched again.
+ *
+ * Queued requests are searched one at a time, and a search that runs out of
+ * time in update() carries on from where it stopped in the next update().
+ * If a block changes in or next to a chunk the search has used, the search
+ * starts over.
+ */
+class Pathfinder {
+public:
+	typedef uint32_t RequestID;
+
+	// path runs from the start block to the goal block, inclusive; empty if found is false
+	typedef std::function<void(RequestID id, bool found, const std::vector<BlockCoord>& path)> Callback;
+
+	Pathfinder(World* world);
+
+	// queue a search to run during a later update()
+	// from and to are the blocks the entity's feet are in; either may be up to two blocks above the ground
+	RequestID request(const BlockCoord& from, const BlockCoord& to, Callback callback);
+
+	// drop a queued request without calling its callback; returns false if it already ran
+	bool cancel(RequestID id);
+
+	size_t pending() const { return requests_.size(); }
+
+	// run queued requests until budget has been used up, leaving the current one to be resumed next time
+	// the budget is checked between search steps, so it is overrun by at most one step
+	void update(timediff budget);
+
+	// search immediately
+	// a queued request that is partway through its search starts over in the next update()
+	bool findPath(const BlockCoord& from, const BlockCoord& to, std::vector<BlockCoord>& path);
+
+	// called when the block at wbc changes, to restart the current search if it relied on the old block
+	void blockChanged(const BlockCoord& wbc);
+
+	// called when the chunk at cc is replaced or unloaded, to rebuild its regions and restart the current
+	// search if it relied on them
+	void chunkChanged(const ChunkCoord& cc);
+
+	bool walkable(const BlockCoord& wbc);
+
+	// number of times a chunk's regions have been (re)built
+	uint64_t regionBuilds() const { return regionBuilds_; }
+
+	// number of region and block search nodes expanded
+	uint64_t expansions() const { return expansions_; }
+
+	// the block search checks the clock once per this many blocks; region expansions can build several chunks'
+	// regions, so the region search checks after every one (and after every chunk it builds)
+	static const uint32_t BlockChecks = 64;
+
+private:
+	static const uint16_t NoRegion = 0xFFFF;
+
+	// per-block flags
+	static const uint8_t Walk = 1; // walkable
+	static const uint8_t Headroom = 2; // the block two above is not opaque, so entities can step up from or down to here
+
+	struct Edge {
+		uint32_t chunk;
+		uint16_t region;
+		float cost;
+	};
+
+	struct Region {
+		BlockCoord rep; // walkable block near the middle of the region
+		std::vector<Edge> edges;
+	};
+
+	struct ChunkNav {
+		bool built;
+		uint64_t seq[3]; // journal seq() of this chunk and the chunks below and above it when built
+		uint64_t version; // changes whenever regions are rebuilt
+		std::vector<uint8_t> flags;
+		std::vector<uint16_t> region;
+		std::vector<Region> regions;
+
+		bool edgesBuilt;
+		uint64_t edgeDeps[27]; // versions of this chunk and its neighbors when edges were built
+
+		ChunkNav() : built(false), version(0), edgesBuilt(false) { }
+	};
+
+	struct Request {
+		RequestID id;
+		BlockCoord from, to;
+		Callback callback;
+	};
+
+	enum class Phase {
+		Idle, // no search in progress
+		Abstract, // searching the region graph
+		Block, // searching blocks in the regions along the abstract path
+	};
+
+	enum class Status {
+		Running,
+		Found,
+		NotFound,
+	};
+
+	// the search in progress for the front of requests_ (or for findPath())
+	struct Search {
+		Phase phase;
+		BlockCoord from, to; // as requested
+		BlockCoord start, goal; // on the ground
+		uint64_t startKey, goalKey;
+		std::unordered_set<uint32_t> chunks; // chunks whose regions the search has used
+		bool stale; // a block changed in or next to one of those chunks
+
+		Search() : phase(Phase::Idle), startKey(0), goalKey(0), stale(false) { }
+	};
+
+	struct SearchNode {
+		float g;
+		uint64_t parent;
+		bool closed;
+	};
+
+	// open list entry: f, g, key
+	struct Open {
+		float f, g;
+		uint64_t key;
+		bool operator<(const Open& rhs) const {
+			// the heap puts the largest first; prefer low f, then high g to dig toward the goal
+			return f > rhs.f || (f == rhs.f && g < rhs.g);
+		}
+	};
+
+	World* world_;
+	std::vector<ChunkNav> nav_;
+	uint64_t nextVersion_;
+	uint64_t regionBuilds_;
+	uint64_t expansions_;
+
+	std::deque<Request> requests_;
+	RequestID nextRequestID_;
+
+	// state of the current search; the containers are reused between searches
+	Search search_;
+	std::unordered_map<uint64_t, SearchNode> nodes_;
+	std::vector<Open> open_; // heap
+	std::vector<BlockCoord> path_;
+	std::unordered_set<uint64_t> corridor_;
+	std::vector<uint64_t> abstractPath_;
+	std::vector<uint32_t> stack_;
+
+	uint32_t chunkIndex(const ChunkCoord& cc) const;
+	ChunkCoord chunkCoord(uint32_t index) const;
+
+	// bring a chunk's regions up to date with the world
+	void updateRegions(uint32_t ci);
+	void buildRegions(uint32_t ci, Chunk* chunk);
+
+	// bring a chunk's region links up to date (also updates the neighbors' regions)
+	void updateEdges(uint32_t ci);
+
+	// bring the regions of a chunk and its neighbors up to date for updateEdges()
+	// returns false if deadline passed first (after at least one chunk was built), to be called again later
+	bool updateNeighborRegions(uint32_t ci, const time& deadline);
+
+	// restart the current search if it used the regions of the chunk at cc or next to it
+	void searchChanged(const ChunkCoord& cc);
+
+	// flags of a block as of the last updateRegions() of its chunk (0 if outside the world or not built yet)
+	uint8_t flags(const BlockCoord& wbc) const;
+
+	// chunk and region of a walkable block, as a search node key
+	uint64_t regionKey(const BlockCoord& wbc) const;
+
+	// block search node keys
+	uint64_t blockKey(const BlockCoord& c) const;
+	BlockCoord blockCoord(uint64_t key) const;
+
+	// call f(target, cost) for each move from walkable block c
+	template <typename F>
+	void forEachMove(const BlockCoord& c, F f) const;
+
+	// find the nearest walkable block at or up to two blocks below c
+	bool ground(BlockCoord& c);
+
+	// start (or restart) the search from from to to; false if there is no path
+	bool startSearch(const BlockCoord& from, const BlockCoord& to);
+
+	// run the search for a path from from to to until it finishes or deadline has passed
+	Status runSearch(const BlockCoord& from, const BlockCoord& to, const time& deadline, std::vector<BlockCoord>& path);
+
+	Status findAbstractPath(const time& deadline);
+	void startBlockPath();
+	Status findBlockPath(const time& deadline, std::vector<BlockCoord>& path);
+};
+
+} // namespace narf
+
+#endif // NARF_PATHFINDER_H
@@ -108,14 +108,9 @@ void narf::PlayerCommand::exec(narf::World* world) {
 		break;
 	case Type::TernaryAction:
 		// fire a new entity
-		auto eid = world->entityManager.newEntity();
-        narf::EntityRef ent(world->entityManager, eid);
-		ent->position = position;
-		ent->prevPosition = position;
-		ent->velocity = velocity + Vector3f(orientation).normalize() * 20.0f;
-		ent->model = true;
-		ent->bouncy = false;
-		ent->explodey = true;
+		world->entityManager.commands().spawn(FixedPoint3(position),
+			velocity + Vector3f(orientation).normalize() * 20.0f,
+			{Entity::Model, Entity::Explodey});
 		break;
 	}
 }
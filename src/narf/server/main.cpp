@@ -39,6 +39,7 @@ void cmdQuit(const std::string &args) {
 
 void cmdStats(const std::string& args) {
 	game->dumpTickTimeHistogram();
+	game->server.world->dumpChunkPoolStats();
 }
 
 
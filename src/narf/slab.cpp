@@ -0,0 +1,174 @@
+/*
+ * NarfBlock slab allocator
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "narf/slab.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// items are aligned to this many bytes within a slab
+static const size_t SlabItemAlign = 16;
+
+// slabs at least this large are mapped directly from the OS so they can be backed by huge pages
+static const size_t SlabMapThreshold = 2 * 1024 * 1024;
+
+
+narf::SlabPool::SlabPool(size_t itemSize, size_t slabSize) :
+	hugePages_(false), freeList_(nullptr), liveItems_(0), freeItems_(0) {
+	itemSize = std::max(itemSize, sizeof(FreeItem));
+	itemSize_ = (itemSize + SlabItemAlign - 1) & ~(SlabItemAlign - 1);
+	// rounded up, so that asking for SlabMapThreshold bytes gets a slab that is mapped
+	itemsPerSlab_ = std::max((slabSize + itemSize_ - 1) / itemSize_, (size_t)1);
+}
+
+
+narf::SlabPool::~SlabPool() {
+	assert(liveItems_ == 0);
+	for (auto& slab : slabs_) {
+#ifdef __linux__
+		if (slab.mapped) {
+			munmap(slab.mem, slab.size);
+			continue;
+		}
+#endif
+		::free(slab.mem);
+	}
+}
+
+
+void narf::SlabPool::addSlab() {
+	Slab slab;
+	slab.size = itemSize_ * itemsPerSlab_;
+	slab.mapped = false;
+	slab.mem = nullptr;
+
+#ifdef __linux__
+	if (slab.size >= SlabMapThreshold) {
+		// map an extra huge page's worth and trim it so the slab starts on a huge page boundary;
+		// otherwise only the whole huge pages that happen to fall inside it could be used
+		auto pageSize = (size_t)sysconf(_SC_PAGESIZE);
+		slab.size = (slab.size + pageSize - 1) & ~(pageSize - 1);
+		auto mapSize = slab.size + SlabMapThreshold;
+		void* mem = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem != MAP_FAILED) {
+			auto start = reinterpret_cast<uintptr_t>(mem);
+			auto aligned = (start + SlabMapThreshold - 1) & ~(uintptr_t)(SlabMapThreshold - 1);
+			if (aligned > start) {
+				munmap(mem, aligned - start);
+			}
+			auto end = aligned + slab.size;
+			if (end < start + mapSize) {
+				munmap(reinterpret_cast<void*>(end), start + mapSize - end);
+			}
+			mem = reinterpret_cast<void*>(aligned);
+#ifdef MADV_HUGEPAGE
+			if (hugePages_) {
+				madvise(mem, slab.size, MADV_HUGEPAGE);
+			}
+#endif
+			slab.mem = mem;
+			slab.mapped = true;
+		} else {
+			slab.size = itemSize_ * itemsPerSlab_;
+		}
+	}
+#endif
+
+	if (!slab.mem) {
+		slab.mem = malloc(slab.size);
+		if (!slab.mem) {
+			return;
+		}
+	}
+
+	slabs_.push_back(slab);
+
+	// thread the new items onto the free list in address order
+	auto base = static_cast<uint8_t*>(slab.mem);
+	for (size_t i = itemsPerSlab_; i-- > 0; ) {
+		auto item = reinterpret_cast<FreeItem*>(base + i * itemSize_);
+		item->next = freeList_;
+		freeList_ = item;
+	}
+	freeItems_ += itemsPerSlab_;
+}
+
+
+void* narf::SlabPool::alloc() {
+	if (!freeList_) {
+		addSlab();
+		if (!freeList_) {
+			return nullptr;
+		}
+	}
+
+	auto item = freeList_;
+	freeList_ = item->next;
+	freeItems_--;
+	liveItems_++;
+	return item;
+}
+
+
+void narf::SlabPool::free(void* p) {
+	if (!p) {
+		return;
+	}
+	assert(liveItems_ > 0);
+
+	auto item = static_cast<FreeItem*>(p);
+	item->next = freeList_;
+	freeList_ = item;
+	freeItems_++;
+	liveItems_--;
+}
+
+
+narf::SlabPool::Stats narf::SlabPool::stats() const {
+	Stats s;
+	s.slabs = slabs_.size();
+	s.mappedSlabs = (size_t)std::count_if(slabs_.begin(), slabs_.end(), [](const Slab& slab) { return slab.mapped; });
+	s.liveItems = liveItems_;
+	s.freeItems = freeItems_;
+	s.bytes = 0;
+	for (const auto& slab : slabs_) {
+		s.bytes += slab.size; // mapped slabs are rounded up to whole pages
+	}
+	return s;
+}
@@ -0,0 +1,105 @@
+/*
+ * NarfBlock slab allocator
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NARF_SLAB_H
+#define NARF_SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+namespace narf {
+
+/*
+ * SlabPool hands out fixed-size items carved from large slabs of memory.
+ * Freed items are kept on a free list and reused, so once the pool has grown
+ * to its working size, alloc() and free() never touch the system allocator.
+ */
+class SlabPool {
+public:
+	// itemSize: size of each item in bytes
+	// slabSize: minimum size of each slab in bytes, rounded up to a whole number of items
+	SlabPool(size_t itemSize, size_t slabSize);
+	~SlabPool();
+
+	// get an uninitialized item
+	void* alloc();
+
+	// return an item obtained from alloc() to the pool
+	void free(void* item);
+
+	// request transparent huge pages for slabs allocated from now on (if supported by the OS)
+	void setHugePages(bool enable) { hugePages_ = enable; }
+
+	size_t itemSize() const { return itemSize_; }
+
+	struct Stats {
+		size_t slabs; // number of slabs allocated
+		size_t mappedSlabs; // slabs mapped directly from the OS rather than taken from malloc()
+		size_t liveItems; // items currently handed out
+		size_t freeItems; // items available for reuse without allocating a new slab
+		size_t bytes; // total memory held by slabs
+	};
+
+	Stats stats() const;
+
+	// no copying
+	SlabPool(const SlabPool&) = delete;
+	SlabPool& operator=(const SlabPool&) = delete;
+
+private:
+	struct FreeItem {
+		FreeItem* next;
+	};
+
+	struct Slab {
+		void* mem;
+		size_t size;
+		bool mapped; // allocated with mmap() rather than malloc()
+	};
+
+	size_t itemSize_;
+	size_t itemsPerSlab_;
+	bool hugePages_;
+
+	std::vector<Slab> slabs_;
+	FreeItem* freeList_;
+	size_t liveItems_;
+	size_t freeItems_;
+
+	void addSlab();
+};
+
+} // namespace narf
+
+#endif // NARF_SLAB_H
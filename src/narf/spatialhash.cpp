@@ -0,0 +1,90 @@
+/*
+ * NarfBlock spatial hash
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "narf/spatialhash.h"
+
+#include <assert.h>
+
+
+const uint32_t narf::SpatialHash::Invalid;
+
+
+narf::SpatialHash::SpatialHash(float cellSize) :
+	cellSize_(cellSize), invCellSize_(1.0f / cellSize), size_(0) {
+	assert(cellSize > 0.0f);
+}
+
+
+void narf::SpatialHash::update(uint32_t item, const Point3f& p) {
+	auto k = key(cellCoord(p));
+	if (contains(item)) {
+		if (itemCell_[item] == k) {
+			return;
+		}
+		remove(item);
+	}
+
+	if (item >= itemCell_.size()) {
+		itemCell_.resize(item + 1, 0);
+		itemIndex_.resize(item + 1, Invalid);
+	}
+
+	auto& cell = cells_[k];
+	itemCell_[item] = k;
+	itemIndex_[item] = static_cast<uint32_t>(cell.size());
+	cell.push_back(item);
+	size_++;
+}
+
+
+void narf::SpatialHash::remove(uint32_t item) {
+	if (!contains(item)) {
+		return;
+	}
+
+	auto cellIter = cells_.find(itemCell_[item]);
+	assert(cellIter != cells_.end());
+	auto& cell = cellIter->second;
+
+	// move the last item in the cell into the hole
+	auto index = itemIndex_[item];
+	auto last = cell.back();
+	cell[index] = last;
+	itemIndex_[last] = index;
+	cell.pop_back();
+	itemIndex_[item] = Invalid;
+	size_--;
+
+	if (cell.empty()) {
+		cells_.erase(cellIter);
+	}
+}
@@ -0,0 +1,225 @@
+/*
+ * NarfBlock spatial hash
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NARF_SPATIALHASH_H
+#define NARF_SPATIALHASH_H
+
+#include <stdint.h>
+#include <math.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "narf/math/vector.h"
+
+namespace narf {
+
+/*
+ * SpatialHash sorts small integer items (e.g. entity slots) into a uniform grid
+ * of cubic cells by position, so nearby items can be found without looking at
+ * all of them. Only occupied cells are stored.
+ */
+class SpatialHash {
+public:
+	typedef Point3<int32_t> CellCoord;
+
+	SpatialHash(float cellSize);
+
+	float cellSize() const { return cellSize_; }
+
+	// add item at position p, or move it if it is already present
+	// moving within the same cell only costs a cell coordinate comparison
+	void update(uint32_t item, const Point3f& p);
+
+	void remove(uint32_t item);
+
+	bool contains(uint32_t item) const { return item < itemCell_.size() && itemIndex_[item] != Invalid; }
+
+	size_t size() const { return size_; }
+	size_t numCells() const { return cells_.size(); }
+
+	// positions beyond the range of cell coordinates are clamped into the outermost cells
+	CellCoord cellCoord(const Point3f& p) const
+	{
+		return CellCoord(cellCoord(p.x), cellCoord(p.y), cellCoord(p.z));
+	}
+
+	// call f(item) for every item in a cell that overlaps the box from min to max
+	template<typename F>
+	void forEachInBox(const Point3f& min, const Point3f& max, F f) const
+	{
+		auto c1 = cellCoord(min);
+		auto c2 = cellCoord(max);
+		if (c1.x > c2.x || c1.y > c2.y || c1.z > c2.z) {
+			return;
+		}
+
+		// a box with more cells than there are occupied ones is quicker to check cell by occupied cell
+		auto boxCells = (uint64_t)(c2.x - c1.x + 1) * (uint64_t)(c2.y - c1.y + 1) * (uint64_t)(c2.z - c1.z + 1);
+		if (boxCells > cells_.size()) {
+			for (const auto& cell : cells_) {
+				auto c = coord(cell.first);
+				if (c.x >= c1.x && c.y >= c1.y && c.z >= c1.z && c.x <= c2.x && c.y <= c2.y && c.z <= c2.z) {
+					for (auto item : cell.second) {
+						f(item);
+					}
+				}
+			}
+			return;
+		}
+
+		for (int32_t z = c1.z; z <= c2.z; z++) {
+			for (int32_t y = c1.y; y <= c2.y; y++) {
+				for (int32_t x = c1.x; x <= c2.x; x++) {
+					forEachInCell({x, y, z}, f);
+				}
+			}
+		}
+	}
+
+	// call f(item) for every item in the cells at Chebyshev distance ring from cell c, so that searching
+	// rings 0, 1, 2... visits every cell once while moving outward
+	template<typename F>
+	void forEachInRing(const CellCoord& c, int32_t ring, F f) const
+	{
+		for (int32_t dz = -ring; dz <= ring; dz++) {
+			for (int32_t dy = -ring; dy <= ring; dy++) {
+				if (dz == -ring || dz == ring || dy == -ring || dy == ring) {
+					for (int32_t dx = -ring; dx <= ring; dx++) {
+						forEachInCell({c.x + dx, c.y + dy, c.z + dz}, f);
+					}
+				} else {
+					forEachInCell({c.x - ring, c.y + dy, c.z + dz}, f);
+					forEachInCell({c.x + ring, c.y + dy, c.z + dz}, f);
+				}
+			}
+		}
+	}
+
+	// call f(item) for every item
+	template<typename F>
+	void forEach(F f) const
+	{
+		for (const auto& cell : cells_) {
+			for (auto item : cell.second) {
+				f(item);
+			}
+		}
+	}
+
+	// call f(a, b) once for every pair of items in the same or adjacent cells
+	template<typename F>
+	void forEachNearbyPair(F f) const
+	{
+		// each pair of cells is visited once by pairing every cell with the 13 neighbors "after" it
+		static const int8_t forward[13][3] = {
+			{1, 0, 0}, {-1, 1, 0}, {0, 1, 0}, {1, 1, 0},
+			{-1, -1, 1}, {0, -1, 1}, {1, -1, 1}, {-1, 0, 1}, {0, 0, 1}, {1, 0, 1}, {-1, 1, 1}, {0, 1, 1}, {1, 1, 1},
+		};
+		for (const auto& cell : cells_) {
+			const auto& items = cell.second;
+			for (size_t i = 0; i < items.size(); i++) {
+				for (size_t j = i + 1; j < items.size(); j++) {
+					f(items[i], items[j]);
+				}
+			}
+			auto c = coord(cell.first);
+			for (const auto& d : forward) {
+				auto neighbor = cells_.find(key({c.x + d[0], c.y + d[1], c.z + d[2]}));
+				if (neighbor == cells_.end()) {
+					continue;
+				}
+				for (auto a : items) {
+					for (auto b : neighbor->second) {
+						f(a, b);
+					}
+				}
+			}
+		}
+	}
+
+private:
+	static const uint32_t Invalid = UINT32_MAX;
+
+	// cell coordinates are packed into 21 bits each
+	typedef uint64_t Key;
+	static const int32_t KeyBias = 1 << 20;
+	static const uint64_t KeyMask = (1u << 21) - 1;
+
+	int32_t cellCoord(float v) const
+	{
+		return (int32_t)fminf(fmaxf(floorf(v * invCellSize_), (float)-KeyBias), (float)(KeyBias - 1));
+	}
+
+	template<typename F>
+	void forEachInCell(const CellCoord& c, F f) const
+	{
+		if (c.x < -KeyBias || c.y < -KeyBias || c.z < -KeyBias || c.x >= KeyBias || c.y >= KeyBias || c.z >= KeyBias) {
+			return; // would alias a cell on the other side
+		}
+		auto cell = cells_.find(key(c));
+		if (cell != cells_.end()) {
+			for (auto item : cell->second) {
+				f(item);
+			}
+		}
+	}
+
+	static Key key(const CellCoord& c)
+	{
+		return ((uint64_t)(c.x + KeyBias) & KeyMask) |
+			(((uint64_t)(c.y + KeyBias) & KeyMask) << 21) |
+			(((uint64_t)(c.z + KeyBias) & KeyMask) << 42);
+	}
+
+	static CellCoord coord(Key k)
+	{
+		return CellCoord(
+			(int32_t)(k & KeyMask) - KeyBias,
+			(int32_t)((k >> 21) & KeyMask) - KeyBias,
+			(int32_t)((k >> 42) & KeyMask) - KeyBias);
+	}
+
+	float cellSize_;
+	float invCellSize_;
+	size_t size_;
+
+	std::unordered_map<Key, std::vector<uint32_t>> cells_;
+
+	// per item: the cell it is in and its index in that cell's list (Invalid if not present)
+	std::vector<Key> itemCell_;
+	std::vector<uint32_t> itemIndex_;
+};
+
+} // namespace narf
+
+#endif // NARF_SPATIALHASH_H
@@ -0,0 +1,50 @@
+#include <gtest/gtest.h>
+
+#include "narf/chunkstream.h"
+#include "narf/world.h"
+
+TEST(ChunkStream, NearestFirst) {
+	narf::World world(512, 512, 64, 16, 16, 16); // 32x32x4 chunks
+	narf::ChunkStream stream;
+
+	// only the chunks in range are queued, however big the world is, and they come out nearest first
+	stream.update(world, {10, 10, 1}, 2);
+	EXPECT_EQ(0u, stream.size());
+	auto queued = stream.queued();
+	EXPECT_LT(queued, 5u * 5u * 4u);
+	narf::ChunkCoord cc;
+	ASSERT_TRUE(stream.next(cc));
+	EXPECT_EQ(narf::ChunkCoord(10, 10, 1), cc);
+	stream.sent(cc, 1);
+	int32_t last = 0;
+	for (int i = 0; i < 10 && stream.next(cc); i++) {
+		auto d = (cc.x - 10) * (cc.x - 10) + (cc.y - 10) * (cc.y - 10) + (cc.z - 1) * (cc.z - 1);
+		EXPECT_GE(d, last);
+		last = d;
+		stream.sent(cc, 1);
+	}
+	EXPECT_EQ(11u, stream.size());
+	EXPECT_TRUE(stream.has({10, 10, 1}));
+
+	// only chunks that were sent can be out of date
+	EXPECT_FALSE(stream.outdated({10, 10, 1}, 1));
+	EXPECT_TRUE(stream.outdated({10, 10, 1}, 2));
+	EXPECT_FALSE(stream.outdated({20, 20, 1}, 2));
+
+	// moving one chunk over keeps what was sent and reprioritises the rest around the new center
+	stream.update(world, {11, 10, 1}, 2);
+	EXPECT_TRUE(stream.unloaded().empty());
+	ASSERT_TRUE(stream.next(cc));
+	EXPECT_EQ(1, std::abs(cc.x - 11) + std::abs(cc.y - 10) + std::abs(cc.z - 1));
+
+	// moving far away drops everything sent
+	while (stream.next(cc)) {
+		stream.sent(cc, 1);
+	}
+	auto sent = stream.size();
+	stream.update(world, {25, 25, 1}, 2);
+	EXPECT_EQ(sent, stream.unloaded().size());
+	EXPECT_EQ(0u, stream.size());
+	EXPECT_FALSE(stream.has({10, 10, 1}));
+	EXPECT_EQ(queued, stream.queued());
+}
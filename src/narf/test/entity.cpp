@@ -0,0 +1,773 @@
+#include <math.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <set>
+
+#include "narf/console.h"
+#include "narf/interest.h"
+#include "narf/world.h"
+
+TEST(EntityManager, Lookup) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	auto& em = world.entityManager;
+
+	std::vector<narf::Entity::ID> ids;
+	for (int i = 0; i < 10; i++) {
+		auto id = em.newEntity();
+		ids.push_back(id);
+		narf::EntityRef ent(em, id);
+		ASSERT_NE(nullptr, ent.ent);
+		ent->position = narf::FixedPoint3(narf::Point3f((float)i, 0.0f, 0.0f));
+	}
+	EXPECT_EQ(10u, em.getNumEntities());
+
+	// delete from the middle; the others must still be found with their own state
+	em.deleteEntity(ids[3]);
+	em.deleteEntity(ids[0]);
+	em.deleteEntity(ids[0]); // already gone
+	EXPECT_EQ(8u, em.getNumEntities());
+
+	for (int i = 0; i < 10; i++) {
+		narf::EntityRef ent(em, ids[(size_t)i]);
+		if (i == 0 || i == 3) {
+			EXPECT_EQ(nullptr, ent.ent);
+		} else {
+			ASSERT_NE(nullptr, ent.ent);
+			EXPECT_EQ(ids[(size_t)i], ent->id);
+			EXPECT_EQ((float)i, ent->position.toFloat().x);
+		}
+	}
+
+	EXPECT_EQ(nullptr, narf::EntityRef(em, 1000).ent);
+
+	// freed slots are reused, but with a new generation so the old IDs stay dead
+	auto id = em.newEntity();
+	auto index = narf::Entity::index(id);
+	EXPECT_TRUE(index == narf::Entity::index(ids[0]) || index == narf::Entity::index(ids[3]));
+	EXPECT_NE(ids[0], id);
+	EXPECT_NE(ids[3], id);
+	EXPECT_NE(nullptr, narf::EntityRef(em, id).ent);
+	EXPECT_EQ(nullptr, narf::EntityRef(em, ids[0]).ent);
+	EXPECT_EQ(nullptr, narf::EntityRef(em, ids[3]).ent);
+}
+
+TEST(EntityManager, StableRefs) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	auto& em = world.entityManager;
+
+	auto id = em.newEntity();
+	narf::EntityRef ref(em, id);
+	ASSERT_TRUE(ref.valid());
+	ref->position = narf::FixedPoint3(narf::Point3f(1.0f, 2.0f, 3.0f));
+
+	// creating and deleting lots of other entities must not move this one
+	std::vector<narf::Entity::ID> others;
+	for (int i = 0; i < 2000; i++) {
+		others.push_back(em.newEntity());
+	}
+	for (size_t i = 0; i < others.size(); i += 2) {
+		em.deleteEntity(others[i]);
+	}
+	EXPECT_TRUE(ref.valid());
+	EXPECT_EQ(ref.ent, narf::EntityRef(em, id).ent);
+	EXPECT_EQ(2.0f, ref->position.toFloat().y);
+
+	size_t count = 0;
+	for (auto& ent : em.getEntities()) {
+		EXPECT_NE(narf::Entity::InvalidID, ent.id);
+		count++;
+	}
+	EXPECT_EQ(1001u, count);
+
+	em.deleteEntity(id);
+	EXPECT_FALSE(ref.valid());
+}
+
+TEST(EntityManager, Tags) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	world.setGravity(-24.0f);
+	auto& em = world.entityManager;
+
+	auto a = em.newEntity();
+	auto b = em.newEntity();
+	narf::EntityRef refA(em, a);
+	narf::EntityRef refB(em, b);
+	refA->set(narf::Entity::Model);
+	refA->set(narf::Entity::Antigrav);
+	refB->set(narf::Entity::Bouncy);
+
+	EXPECT_TRUE(refA->has(narf::Entity::Model));
+	EXPECT_TRUE(refA->has(narf::Entity::Antigrav));
+	EXPECT_FALSE(refA->has(narf::Entity::Bouncy));
+	EXPECT_FALSE(refB->has(narf::Entity::Model));
+
+	size_t models = 0;
+	for (auto& ent : em.getEntities(narf::Entity::Model)) {
+		EXPECT_EQ(a, ent.id);
+		models++;
+	}
+	EXPECT_EQ(1u, models);
+
+	// antigrav entities float, others fall
+	refA->position = narf::FixedPoint3(narf::Point3f(8.0f, 8.0f, 60.0f));
+	refB->position = narf::FixedPoint3(narf::Point3f(9.0f, 8.0f, 60.0f));
+	world.update(0.1);
+	EXPECT_EQ(60.0f, refA->position.toFloat().z);
+	EXPECT_EQ(60.0f, refA->prevPosition.toFloat().z);
+	EXPECT_LT(refB->position.toFloat().z, 60.0f);
+	EXPECT_EQ(60.0f, refB->prevPosition.toFloat().z);
+
+	// tags do not survive into a reused slot
+	em.deleteEntity(a);
+	auto c = em.newEntity();
+	ASSERT_EQ(narf::Entity::index(a), narf::Entity::index(c));
+	narf::EntityRef refC(em, c);
+	EXPECT_FALSE(refC->has(narf::Entity::Model));
+	EXPECT_FALSE(refC->has(narf::Entity::Antigrav));
+}
+
+// deserializeEntityUpdate() logs to the console
+class SilentConsole : public narf::Console {
+public:
+	void println(const std::string& s) override { }
+	std::string pollInput() override { return ""; }
+};
+
+TEST(EntityManager, SnapshotDeltas) {
+	SilentConsole silent;
+	narf::console = &silent;
+
+	narf::World server(64, 64, 64, 16, 16, 16), client(64, 64, 64, 16, 16, 16);
+	auto& em = server.entityManager;
+	std::vector<narf::Entity::ID> ids;
+	for (int i = 0; i < 3; i++) {
+		auto id = em.newEntity();
+		narf::EntityRef ent(em, id);
+		ent->position = narf::FixedPoint3(narf::Point3f(1.0f + (float)i, 2.0f, 3.0f));
+		ent->velocity = narf::Vector3f(4.0f, 5.0f, 6.0f);
+		ent->set(narf::Entity::Model);
+		ids.push_back(id);
+	}
+
+	narf::SnapshotHistory sent;
+	uint64_t tick = 0;
+	auto send = [&](const std::vector<narf::Entity::ID>& kept, const std::vector<narf::Entity::ID>& changed) {
+		auto& snap = sent.add(++tick);
+		narf::ByteStream bs;
+		em.serializeSnapshot(bs, sent.find(sent.acked()), snap, kept, changed, em.checksum(kept));
+		bs.seek(0);
+		client.entityManager.deserializeEntityUpdate(bs);
+		sent.ack(client.entityManager.lastSnapshotTick());
+		return bs.size();
+	};
+
+	// nothing to send changes from: every field of every entity
+	send({}, ids);
+	EXPECT_EQ(em.checksum(), client.entityManager.checksum());
+	narf::EntityRef copied(client.entityManager, ids[1]);
+	ASSERT_TRUE(copied.valid());
+	EXPECT_EQ(2.0f, copied->position.toFloat().x);
+	EXPECT_EQ(6.0f, copied->velocity.z);
+	EXPECT_TRUE(copied->has(narf::Entity::Model));
+
+	// one entity moved along x and the last is forgotten: the header, one removed ID, and for the moved entity
+	// its ID, the mask and a 2-byte position change
+	narf::EntityRef moved(em, ids[0]);
+	moved->position += narf::Vector3f(0.0625f, 0.0f, 0.0f);
+	EXPECT_EQ(1u + 8u + 1u + 8u + (1u + 1u) + (1u + 1u + 1u + 2u), send({ids[1]}, {ids[0]}));
+	EXPECT_EQ(em.checksum({ids[0], ids[1]}), client.entityManager.checksum({ids[0], ids[1]}));
+
+	// unchanged since the acknowledged snapshot: just the mask
+	EXPECT_EQ(1u + 8u + 1u + 8u + 1u + (1u + 1u + 1u), send({ids[0], ids[1]}, {ids[1]}));
+
+	narf::console = nullptr;
+}
+
+TEST(EntityManager, SnapshotLoss) {
+	SilentConsole silent;
+	narf::console = &silent;
+
+	narf::World server(64, 64, 64, 16, 16, 16), client(64, 64, 64, 16, 16, 16);
+	auto& em = server.entityManager;
+	auto a = em.newEntity();
+	narf::EntityRef(em, a)->position = narf::FixedPoint3(narf::Point3f(8.0f, 8.0f, 60.0f));
+
+	narf::SnapshotHistory sent;
+	uint64_t tick = 0;
+	auto snapshot = [&](const std::vector<narf::Entity::ID>& kept, const std::vector<narf::Entity::ID>& changed) {
+		auto& snap = sent.add(++tick);
+		narf::ByteStream bs;
+		em.serializeSnapshot(bs, sent.find(sent.acked()), snap, kept, changed, em.checksum(kept));
+		return bs;
+	};
+	auto deliver = [&](narf::ByteStream bs) {
+		bs.seek(0);
+		client.entityManager.deserializeEntityUpdate(bs);
+		sent.ack(client.entityManager.lastSnapshotTick());
+	};
+
+	// nothing was acknowledged, so the second snapshot does not depend on the lost first one,
+	// and the first is ignored when it turns up late
+	auto first = snapshot({}, {a});
+	deliver(snapshot({}, {a}));
+	ASSERT_NE(nullptr, client.entityManager.getEntity(a));
+	deliver(first);
+	EXPECT_EQ(2u, client.entityManager.lastSnapshotTick());
+
+	// an entity deleted before the snapshot that creates it arrives stays deleted
+	auto b = em.newEntity();
+	auto late = snapshot({a}, {b});
+	em.deleteEntity(b);
+	narf::ByteStream deleted;
+	em.serializeEntityDelete(deleted, b);
+	deliver(deleted);
+	deliver(late);
+	EXPECT_EQ(3u, client.entityManager.lastSnapshotTick());
+	EXPECT_EQ(nullptr, client.entityManager.getEntity(b));
+
+	// a correction is drawn from where the entity was and blended in over a few updates
+	narf::EntityRef(em, a)->position += narf::Vector3f(1.0f, 0.0f, 0.0f);
+	deliver(snapshot({a}, {a}));
+	narf::EntityRef copy(client.entityManager, a);
+	EXPECT_TRUE(em.getEntity(a)->position == copy->position);
+	EXPECT_NEAR(-1.0f, client.entityManager.renderOffset(*copy.ent).x, 1e-4f);
+	for (int i = 0; i < 30; i++) {
+		client.update(1.0 / 60.0);
+	}
+	EXPECT_EQ(0.0f, client.entityManager.renderOffset(*copy.ent).x);
+
+	narf::console = nullptr;
+}
+
+TEST(EntityManager, LeaveAndReenterInterest) {
+	SilentConsole silent;
+	narf::console = &silent;
+
+	narf::World server(64, 64, 64, 16, 16, 16), client(64, 64, 64, 16, 16, 16);
+	auto& em = server.entityManager;
+	auto a = em.newEntity();
+	narf::EntityRef(em, a)->set(narf::Entity::Antigrav);
+
+	// what the server does for a client every tick
+	narf::InterestSet interest;
+	narf::SnapshotHistory sent;
+	narf::Point3f center(8.0f, 8.0f, 60.0f);
+	auto tick = [&](const narf::Point3f& position) {
+		if (em.getEntity(a)) {
+			em.getEntity(a)->position = narf::FixedPoint3(position);
+			em.positionChanged(a);
+		}
+		server.update(1.0 / 60.0);
+		interest.update(em, center, 16.0f, server.tick());
+		for (auto id : interest.left()) {
+			narf::ByteStream bs;
+			if (em.getEntity(id)) {
+				em.serializeEntityForget(bs, id, server.tick());
+			} else {
+				em.serializeEntityDelete(bs, id);
+			}
+			bs.seek(0);
+			client.entityManager.deserializeEntityUpdate(bs);
+		}
+		auto& snap = sent.add(server.tick());
+		narf::ByteStream bs;
+		em.serializeSnapshot(bs, sent.find(sent.acked()), snap, interest.kept(), interest.send(), em.checksum(interest.kept()));
+		bs.seek(0);
+		client.entityManager.deserializeEntityUpdate(bs);
+		sent.ack(client.entityManager.lastSnapshotTick());
+	};
+
+	tick({10.0f, 8.0f, 60.0f});
+	EXPECT_NE(nullptr, client.entityManager.getEntity(a));
+	tick({40.0f, 8.0f, 60.0f});
+	EXPECT_EQ(nullptr, client.entityManager.getEntity(a));
+
+	// out of range is not deleted: the entity comes back, and stays
+	for (int i = 0; i < 20; i++) {
+		tick({10.0f, 8.0f, 60.0f});
+		ASSERT_NE(nullptr, client.entityManager.getEntity(a));
+	}
+	EXPECT_TRUE(em.getEntity(a)->position == client.entityManager.getEntity(a)->position);
+
+	// a real deletion still keeps late snapshots from bringing it back
+	em.deleteEntity(a);
+	tick({10.0f, 8.0f, 60.0f});
+	EXPECT_EQ(nullptr, client.entityManager.getEntity(a));
+
+	narf::console = nullptr;
+}
+
+TEST(EntityManager, SnapshotLossOfSleepingEntity) {
+	SilentConsole silent;
+	narf::console = &silent;
+
+	narf::World server(64, 64, 64, 16, 16, 16), client(64, 64, 64, 16, 16, 16); // generated terrain stays below z = 50
+	server.setGravity(-24.0f);
+	auto& em = server.entityManager;
+	narf::Block b;
+	b.id = 2;
+	server.putBlock(&b, {50, 50, 56});
+	auto a = em.newEntity();
+	narf::EntityRef(em, a)->position = narf::FixedPoint3(narf::Point3f(50.5f, 50.5f, 57.0f));
+	em.positionChanged(a);
+
+	// what the server does for a client every tick, except that the snapshot may be lost
+	narf::InterestSet interest;
+	narf::SnapshotHistory sent;
+	auto loseRest = false; // lose the snapshot of the tick the entity falls asleep in
+	auto tick = [&](const narf::Point3f& center, bool lost) {
+		auto wasAsleep = em.getEntity(a)->asleep();
+		server.update(1.0 / 60.0);
+		lost = lost || (loseRest && !wasAsleep && em.getEntity(a)->asleep());
+		interest.update(em, center, 64.0f, server.tick());
+		auto& snap = sent.add(server.tick());
+		narf::ByteStream bs;
+		em.serializeSnapshot(bs, sent.find(sent.acked()), snap, interest.kept(), interest.send(), em.checksum(interest.kept()));
+		if (!lost) {
+			bs.seek(0);
+			client.entityManager.deserializeEntityUpdate(bs);
+			sent.ack(client.entityManager.lastSnapshotTick());
+		}
+	};
+
+	narf::Point3f far(0.0f, 0.0f, 0.0f), near(50.0f, 50.0f, 60.0f);
+	for (int i = 0; i < 60; i++) {
+		tick(far, false);
+	}
+	ASSERT_TRUE(em.getEntity(a)->asleep());
+
+	// the snapshot that brings the sleeping entity in is lost
+	tick(near, true);
+	for (int i = 0; i < 10; i++) {
+		tick(near, false);
+	}
+	ASSERT_NE(nullptr, client.entityManager.getEntity(a));
+	EXPECT_TRUE(em.getEntity(a)->position == client.entityManager.getEntity(a)->position);
+
+	// it is pushed off the block, and the snapshot with the state it comes to rest in is lost
+	em.getEntity(a)->velocity = narf::Vector3f(3.0f, 0.0f, 0.0f);
+	em.getEntity(a)->wake();
+	loseRest = true;
+	for (int i = 0; i < 600 && !(i > 0 && em.getEntity(a)->asleep()); i++) {
+		tick(near, false);
+	}
+	ASSERT_TRUE(em.getEntity(a)->asleep());
+	ASSERT_LT(em.getEntity(a)->position.toFloat().z, 56.0f);
+	EXPECT_FALSE(client.entityManager.getEntity(a)->asleep());
+	for (int i = 0; i < 10; i++) {
+		tick(near, false);
+	}
+	EXPECT_TRUE(client.entityManager.getEntity(a)->asleep());
+	EXPECT_TRUE(em.getEntity(a)->state().position == client.entityManager.getEntity(a)->position);
+
+	narf::console = nullptr;
+}
+
+// scatter antigrav entities randomly in a box and return their IDs
+static std::vector<narf::Entity::ID> scatterEntities(narf::EntityManager& em, size_t count, float size, std::mt19937& rng) {
+	std::uniform_real_distribution<float> coord(0.0f, size);
+	std::vector<narf::Entity::ID> ids;
+	for (size_t i = 0; i < count; i++) {
+		auto id = em.newEntity();
+		narf::EntityRef ent(em, id);
+		ent->set(narf::Entity::Antigrav);
+		ent->position = narf::FixedPoint3(narf::Point3f(coord(rng), coord(rng), coord(rng)));
+		em.positionChanged(id);
+		ids.push_back(id);
+	}
+	return ids;
+}
+
+TEST(EntityManager, SpatialQueries) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	auto& em = world.entityManager;
+	std::mt19937 rng(1234);
+	auto ids = scatterEntities(em, 400, 30.0f, rng);
+
+	for (int round = 0; round < 2; round++) {
+		narf::Point3f center(15.0f, 15.0f, 15.0f);
+		std::vector<narf::Entity::ID> found;
+
+		em.findInRadius(center, 6.0f, found);
+		std::set<narf::Entity::ID> expected;
+		for (auto id : ids) {
+			if ((narf::EntityRef(em, id)->position.toFloat() - center).length() <= 6.0f) {
+				expected.insert(id);
+			}
+		}
+		EXPECT_EQ(expected, std::set<narf::Entity::ID>(found.begin(), found.end()));
+
+		narf::AABB box(center, narf::Vector3f(3.0f, 5.0f, 2.0f));
+		found.clear();
+		em.findInAABB(box, found);
+		expected.clear();
+		for (auto id : ids) {
+			if (narf::EntityRef(em, id)->getAABB().intersect(box)) {
+				expected.insert(id);
+			}
+		}
+		EXPECT_EQ(expected, std::set<narf::Entity::ID>(found.begin(), found.end()));
+
+		found.clear();
+		em.findNearest(center, 5, 100.0f, found);
+		auto sorted = ids;
+		std::sort(sorted.begin(), sorted.end(), [&](narf::Entity::ID a, narf::Entity::ID b) {
+			return (narf::EntityRef(em, a)->position.toFloat() - center).lengthSquared() <
+				(narf::EntityRef(em, b)->position.toFloat() - center).lengthSquared();
+		});
+		ASSERT_EQ(5u, found.size());
+		EXPECT_TRUE(std::equal(found.begin(), found.end(), sorted.begin()));
+
+		// unbounded queries find everything, without visiting every cell of a huge box
+		found.clear();
+		em.findNearest(center, ids.size() + 10, INFINITY, found);
+		EXPECT_EQ(std::set<narf::Entity::ID>(ids.begin(), ids.end()), std::set<narf::Entity::ID>(found.begin(), found.end()));
+		for (size_t i = 1; i < found.size(); i++) {
+			EXPECT_LE((narf::EntityRef(em, found[i - 1])->position.toFloat() - center).lengthSquared(),
+				(narf::EntityRef(em, found[i])->position.toFloat() - center).lengthSquared());
+		}
+		found.clear();
+		em.findInRadius(center, 1e30f, found);
+		EXPECT_EQ(ids.size(), found.size());
+
+		std::vector<std::pair<narf::Entity::ID, narf::Entity::ID>> pairs;
+		em.findOverlaps(pairs);
+		std::set<std::pair<narf::Entity::ID, narf::Entity::ID>> foundPairs, expectedPairs;
+		for (auto& pair : pairs) {
+			foundPairs.insert(std::minmax(pair.first, pair.second));
+		}
+		EXPECT_EQ(pairs.size(), foundPairs.size()); // no duplicates
+		for (size_t i = 0; i < ids.size(); i++) {
+			for (size_t j = i + 1; j < ids.size(); j++) {
+				if (narf::EntityRef(em, ids[i])->getAABB().intersect(narf::EntityRef(em, ids[j])->getAABB())) {
+					expectedPairs.insert(std::minmax(ids[i], ids[j]));
+				}
+			}
+		}
+		EXPECT_FALSE(expectedPairs.empty());
+		EXPECT_EQ(expectedPairs, foundPairs);
+
+		// move everything and check again
+		std::uniform_real_distribution<float> v(-40.0f, 40.0f);
+		for (auto id : ids) {
+			narf::EntityRef(em, id)->velocity = narf::Vector3f(v(rng), v(rng), v(rng));
+		}
+		world.update(0.1);
+	}
+}
+
+TEST(EntityManager, OverlapsMatchBruteForce) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	auto& em = world.entityManager;
+	std::mt19937 rng(5678);
+	auto ids = scatterEntities(em, 2000, 40.0f, rng);
+
+	std::uniform_real_distribution<float> v(-2.0f, 2.0f);
+	for (auto id : ids) {
+		narf::EntityRef(em, id)->velocity = narf::Vector3f(v(rng), v(rng), v(rng));
+	}
+	for (int i = 0; i < 5; i++) {
+		world.update(1.0 / 60.0);
+	}
+
+	size_t bruteForcePairs = 0;
+	std::vector<narf::AABB> boxes;
+	for (auto& ent : em.getEntities()) {
+		boxes.push_back(ent.getAABB());
+	}
+	for (size_t i = 0; i < boxes.size(); i++) {
+		for (size_t j = i + 1; j < boxes.size(); j++) {
+			bruteForcePairs += boxes[i].intersect(boxes[j]);
+		}
+	}
+
+	std::vector<std::pair<narf::Entity::ID, narf::Entity::ID>> pairs;
+	em.findOverlaps(pairs);
+	EXPECT_GT(bruteForcePairs, 0u);
+	EXPECT_EQ(bruteForcePairs, pairs.size());
+}
+
+// run the same simulation with the given number of update threads and return the final entity states
+static std::vector<std::pair<narf::FixedPoint3, narf::Vector3f>> simulate(size_t threads, size_t& numEntities, std::vector<uint8_t>& blocks) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	world.setGravity(-24.0f);
+	auto& em = world.entityManager;
+	em.setUpdateThreads(threads);
+
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> coord(2.0f, 62.0f);
+	std::uniform_real_distribution<float> v(-10.0f, 10.0f);
+	std::vector<narf::Entity::ID> ids;
+	for (int i = 0; i < 5000; i++) {
+		auto id = em.newEntity();
+		narf::EntityRef ent(em, id);
+		ent->position = narf::FixedPoint3(narf::Point3f(coord(rng), coord(rng), coord(rng)));
+		ent->velocity = narf::Vector3f(v(rng), v(rng), v(rng));
+		if (i % 50 == 0) {
+			ent->set(narf::Entity::Explodey);
+		} else if (i % 3 == 0) {
+			ent->set(narf::Entity::Bouncy);
+		}
+		ids.push_back(id);
+	}
+
+	for (int tick = 0; tick < 60; tick++) {
+		world.update(1.0 / 60.0);
+	}
+
+	std::vector<std::pair<narf::FixedPoint3, narf::Vector3f>> states;
+	for (auto id : ids) {
+		narf::EntityRef ent(em, id);
+		if (ent.valid()) {
+			states.emplace_back(ent->position, ent->velocity);
+		}
+	}
+	numEntities = em.getNumEntities();
+
+	blocks.clear();
+	narf::ZYXCoordIter<narf::BlockCoord> iter({0, 0, 0}, {64, 64, 64});
+	for (const auto& c : iter) {
+		blocks.push_back(world.getBlock(c)->id);
+	}
+	return states;
+}
+
+TEST(EntityManager, ParallelUpdateMatchesSerial) {
+	size_t serialCount, parallelCount;
+	std::vector<uint8_t> serialBlocks, parallelBlocks;
+	auto serial = simulate(1, serialCount, serialBlocks);
+	auto parallel = simulate(4, parallelCount, parallelBlocks);
+
+	EXPECT_LT(serialCount, 5000u); // some entities exploded
+	EXPECT_EQ(serialCount, parallelCount);
+	ASSERT_EQ(serial.size(), parallel.size());
+	for (size_t i = 0; i < serial.size(); i++) {
+		ASSERT_EQ(serial[i].first, parallel[i].first);
+		ASSERT_EQ(serial[i].second, parallel[i].second);
+	}
+	EXPECT_TRUE(serialBlocks == parallelBlocks);
+}
+
+TEST(EntityManager, DeterministicChecksum) {
+	SilentConsole silent;
+	narf::console = &silent;
+
+	narf::World server(64, 64, 64, 16, 16, 16), client(64, 64, 64, 16, 16, 16);
+	for (auto w : {&server, &client}) {
+		w->setGravity(-24.0f);
+		w->setDeterministic(true);
+	}
+	server.entityManager.setUpdateThreads(4);
+
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<float> coord(2.0f, 62.0f), v(-10.0f, 10.0f);
+	std::vector<narf::Entity::ID> ids;
+	for (int i = 0; i < 2000; i++) {
+		auto id = server.entityManager.newEntity();
+		narf::EntityRef ent(server.entityManager, id);
+		ent->position = narf::FixedPoint3(narf::Point3f(coord(rng), coord(rng), coord(rng)));
+		ent->velocity = narf::Vector3f(v(rng), v(rng), v(rng));
+		ent->set(narf::Entity::Bouncy, i % 3 == 0);
+		ids.push_back(id);
+	}
+	for (int tick = 0; tick < 6; tick++) {
+		server.update(1.0 / 60.0);
+	}
+
+	narf::SnapshotHistory sent;
+	auto send = [&](uint64_t tick, const std::vector<narf::Entity::ID>& kept, const std::vector<narf::Entity::ID>& changed) {
+		auto& snap = sent.add(tick);
+		narf::ByteStream bs;
+		server.entityManager.serializeSnapshot(bs, sent.find(sent.acked()), snap, kept, changed,
+			server.entityManager.checksum(kept));
+		bs.seek(0);
+		client.entityManager.deserializeEntityUpdate(bs);
+		sent.ack(client.entityManager.lastSnapshotTick());
+	};
+
+	// the client learns the entities over a few ticks in a different order, so its storage is laid out differently
+	// (the first snapshot sets its tick to the server's)
+	std::shuffle(ids.begin(), ids.end(), rng);
+	std::vector<narf::Entity::ID> known;
+	for (size_t i = 0; i < ids.size(); i += 500) {
+		std::vector<narf::Entity::ID> batch(ids.begin() + (ptrdiff_t)i, ids.begin() + (ptrdiff_t)i + 500);
+		std::sort(batch.begin(), batch.end());
+		server.update(1.0 / 60.0);
+		client.update(1.0 / 60.0);
+		send(server.tick(), known, batch);
+		known.insert(known.end(), batch.begin(), batch.end());
+		std::sort(known.begin(), known.end());
+	}
+	EXPECT_EQ(server.entityManager.checksum(), client.entityManager.checksum());
+	std::sort(ids.begin(), ids.end());
+
+	// both sides simulate on their own and agree every tick
+	for (int tick = 0; tick < 60; tick++) {
+		server.update(1.0 / 60.0);
+		client.update(1.0 / 60.0);
+		send(server.tick(), ids, {});
+	}
+	EXPECT_EQ(0u, client.entityManager.desyncs());
+	EXPECT_EQ(70u, client.entityManager.lastSnapshotTick());
+	EXPECT_EQ(70u, client.tick());
+
+	// snapshots that arrive after the client has moved on are compared with its state as of their tick
+	client.update(1.0 / 60.0);
+	client.update(1.0 / 60.0);
+	for (int tick = 0; tick < 2; tick++) {
+		server.update(1.0 / 60.0);
+		send(server.tick(), ids, {});
+	}
+	EXPECT_EQ(0u, client.entityManager.desyncs());
+
+	// after a matching checksum, states in the snapshot are skipped; a nudged entity is caught by the next one
+	narf::EntityRef nudged(client.entityManager, ids[0]);
+	nudged->velocity.x += 1.0f;
+	EXPECT_NE(server.entityManager.checksum(), client.entityManager.checksum());
+	server.update(1.0 / 60.0);
+	client.update(1.0 / 60.0);
+	send(server.tick(), ids, {ids[0]});
+	EXPECT_EQ(1u, client.entityManager.desyncs());
+	EXPECT_EQ(server.entityManager.checksum(), client.entityManager.checksum());
+
+	// both worlds loaded the same chunks for collisions
+	EXPECT_EQ(server.checksum(), client.checksum());
+	narf::Block b;
+	b.id = 2;
+	client.putBlock(&b, {1, 1, 63});
+	EXPECT_NE(server.checksum(), client.checksum());
+
+	narf::console = nullptr;
+}
+
+TEST(EntityManager, Sleep) {
+	narf::World world(64, 64, 64, 16, 16, 16); // generated terrain stays below z = 50
+	world.setGravity(-24.0f);
+	auto& em = world.entityManager;
+	narf::Block b;
+	b.id = 2;
+	world.putBlock(&b, {50, 50, 56});
+
+	auto id = em.newEntity();
+	auto ent = em.getEntity(id);
+	ent->position = ent->prevPosition = narf::FixedPoint3(narf::Point3f(50.5f, 50.5f, 57.0f));
+	em.positionChanged(id);
+
+	// resting on the block, it soon goes to sleep and stops being updated
+	for (int i = 0; i < 60; i++) {
+		world.update(1.0 / 60.0);
+	}
+	EXPECT_TRUE(ent->asleep());
+	EXPECT_FLOAT_EQ(57.0f, ent->position.toFloat().z);
+	size_t awake = 0;
+	for (auto& e : em.getAwakeEntities()) {
+		(void)e;
+		awake++;
+	}
+	EXPECT_EQ(0u, awake);
+
+	// removing the block underneath wakes it up, and it falls
+	b.id = 0;
+	world.putBlock(&b, {50, 50, 56});
+	EXPECT_FALSE(ent->asleep());
+	world.update(1.0 / 60.0);
+	EXPECT_LT(ent->position.toFloat().z, 57.0f);
+
+	// a sleeping entity only moves once it is woken
+	b.id = 2;
+	world.putBlock(&b, {50, 50, 56});
+	ent->position = ent->prevPosition = narf::FixedPoint3(narf::Point3f(50.5f, 50.5f, 57.0f));
+	ent->velocity = narf::Vector3f(0.0f, 0.0f, 0.0f);
+	for (int i = 0; i < 60; i++) {
+		world.update(1.0 / 60.0);
+	}
+	ASSERT_TRUE(ent->asleep());
+	ent->velocity = narf::Vector3f(6.0f, 0.0f, 0.0f);
+	world.update(1.0 / 60.0);
+	EXPECT_FLOAT_EQ(50.5f, ent->position.toFloat().x);
+	ent->wake();
+	world.update(1.0 / 60.0);
+	EXPECT_GT(ent->position.toFloat().x, 50.5f);
+}
+
+TEST(EntityManager, SleepAirborne) {
+	narf::World world(64, 64, 64, 16, 16, 16); // generated terrain stays below z = 50
+	world.setGravity(0.0f);
+	auto& em = world.entityManager;
+
+	// still in mid-air, but not resting on anything, so it stays awake
+	auto id = em.newEntity();
+	auto ent = em.getEntity(id);
+	ent->position = ent->prevPosition = narf::FixedPoint3(narf::Point3f(50.5f, 50.5f, 57.0f));
+	em.positionChanged(id);
+
+	// an antigrav entity does not fall, so it can sleep wherever it is
+	auto floatId = em.newEntity();
+	auto floater = em.getEntity(floatId);
+	floater->set(narf::Entity::Antigrav);
+	floater->position = floater->prevPosition = narf::FixedPoint3(narf::Point3f(40.5f, 40.5f, 57.0f));
+	em.positionChanged(floatId);
+
+	for (int i = 0; i < 60; i++) {
+		world.update(1.0 / 60.0);
+	}
+	EXPECT_FALSE(ent->onGround);
+	EXPECT_FALSE(ent->asleep());
+	EXPECT_TRUE(floater->asleep());
+
+	// so once there is gravity again, it falls
+	world.setGravity(-24.0f);
+	world.update(1.0 / 60.0);
+	EXPECT_LT(ent->position.toFloat().z, 57.0f);
+	EXPECT_FLOAT_EQ(57.0f, floater->position.toFloat().z);
+}
+
+TEST(EntityManager, CommandBuffer) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	auto& em = world.entityManager;
+
+	std::vector<narf::Entity::ID> ids;
+	for (int i = 0; i < 10; i++) {
+		auto id = em.newEntity();
+		em.getEntity(id)->set(narf::Entity::Antigrav);
+		ids.push_back(id);
+	}
+
+	size_t signals = 0;
+	std::vector<narf::Entity::ID> deleted;
+	em.onEntitiesDeleted += [&](const std::vector<narf::Entity::ID>& batch) {
+		signals++;
+		deleted.insert(deleted.end(), batch.begin(), batch.end());
+	};
+
+	// spawning and deleting while iterating only takes effect at the sync point
+	auto& cmds = em.commands();
+	for (auto& ent : em.getEntities()) {
+		cmds.spawn(narf::FixedPoint3(narf::Point3f(1.0f, 2.0f, 3.0f)), narf::Vector3f(0.0f, 0.0f, 0.0f),
+			{narf::Entity::Antigrav, narf::Entity::Bouncy});
+		cmds.deleteEntity(ent.id);
+	}
+	cmds.deleteEntity(ids[0]); // twice
+	cmds.set(ids[1], narf::Entity::Model);
+	EXPECT_EQ(10u, em.getNumEntities());
+
+	em.flush();
+	EXPECT_TRUE(cmds.empty());
+	EXPECT_EQ(10u, em.getNumEntities());
+	EXPECT_EQ(1u, signals);
+	EXPECT_EQ(10u, deleted.size());
+	for (auto id : ids) {
+		EXPECT_EQ(nullptr, em.getEntity(id));
+	}
+	for (auto& ent : em.getEntities()) {
+		EXPECT_TRUE(ent.has(narf::Entity::Bouncy));
+		EXPECT_FLOAT_EQ(2.0f, ent.position.toFloat().y);
+	}
+
+	// nothing deleted, no signal
+	em.flush();
+	EXPECT_EQ(1u, signals);
+}
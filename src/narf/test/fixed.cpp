@@ -0,0 +1,39 @@
+#include <gtest/gtest.h>
+#include "narf/math/fixed.h"
+
+TEST(FixedPoint3, Precision) {
+	// far from the origin, a float position cannot represent a small step, but a fixed point one can
+	narf::FixedPoint3 origin(narf::Point3f(10000000.0f, -10000000.0f, 0.0f));
+	auto p = origin;
+	for (int i = 0; i < 100; i++) {
+		p += narf::Vector3f(0.015f, -0.015f, 0.015f);
+	}
+	auto rel = p.relativeTo(origin);
+	EXPECT_NEAR(1.5f, rel.x, 1e-6f);
+	EXPECT_NEAR(-1.5f, rel.y, 1e-6f);
+	EXPECT_NEAR(1.5f, rel.z, 1e-6f);
+	EXPECT_EQ(narf::Point3<int32_t>(10000001, -10000002, 1), p.floor());
+}
+
+TEST(FixedPoint3, Serialize) {
+	narf::FixedPoint3 p(narf::Point3f(12.25f, -3.5f, 63.75f));
+	narf::ByteStream bs;
+	p.serialize(bs);
+	EXPECT_EQ(9u, bs.size()); // 3 bytes per axis near the origin
+
+	narf::FixedPoint3 far;
+	far.x = (int64_t)1 << 60;
+	far.y = -((int64_t)1 << 60);
+	far.z = narf::FixedPoint3::fromFloat(0.1f);
+	far.serialize(bs);
+
+	bs.seek(0);
+	narf::FixedPoint3 q, farCopy;
+	ASSERT_TRUE(q.deserialize(bs));
+	EXPECT_TRUE(p == q);
+	ASSERT_TRUE(farCopy.deserialize(bs));
+	EXPECT_EQ(far.x, farCopy.x);
+	EXPECT_EQ(far.y, farCopy.y);
+	EXPECT_NEAR(0.1f, narf::FixedPoint3::toFloat(farCopy.z), 1.0f / 65536.0f);
+	EXPECT_FALSE(q.deserialize(bs)); // out of data
+}
@@ -0,0 +1,63 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+
+#include "narf/interest.h"
+#include "narf/world.h"
+
+static bool contains(const std::vector<narf::Entity::ID>& ids, narf::Entity::ID id) {
+	return std::find(ids.begin(), ids.end(), id) != ids.end();
+}
+
+TEST(InterestSet, EnterLeaveAndRate) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	auto& em = world.entityManager;
+
+	// drifting entities at increasing distances from the observer at (8, 8, 60), and one out of range
+	narf::Point3f center(8.0f, 8.0f, 60.0f);
+	std::vector<narf::Entity::ID> ids;
+	for (float x : {9.0f, 14.0f, 22.0f, 30.0f, 50.0f}) {
+		auto id = em.newEntity();
+		narf::EntityRef ent(em, id);
+		ent->set(narf::Entity::Antigrav);
+		ent->position = narf::FixedPoint3(narf::Point3f(x, 8.0f, 60.0f));
+		ent->velocity = narf::Vector3f(0.0f, 1.0f, 0.0f);
+		em.positionChanged(id);
+		ids.push_back(id);
+	}
+
+	const float radius = 24.0f;
+	narf::InterestSet interest;
+	interest.update(em, center, radius, 0);
+	EXPECT_EQ(4u, interest.send().size()); // everything in range enters
+	EXPECT_FALSE(contains(interest.send(), ids[4]));
+	EXPECT_TRUE(interest.kept().empty());
+
+	// near entities are updated every tick, far ones less often
+	size_t sent[5] = {};
+	for (uint64_t tick = 1; tick <= 16; tick++) {
+		world.update(1.0 / 60.0);
+		interest.update(em, center, radius, tick);
+		EXPECT_EQ(4u, interest.kept().size());
+		for (size_t i = 0; i < ids.size(); i++) {
+			sent[i] += contains(interest.send(), ids[i]);
+		}
+	}
+	EXPECT_EQ(16u, sent[0]);
+	EXPECT_EQ(8u, sent[1]);
+	EXPECT_EQ(4u, sent[2]);
+	EXPECT_EQ(2u, sent[3]);
+	EXPECT_EQ(0u, sent[4]);
+
+	// an entity leaves by moving out of range or being deleted, and the far one enters
+	narf::EntityRef(em, ids[3])->position = narf::FixedPoint3(narf::Point3f(40.0f, 8.0f, 60.0f));
+	narf::EntityRef(em, ids[4])->position = narf::FixedPoint3(narf::Point3f(20.0f, 8.0f, 60.0f));
+	em.deleteEntity(ids[0]);
+	world.update(1.0 / 60.0);
+	interest.update(em, center, radius, 17);
+	ASSERT_EQ(2u, interest.left().size());
+	EXPECT_TRUE(contains(interest.left(), ids[0]));
+	EXPECT_TRUE(contains(interest.left(), ids[3]));
+	EXPECT_TRUE(contains(interest.send(), ids[4]));
+	EXPECT_EQ(3u, interest.size());
+}
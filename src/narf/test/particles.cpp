@@ -0,0 +1,54 @@
+#include <gtest/gtest.h>
+
+#include "narf/world.h"
+
+TEST(ParticleSystem, Collision) {
+	narf::World world(64, 64, 64, 16, 16, 16); // generated terrain stays below z = 50
+	world.setGravity(-24.0f);
+	narf::Block b;
+	b.id = 2;
+	for (int32_t y = 48; y < 64; y++) {
+		for (int32_t x = 48; x < 64; x++) {
+			world.putBlock(&b, {x, y, 56});
+		}
+	}
+
+	auto& particles = world.particles;
+	particles.setCapacity(5);
+	EXPECT_EQ(8u, particles.capacity());
+
+	using Collision = narf::ParticleSystem::Collision;
+	particles.spawn({50.5f, 50.5f, 60.0f}, {0.0f, 0.0f, 0.0f}, 10.0f, Collision::Stick);
+	particles.spawn({52.5f, 52.5f, 60.0f}, {0.0f, 0.0f, 0.0f}, 10.0f, Collision::Die, 1.0f, 42);
+	particles.spawn({54.5f, 54.5f, 60.0f}, {0.0f, 0.0f, -10.0f}, 10.0f, Collision::Bounce);
+	particles.spawn({58.5f, 58.5f, 60.0f}, {0.0f, 0.0f, 0.0f}, 0.5f, Collision::Stick, 0.0f);
+
+	bool hit = false;
+	for (int i = 0; i < 60; i++) {
+		world.update(1.0 / 60.0);
+		for (const auto& h : particles.hits()) {
+			EXPECT_EQ(42u, h.user);
+			EXPECT_EQ(narf::BlockCoord(52, 52, 56), h.block);
+			hit = true;
+		}
+	}
+	EXPECT_TRUE(hit);
+
+	// the projectile died on impact and the short-lived spark expired
+	ASSERT_EQ(2u, particles.size());
+	for (uint32_t i = 0; i < particles.size(); i++) {
+		auto p = particles.position(i);
+		EXPECT_GE(p.z, 57.0f); // nothing fell through the floor
+		if (p.x < 51.0f) {
+			// debris came to rest on the floor
+			EXPECT_LT(p.z, 57.5f);
+			EXPECT_EQ(0.0f, particles.velocity(i).z);
+		}
+	}
+
+	// full systems refuse new particles instead of growing
+	for (int i = 0; i < 10; i++) {
+		particles.spawn({1.0f, 1.0f, 63.0f}, {0.0f, 0.0f, 0.0f}, 1.0f, Collision::Die);
+	}
+	EXPECT_EQ(8u, particles.size());
+}
@@ -0,0 +1,183 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+
+#include "narf/bytestream.h"
+#include "narf/world.h"
+
+// every step of a path is one move between walkable blocks
+static void checkPath(narf::World& world, const std::vector<narf::BlockCoord>& path) {
+	for (size_t i = 0; i < path.size(); i++) {
+		EXPECT_TRUE(world.pathfinder.walkable(path[i]));
+		if (i > 0) {
+			EXPECT_LE(abs(path[i].x - path[i - 1].x), 1);
+			EXPECT_LE(abs(path[i].y - path[i - 1].y), 1);
+			EXPECT_LE(abs(path[i].z - path[i - 1].z), 1);
+		}
+	}
+}
+
+TEST(Pathfinder, Paths) {
+	narf::World world(64, 64, 64, 16, 16, 16); // generated ground is walkable at z = 48
+	narf::Block b;
+	b.id = 2;
+
+	// wall across the world at x = 32 with a gap at y = 5, crossing chunk boundaries
+	for (int32_t y = 0; y < 64; y++) {
+		if (y != 5) {
+			world.putBlock(&b, {32, y, 48});
+			world.putBlock(&b, {32, y, 49});
+		}
+	}
+
+	auto& pathfinder = world.pathfinder;
+	std::vector<narf::BlockCoord> path;
+	ASSERT_TRUE(pathfinder.findPath({20, 40, 49}, {50, 40, 48}, path)); // start in the air
+	EXPECT_EQ(narf::BlockCoord(20, 40, 48), path.front());
+	EXPECT_EQ(narf::BlockCoord(50, 40, 48), path.back());
+	EXPECT_NE(path.end(), std::find(path.begin(), path.end(), narf::BlockCoord(32, 5, 48)));
+	checkPath(world, path);
+	auto around = path.size();
+
+	EXPECT_FALSE(pathfinder.findPath({20, 40, 48}, {32, 40, 48}, path)); // inside the wall
+	EXPECT_TRUE(path.empty());
+
+	// opening the wall only rebuilds the changed chunk and the one below it, whose top depends on it
+	auto builds = pathfinder.regionBuilds();
+	narf::Block air;
+	air.id = 0;
+	world.putBlock(&air, {32, 50, 48});
+	world.putBlock(&air, {32, 50, 49});
+	ASSERT_TRUE(pathfinder.findPath({20, 40, 48}, {50, 40, 48}, path));
+	EXPECT_EQ(builds + 2, pathfinder.regionBuilds());
+	EXPECT_LT(path.size(), around);
+	EXPECT_NE(path.end(), std::find(path.begin(), path.end(), narf::BlockCoord(32, 50, 48)));
+	checkPath(world, path);
+
+	// queued requests run in order; with no time to spare, each update only takes a few steps of the search
+	std::vector<narf::Pathfinder::RequestID> done;
+	std::vector<narf::BlockCoord> result;
+	auto callback = [&](narf::Pathfinder::RequestID id, bool found, const std::vector<narf::BlockCoord>& p) {
+		EXPECT_TRUE(found);
+		EXPECT_FALSE(p.empty());
+		result = p;
+		done.push_back(id);
+	};
+	auto first = pathfinder.request({60, 1, 48}, {1, 60, 48}, callback);
+	auto cancelled = pathfinder.request({1, 1, 48}, {60, 1, 48}, callback);
+	auto last = pathfinder.request({60, 1, 48}, {1, 60, 48}, callback);
+	EXPECT_EQ(3u, pathfinder.pending());
+	EXPECT_TRUE(pathfinder.cancel(cancelled));
+	int updates = 0;
+	while (done.empty()) {
+		pathfinder.update(0.0);
+		updates++;
+	}
+	EXPECT_GT(updates, 1);
+	EXPECT_EQ(first, done[0]);
+	checkPath(world, result);
+
+	// blocking the path just before the same search finishes restarts it, rather than finishing with the old blocks
+	auto blocked = result[result.size() / 2];
+	for (int i = 0; i < updates - 1; i++) {
+		pathfinder.update(0.0);
+	}
+	ASSERT_EQ(1u, done.size());
+	world.putBlock(&b, blocked);
+	world.putBlock(&b, {blocked.x, blocked.y, blocked.z + 1});
+	pathfinder.update(1.0);
+	ASSERT_EQ(2u, done.size());
+	EXPECT_EQ(last, done[1]);
+	EXPECT_EQ(result.end(), std::find(result.begin(), result.end(), blocked));
+	checkPath(world, result);
+	EXPECT_EQ(0u, pathfinder.pending());
+	EXPECT_FALSE(pathfinder.cancel(last));
+}
+
+TEST(Pathfinder, Budget) {
+	// walls every 32 blocks with the gap at alternating ends, so the path zigzags across the world
+	narf::World world(256, 256, 64, 16, 16, 16);
+	narf::Block b;
+	b.id = 2;
+	for (int32_t x = 32; x < 256; x += 32) {
+		auto gap = (x / 32) % 2 ? 250 : 5;
+		for (int32_t y = 0; y < 256; y++) {
+			if (y != gap) {
+				world.putBlock(&b, {x, y, 48});
+				world.putBlock(&b, {x, y, 49});
+			}
+		}
+	}
+
+	// with no budget at all, each update stops at its first check of the clock, so the work it does between
+	// checks is what bounds how far an update can overrun: one region node and one chunk's regions,
+	// or BlockChecks block nodes; the time this takes is measured by narfblock-bench
+	auto& pathfinder = world.pathfinder;
+	std::vector<narf::BlockCoord> path;
+	bool finished = false;
+	pathfinder.request({2, 2, 48}, {252, 252, 48}, [&](narf::Pathfinder::RequestID, bool found, const std::vector<narf::BlockCoord>& p) {
+		EXPECT_TRUE(found);
+		path = p;
+		finished = true;
+	});
+	int updates = 0;
+	uint64_t mostBuilds = 0, mostExpansions = 0;
+	while (!finished) {
+		auto builds = pathfinder.regionBuilds(), expansions = pathfinder.expansions();
+		pathfinder.update(narf::timediff(0));
+		if (updates > 0) { // the first also finds the start and goal chunks' regions
+			mostBuilds = std::max(mostBuilds, pathfinder.regionBuilds() - builds);
+		}
+		mostExpansions = std::max(mostExpansions, pathfinder.expansions() - expansions);
+		updates++;
+	}
+	EXPECT_GT(updates, 100);
+	EXPECT_EQ(1u, mostBuilds);
+	EXPECT_LE(mostExpansions, (uint64_t)narf::Pathfinder::BlockChecks);
+	EXPECT_EQ(narf::BlockCoord(252, 252, 48), path.back());
+	for (int32_t x = 32; x < 256; x += 32) {
+		auto gap = (x / 32) % 2 ? 250 : 5;
+		EXPECT_NE(path.end(), std::find(path.begin(), path.end(), narf::BlockCoord(x, gap, 48)));
+	}
+	checkPath(world, path);
+}
+
+TEST(Pathfinder, ChunkUnloaded) {
+	// a client that has been sent every chunk of the server's world
+	narf::World server(64, 64, 64, 16, 16, 16), client(64, 64, 64, 16, 16, 16); // generated ground is walkable at z = 48
+	client.setGenerateChunks(false);
+	for (int32_t z = 0; z < 4; z++) {
+		for (int32_t y = 0; y < 4; y++) {
+			for (int32_t x = 0; x < 4; x++) {
+				narf::ByteStream bs;
+				server.serializeChunkUpdate(bs, {x, y, z}, 0);
+				bs.seek(0);
+				client.deserializeChunkUpdate(bs);
+			}
+		}
+	}
+
+	auto& pathfinder = client.pathfinder;
+	bool finished = false, found = true;
+	pathfinder.request({2, 2, 48}, {60, 2, 48}, [&](narf::Pathfinder::RequestID, bool f, const std::vector<narf::BlockCoord>&) {
+		found = f;
+		finished = true;
+	});
+	// partway through the region search, with the regions of the chunks in the next column built
+	while (!finished && pathfinder.expansions() < 2) {
+		pathfinder.update(narf::timediff(0));
+	}
+	ASSERT_FALSE(finished);
+
+	// unloading that column cuts every path; the search in progress has to notice
+	for (int32_t z = 0; z < 4; z++) {
+		for (int32_t y = 0; y < 4; y++) {
+			client.unloadChunk({2, y, z});
+		}
+	}
+	EXPECT_FALSE(pathfinder.walkable({40, 2, 48}));
+	while (!finished) {
+		pathfinder.update(narf::timediff(0));
+	}
+	EXPECT_FALSE(found);
+}
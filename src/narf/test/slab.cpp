@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+
+#include <set>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "narf/slab.h"
+
+TEST(SlabPool, Recycle) {
+	narf::SlabPool pool(100, 1000);
+	EXPECT_EQ(0u, pool.stats().slabs);
+
+	std::set<void*> items;
+	for (int i = 0; i < 20; i++) {
+		auto p = pool.alloc();
+		ASSERT_NE(nullptr, p);
+		EXPECT_EQ(0u, (uintptr_t)p % 16);
+		EXPECT_TRUE(items.insert(p).second);
+		memset(p, 0xAA, 100);
+	}
+
+	auto stats = pool.stats();
+	EXPECT_EQ(20u, stats.liveItems);
+	EXPECT_EQ(3u, stats.slabs); // 112-byte items, 9 per slab
+
+	for (auto p : items) {
+		pool.free(p);
+	}
+	stats = pool.stats();
+	EXPECT_EQ(0u, stats.liveItems);
+	EXPECT_EQ(27u, stats.freeItems);
+
+	// steady state: reallocating the same number of items reuses the same memory
+	for (int i = 0; i < 20; i++) {
+		auto p = pool.alloc();
+		EXPECT_EQ(1u, items.count(p));
+	}
+	EXPECT_EQ(3u, pool.stats().slabs);
+
+	for (auto p : items) {
+		pool.free(p);
+	}
+}
+
+TEST(SlabPool, LargeSlabs) {
+	// a slab size that is not a multiple of the item size still gets slabs at least that large,
+	// so slabs asked for at the huge page size are mapped rather than falling back to malloc()
+	const size_t slabSize = 2 * 1024 * 1024;
+	narf::SlabPool pool(3000, slabSize);
+	pool.setHugePages(true);
+	auto p = pool.alloc();
+	ASSERT_NE(nullptr, p);
+	memset(p, 0xAA, 3000);
+
+	auto stats = pool.stats();
+	EXPECT_EQ(1u, stats.slabs);
+	auto slabBytes = (slabSize + pool.itemSize() - 1) / pool.itemSize() * pool.itemSize();
+#ifdef __linux__
+	// the memory mapped for the slab, which is a whole number of pages
+	auto pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	EXPECT_EQ((slabBytes + pageSize - 1) & ~(pageSize - 1), stats.bytes);
+	EXPECT_EQ(1u, stats.mappedSlabs);
+	EXPECT_EQ(0u, (uintptr_t)p % slabSize); // the first item is at the start of the slab, on a huge page boundary
+#else
+	EXPECT_EQ(slabBytes, stats.bytes);
+#endif
+
+	pool.free(p);
+}
@@ -0,0 +1,452 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+
+#include "narf/world.h"
+
+// step along the ray in tiny increments and return the first opaque block (reference implementation)
+static bool slowRayCast(narf::World& world, const narf::Point3f& origin, const narf::Vector3f& direction, float maxDistance, narf::BlockCoord& wbc, float& distance) {
+	auto dir = direction.normalize();
+	for (float t = 0.0f; t <= maxDistance; t += 0.001f) {
+		auto p = origin + dir * t;
+		narf::BlockCoord c((int32_t)floorf(p.x), (int32_t)floorf(p.y), (int32_t)floorf(p.z));
+		if (world.isOpaque(c)) {
+			wbc = c;
+			distance = t;
+			return true;
+		}
+	}
+	return false;
+}
+
+TEST(World, RayCastDown) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	narf::RayHit hit;
+
+	// chunk (3,0,3) is empty, so the ray should pass through it and land on the grass below
+	ASSERT_TRUE(world.rayCast(narf::Point3f(56.5f, 8.5f, 63.5f), narf::Vector3f(0.0f, 0.0f, -1.0f), 100.0f, hit));
+	EXPECT_EQ(56, hit.wbc.x);
+	EXPECT_EQ(8, hit.wbc.y);
+	EXPECT_EQ(47, hit.wbc.z);
+	EXPECT_EQ(narf::ZPos, hit.face);
+	EXPECT_FLOAT_EQ(15.5f, hit.distance);
+
+	// too short to reach the ground
+	EXPECT_FALSE(world.rayCast(narf::Point3f(56.5f, 8.5f, 63.5f), narf::Vector3f(0.0f, 0.0f, -1.0f), 10.0f, hit));
+
+	// pointing up and out of the world
+	EXPECT_FALSE(world.rayCast(narf::Point3f(56.5f, 8.5f, 50.5f), narf::Vector3f(0.0f, 0.0f, 1.0f), 100.0f, hit));
+}
+
+TEST(World, RayCastFromOutside) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	narf::RayHit hit;
+
+	ASSERT_TRUE(world.rayCast(narf::Point3f(8.5f, 8.5f, -10.0f), narf::Vector3f(0.0f, 0.0f, 1.0f), 100.0f, hit));
+	EXPECT_EQ(0, hit.wbc.z);
+	EXPECT_EQ(narf::ZNeg, hit.face);
+}
+
+TEST(World, RayCastBlockEdits) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	narf::RayHit hit;
+	narf::Point3f origin(56.5f, 8.5f, 60.5f);
+	narf::Vector3f down(0.0f, 0.0f, -1.0f);
+
+	narf::Block b;
+	b.id = 5;
+	world.putBlock(&b, {56, 8, 52});
+	ASSERT_TRUE(world.rayCast(origin, down, 100.0f, hit));
+	EXPECT_EQ(52, hit.wbc.z);
+
+	b.id = 0;
+	world.putBlock(&b, {56, 8, 52});
+	ASSERT_TRUE(world.rayCast(origin, down, 100.0f, hit));
+	EXPECT_EQ(47, hit.wbc.z);
+	EXPECT_TRUE(world.lineOfSight(origin, narf::Point3f(20.5f, 60.5f, 55.5f)));
+	EXPECT_FALSE(world.lineOfSight(origin, narf::Point3f(56.5f, 8.5f, 40.0f)));
+}
+
+TEST(World, RayCastMatchesReference) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	srand(1234);
+	for (int i = 0; i < 200; i++) {
+		narf::Point3f origin(
+			(float)(rand() % 6400) / 100.0f,
+			(float)(rand() % 6400) / 100.0f,
+			48.0f + (float)(rand() % 1600) / 100.0f);
+		narf::Vector3f direction(
+			(float)(rand() % 200 - 100),
+			(float)(rand() % 200 - 100),
+			(float)(rand() % 100 - 100));
+		if (direction.lengthSquared() == 0.0f) {
+			continue;
+		}
+
+		narf::RayHit hit;
+		narf::BlockCoord expected;
+		float expectedDistance;
+		bool expectHit = slowRayCast(world, origin, direction, 40.0f, expected, expectedDistance);
+		bool gotHit = world.rayCast(origin, direction, 40.0f, hit);
+
+		// the reference implementation can step over the corner of a block, so a different
+		// block is only acceptable if the ray reached it first
+		if (expectHit && gotHit) {
+			EXPECT_TRUE(world.isOpaque(hit.wbc));
+			if (hit.wbc.x != expected.x || hit.wbc.y != expected.y || hit.wbc.z != expected.z) {
+				EXPECT_LE(hit.distance, expectedDistance);
+			} else {
+				EXPECT_NEAR(expectedDistance, hit.distance, 0.002f);
+			}
+		} else if (expectHit) {
+			ADD_FAILURE() << "ray " << i << " missed block " << expected.x << "," << expected.y << "," << expected.z;
+		}
+	}
+}
+
+TEST(Chunk, Visibility) {
+	narf::World world(128, 128, 64, 16, 16, 16);
+
+	// solid dirt underground
+	EXPECT_EQ(0, world.getChunk({0, 0, 1})->getVisibility());
+
+	// empty air chunk
+	EXPECT_EQ(0x7FFF, world.getChunk({3, 0, 3})->getVisibility());
+
+	// one-block layer at z=4 separates the top and bottom of the chunk
+	auto layer = world.getChunk({4, 3, 3});
+	EXPECT_TRUE(layer->facesConnected(narf::XPos, narf::XNeg));
+	EXPECT_TRUE(layer->facesConnected(narf::ZPos, narf::XNeg));
+	EXPECT_TRUE(layer->facesConnected(narf::ZNeg, narf::YPos));
+	EXPECT_FALSE(layer->facesConnected(narf::ZPos, narf::ZNeg));
+
+	// punch a hole in the layer
+	narf::Block air;
+	air.id = 0;
+	world.putBlock(&air, {4 * 16 + 3, 3 * 16 + 3, 3 * 16 + 4});
+	EXPECT_TRUE(layer->facesConnected(narf::ZPos, narf::ZNeg));
+}
+
+TEST(World, FindVisibleChunks) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	std::vector<narf::ChunkCoord> visible;
+
+	// camera buried in solid dirt can see into adjacent chunks but no further
+	world.findVisibleChunks(narf::Point3f(8.0f, 8.0f, 24.0f), narf::Vector3f(1.0f, 0.0f, 0.0f), 4, visible);
+	ASSERT_EQ(5u, visible.size());
+	EXPECT_EQ(narf::ChunkCoord(0, 0, 1), visible[0]);
+	for (const auto& cc : visible) {
+		EXPECT_LE(abs(cc.x) + abs(cc.y) + abs(cc.z - 1), 1);
+	}
+
+	// camera in the sky sees the sky layer and the ground surface, but not underground chunks,
+	// nor chunks outside the sphere of the given radius
+	world.findVisibleChunks(narf::Point3f(8.0f, 8.0f, 56.0f), narf::Vector3f(1.0f, 1.0f, 0.0f), 4, visible);
+	bool sawSurface = false;
+	for (const auto& cc : visible) {
+		EXPECT_GE(cc.z, 2);
+		EXPECT_LE(cc.x * cc.x + cc.y * cc.y + (cc.z - 3) * (cc.z - 3), 16);
+		if (cc == narf::ChunkCoord(2, 2, 2)) {
+			sawSurface = true;
+		}
+	}
+	EXPECT_TRUE(sawSurface);
+	EXPECT_EQ(visible.end(), std::find(visible.begin(), visible.end(), narf::ChunkCoord(3, 3, 3)));
+}
+
+static void checkSerializeRoundTrip(int32_t chunkSize) {
+	narf::World world(64, 64, 64, chunkSize, chunkSize, chunkSize);
+	narf::World copy(64, 64, 64, chunkSize, chunkSize, chunkSize);
+
+	narf::Block b;
+	b.id = 5;
+	world.putBlock(&b, {1, 2, 60});
+
+	narf::ByteStream bs;
+	world.serialize(bs);
+	bs.seek(0);
+	uint32_t numChunks = (uint32_t)(world.chunksX() * world.chunksY() * world.chunksZ());
+	bs.skip(6 * sizeof(int32_t)); // world header
+	ASSERT_EQ(numChunks, bs.readU32(LE));
+	while (numChunks--) {
+		narf::ChunkCoord wcc;
+		copy.deserializeChunk(bs, wcc);
+	}
+
+	narf::ZYXCoordIter<narf::BlockCoord> iter({0, 0, 0}, {64, 64, 64});
+	for (const auto& c : iter) {
+		ASSERT_EQ(world.getBlock(c)->id, copy.getBlock(c)->id);
+	}
+}
+
+TEST(Chunk, SerializeRoundTrip) {
+	checkSerializeRoundTrip(16); // DefaultChunkGeometry
+	checkSerializeRoundTrip(32); // runtime-sized fallback
+}
+
+TEST(Chunk, Journal) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	auto chunk = world.getChunk({3, 0, 3}); // empty
+	auto start = chunk->journal().seq();
+	std::vector<narf::ChunkJournal::Change> changes;
+
+	EXPECT_TRUE(chunk->journal().changesSince(start, changes));
+	EXPECT_TRUE(changes.empty());
+
+	narf::Block b;
+	b.id = 2;
+	chunk->putBlock(&b, {1, 2, 3});
+	chunk->putBlock(&b, {1, 2, 3}); // no change
+	b.id = 0;
+	chunk->putBlock(&b, {4, 5, 6});
+
+	ASSERT_TRUE(chunk->journal().changesSince(start, changes));
+	ASSERT_EQ(1u, changes.size());
+	EXPECT_EQ(narf::Chunk::BlockCoord(1, 2, 3), chunk->blockCoord(changes[0].index));
+	EXPECT_EQ(2, changes[0].id);
+
+	// a consumer that falls too far behind has to take the whole chunk
+	auto mid = chunk->journal().seq();
+	for (uint32_t i = 0; i < narf::ChunkJournal::Capacity; i++) {
+		b.id = (narf::BlockTypeId)(i & 1 ? 0 : 2);
+		chunk->putBlock(&b, {0, 0, 0});
+	}
+	EXPECT_FALSE(chunk->journal().changesSince(start, changes));
+	ASSERT_TRUE(chunk->journal().changesSince(mid, changes));
+	EXPECT_EQ(narf::ChunkJournal::Capacity, changes.size());
+
+	// replacing the chunk contents invalidates everything before it
+	narf::ByteStream bs;
+	chunk->serialize(bs);
+	bs.seek(0);
+	auto beforeLoad = chunk->journal().seq();
+	chunk->deserialize(bs);
+	EXPECT_FALSE(chunk->journal().changesSince(beforeLoad, changes));
+	EXPECT_TRUE(chunk->journal().changesSince(chunk->journal().seq(), changes));
+
+	// so does unloading it and loading it again, even though the new copy has had no changes of its own
+	auto beforeUnload = chunk->journal().seq();
+	world.unloadChunk({3, 0, 3});
+	EXPECT_EQ(nullptr, world.loadedChunk({3, 0, 3}));
+	chunk = world.getChunk({3, 0, 3});
+	EXPECT_EQ(chunk, world.loadedChunk({3, 0, 3}));
+	EXPECT_GT(chunk->journal().seq(), beforeUnload);
+	EXPECT_FALSE(chunk->journal().changesSince(beforeUnload, changes));
+}
+
+TEST(World, SweepAABB) {
+	narf::World world(64, 64, 64, 16, 16, 16); // generated terrain stays below z = 50
+	narf::Block b;
+	b.id = 2;
+	for (int32_t y = 48; y < 64; y++) {
+		for (int32_t x = 48; x < 64; x++) {
+			world.putBlock(&b, {x, y, 56}); // floor
+		}
+		world.putBlock(&b, {56, y, 57}); // wall along y
+	}
+	world.putBlock(&b, {52, 52, 57}); // 1-block step
+
+	narf::Vector3f half(0.375f, 0.375f, 0.375f);
+	narf::SweepResult r;
+	auto sweep = [&](const narf::AABB& box, const narf::Vector3f& delta, float stepHeight) {
+		world.updateCollision(box, delta, stepHeight);
+		world.sweepAABB(box, delta, stepHeight, r);
+	};
+
+	// falling onto the floor stops exactly on its surface
+	sweep(narf::AABB({50.5f, 50.5f, 59.0f}, half), {0.0f, 0.0f, -3.0f}, 0.0f);
+	EXPECT_TRUE(r.hit[2]);
+	EXPECT_FALSE(r.hit[0] || r.hit[1]);
+	EXPECT_NEAR(57.0f, 59.0f + r.movement.z - 0.375f, 0.01f);
+	EXPECT_NEAR((59.0f - 0.375f - 57.0f) / 3.0f, r.toi, 0.01f);
+
+	// moving diagonally into the wall slides along it instead of stopping
+	sweep(narf::AABB({55.0f, 58.0f, 57.375f}, half), {2.0f, 2.0f, 0.0f}, 0.0f);
+	EXPECT_TRUE(r.hit[0]);
+	EXPECT_FALSE(r.hit[1]);
+	EXPECT_NEAR(56.0f, 55.0f + r.movement.x + 0.375f, 0.01f);
+	EXPECT_FLOAT_EQ(2.0f, r.movement.y);
+
+	// a fast box does not tunnel through the 1-block floor
+	sweep(narf::AABB({60.5f, 60.5f, 63.0f}, half), {0.0f, 0.0f, -60.0f}, 0.0f);
+	EXPECT_TRUE(r.hit[2]);
+	EXPECT_EQ(narf::BlockCoord(60, 60, 56), r.block);
+	EXPECT_NEAR(57.0f, 63.0f + r.movement.z - 0.375f, 0.01f);
+
+	// walking into a 1-block obstacle climbs it only when stepping is allowed
+	narf::AABB walker({50.5f, 52.5f, 57.375f}, half);
+	sweep(walker, {2.0f, 0.0f, -0.1f}, 0.0f);
+	EXPECT_TRUE(r.hit[0]);
+	EXPECT_FALSE(r.stepped);
+	sweep(walker, {2.0f, 0.0f, -0.1f}, 1.0f);
+	EXPECT_TRUE(r.stepped);
+	EXPECT_FLOAT_EQ(2.0f, r.movement.x);
+	EXPECT_NEAR(58.0f, 57.375f + r.movement.z - 0.375f, 0.01f);
+}
+
+// sweep box along delta in many tiny steps, dropping axes once they hit something as sweepAABBPath() does
+// (reference implementation)
+static narf::Vector3f steppedSweep(narf::World& world, narf::AABB box, narf::Vector3f delta, int steps) {
+	narf::Vector3f moved(0.0f, 0.0f, 0.0f);
+	auto step = delta / (float)steps;
+	for (int i = 0; i < steps; i++) {
+		narf::SweepResult r;
+		world.sweepAABB(box, step, 0.0f, r);
+		box.center += r.movement;
+		moved += r.movement;
+		if (r.hit[0]) step.x = 0.0f;
+		if (r.hit[1]) step.y = 0.0f;
+		if (r.hit[2]) step.z = 0.0f;
+	}
+	return moved;
+}
+
+TEST(World, SweepAABBPath) {
+	narf::World world(64, 64, 64, 16, 16, 16); // generated terrain stays below z = 50
+	narf::Block b;
+	b.id = 2;
+	for (int32_t y = 48; y < 64; y++) {
+		for (int32_t x = 48; x < 64; x++) {
+			world.putBlock(&b, {x, y, 56}); // floor
+		}
+	}
+	world.putBlock(&b, {55, 55, 57}); // pillar
+	world.putBlock(&b, {55, 55, 58});
+	for (int32_t y = 48; y < 64; y++) {
+		if (y != 60) {
+			world.putBlock(&b, {58, y, 57}); // wall along y with a 1-block gap
+			world.putBlock(&b, {58, y, 58});
+		}
+	}
+
+	narf::Vector3f half(0.375f, 0.375f, 0.375f);
+	narf::SweepResult r;
+	auto sweep = [&](const narf::AABB& box, const narf::Vector3f& delta) {
+		world.updateCollision(box, delta, 0.0f);
+		world.sweepAABBPath(box, delta, 0.0f, r);
+		auto expected = steppedSweep(world, box, delta, 1000);
+		EXPECT_NEAR(expected.x, r.movement.x, 0.01f);
+		EXPECT_NEAR(expected.y, r.movement.y, 0.01f);
+		EXPECT_NEAR(expected.z, r.movement.z, 0.01f);
+	};
+
+	// a fast diagonal move whose straight path runs into the side of the pillar stops there and slides along it,
+	// rather than going all the way along x first and passing the pillar's corner
+	narf::AABB diagonal({51.5f, 53.2f, 57.375f}, half);
+	sweep(diagonal, {5.0f, 3.0f, 0.0f});
+	EXPECT_TRUE(r.hit[0]);
+	EXPECT_FALSE(r.hit[1]);
+	EXPECT_EQ(narf::BlockCoord(55, 55, 57), r.block);
+	EXPECT_NEAR(55.0f, 51.5f + r.movement.x + 0.375f, 0.01f);
+	EXPECT_FLOAT_EQ(3.0f, r.movement.y);
+
+	// moving several blocks in one tick through the gap in the wall, nearly head on
+	narf::AABB throughGap({54.5f, 60.4f, 57.375f}, half);
+	sweep(throughGap, {5.0f, 0.2f, 0.0f});
+	EXPECT_FALSE(r.hit[0] || r.hit[1] || r.hit[2]);
+	EXPECT_FLOAT_EQ(5.0f, r.movement.x);
+
+	// too far off the line of the gap, it catches the edge of the wall instead
+	sweep(throughGap, {5.0f, 1.0f, 0.0f});
+	EXPECT_TRUE(r.hit[0]);
+	EXPECT_NEAR(58.0f, 54.5f + r.movement.x + 0.375f, 0.01f);
+}
+
+TEST(World, SweepAABBCollisionCache) {
+	narf::World world(64, 64, 64, 16, 16, 16);
+	narf::Block b;
+	b.id = 2;
+	for (int32_t y = 48; y < 64; y++) {
+		for (int32_t x = 48; x < 64; x++) {
+			world.putBlock(&b, {x, y, 56});
+		}
+	}
+
+	// half-height block, which is not a full cube
+	narf::BlockType slabType(5, 5, 5, 5, 5, 5);
+	slabType.aabbCenterOffset = narf::Vector3f(0.0f, 0.0f, -0.25f);
+	slabType.aabbHalfSize = narf::Vector3f(0.5f, 0.5f, 0.25f);
+	narf::Block slab;
+	slab.id = world.addBlockType(slabType);
+	world.putBlock(&slab, {52, 52, 57});
+
+	narf::Vector3f half(0.375f, 0.375f, 0.375f);
+	narf::SweepResult r;
+	auto sweep = [&](const narf::AABB& box, const narf::Vector3f& delta, float stepHeight) {
+		world.updateCollision(box, delta, stepHeight);
+		world.sweepAABB(box, delta, stepHeight, r);
+	};
+	auto landingHeight = [&]() {
+		sweep(narf::AABB({52.5f, 52.5f, 60.0f}, half), {0.0f, 0.0f, -5.0f}, 0.0f);
+		EXPECT_TRUE(r.hit[2]);
+		return 60.0f + r.movement.z - 0.375f;
+	};
+	EXPECT_NEAR(57.5f, landingHeight(), 0.01f);
+	EXPECT_EQ(narf::BlockCoord(52, 52, 57), r.block);
+
+	// changing blocks updates the cached collision data
+	narf::Block air;
+	air.id = 0;
+	world.putBlock(&air, {52, 52, 57});
+	EXPECT_NEAR(57.0f, landingHeight(), 0.01f);
+	world.putBlock(&b, {52, 52, 57});
+	EXPECT_NEAR(58.0f, landingHeight(), 0.01f);
+}
+
+TEST(World, ChunkUpdates) {
+	narf::World server(64, 64, 64, 16, 16, 16), client(64, 64, 64, 16, 16, 16);
+	client.setGenerateChunks(false);
+	narf::ChunkCoord wcc(1, 1, 3);
+	auto chunk = server.getChunk(wcc);
+	narf::Block b;
+	b.id = 2;
+	server.putBlock(&b, {20, 20, 60}); // sky over generated terrain compresses well
+
+	// until a chunk is received, the client has nothing there rather than terrain of its own
+	narf::RayHit hit;
+	EXPECT_FALSE(client.rayCast({20.5f, 20.5f, 63.5f}, {0.0f, 0.0f, -1.0f}, 64.0f, hit));
+	client.putBlock(&b, {20, 20, 50});
+	EXPECT_EQ(nullptr, client.loadedChunk(wcc));
+	EXPECT_TRUE(client.getChunk(wcc)->empty());
+
+	// the client has nothing yet, so it gets the whole chunk
+	narf::ByteStream full;
+	server.serializeChunkUpdate(full, wcc, 0);
+	EXPECT_LT(full.size(), 16u * 16u * 16u * 2u);
+	full.seek(0);
+	client.deserializeChunkUpdate(full);
+	EXPECT_EQ(chunk->checksum(), client.getChunk(wcc)->checksum());
+
+	// one block changed: 4 bytes on top of the message header
+	auto version = chunk->journal().seq();
+	b.id = 3;
+	server.putBlock(&b, {21, 20, 60});
+	narf::ByteStream delta;
+	server.serializeChunkUpdate(delta, wcc, version);
+	EXPECT_EQ(1u + 12u + 2u + 4u, delta.size());
+	delta.seek(0);
+	client.deserializeChunkUpdate(delta);
+	EXPECT_EQ(chunk->checksum(), client.getChunk(wcc)->checksum());
+
+	// more changes than the journal keeps: falls back to the whole chunk
+	version = chunk->journal().seq();
+	for (int32_t i = 0; i < 100; i++) {
+		b.id = 2 + (i & 1);
+		server.putBlock(&b, {16 + (i & 15), 16 + (i >> 4), 61});
+	}
+	narf::ByteStream fallback;
+	server.serializeChunkUpdate(fallback, wcc, version);
+	EXPECT_LT(fallback.size(), 100u * 4u);
+	fallback.seek(0);
+	client.deserializeChunkUpdate(fallback);
+	EXPECT_EQ(chunk->checksum(), client.getChunk(wcc)->checksum());
+
+	narf::ByteStream unload;
+	server.serializeChunkUnload(unload, wcc);
+	unload.seek(0);
+	client.deserializeChunkUpdate(unload);
+	narf::World empty(64, 64, 64, 16, 16, 16);
+	EXPECT_EQ(empty.checksum(), client.checksum()); // no chunks loaded
+	EXPECT_TRUE(client.getChunk(wcc)->empty());
+	EXPECT_FALSE(client.rayCast({20.5f, 20.5f, 63.5f}, {0.0f, 0.0f, -1.0f}, 64.0f, hit));
+}
@@ -0,0 +1,111 @@
+/*
+ * NarfBlock worker thread pool
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "narf/workerpool.h"
+
+
+narf::WorkerPool::WorkerPool(size_t numThreads) :
+	job_(nullptr), count_(0), next_(0), generation_(0), pending_(0), quit_(false) {
+	for (size_t i = 1; i < numThreads; i++) {
+		threads_.emplace_back(&WorkerPool::threadMain, this);
+	}
+}
+
+
+narf::WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		quit_ = true;
+	}
+	wake_.notify_all();
+	for (auto& thread : threads_) {
+		thread.join();
+	}
+}
+
+
+void narf::WorkerPool::run(size_t count, const std::function<void(size_t)>& f) {
+	if (threads_.empty() || count <= 1) {
+		for (size_t i = 0; i < count; i++) {
+			f(i);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		job_ = &f;
+		count_ = count;
+		next_ = 0;
+		pending_ = threads_.size();
+		generation_++;
+	}
+	wake_.notify_all();
+
+	work();
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	done_.wait(lock, [this] { return pending_ == 0; });
+	job_ = nullptr;
+}
+
+
+void narf::WorkerPool::work() {
+	for (;;) {
+		auto i = next_++;
+		if (i >= count_) {
+			break;
+		}
+		(*job_)(i);
+	}
+}
+
+
+void narf::WorkerPool::threadMain() {
+	uint64_t seen = 0;
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (;;) {
+		wake_.wait(lock, [&] { return quit_ || generation_ != seen; });
+		if (quit_) {
+			return;
+		}
+		seen = generation_;
+
+		lock.unlock();
+		work();
+		lock.lock();
+
+		if (--pending_ == 0) {
+			done_.notify_all();
+		}
+	}
+}
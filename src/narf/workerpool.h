@@ -0,0 +1,88 @@
+/*
+ * NarfBlock worker thread pool
+ *
+ * Copyright (c) 2015 Daniel Verkamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in
+ * the documentation and/or other materials provided with the
+ * distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NARF_WORKERPOOL_H
+#define NARF_WORKERPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace narf {
+
+/*
+ * WorkerPool runs parallel loops on a fixed set of threads.
+ * The thread calling run() takes part in the work too.
+ */
+class WorkerPool {
+public:
+	// numThreads: total number of threads working on each run(), including the caller
+	WorkerPool(size_t numThreads);
+	~WorkerPool();
+
+	size_t size() const { return threads_.size() + 1; }
+
+	// call f(i) for each i in [0, count), spread across the pool
+	// returns when all calls have finished
+	void run(size_t count, const std::function<void(size_t)>& f);
+
+	// no copying
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+private:
+	std::vector<std::thread> threads_;
+
+	std::mutex mutex_;
+	std::condition_variable wake_; // signaled when a new run starts or the pool is shutting down
+	std::condition_variable done_; // signaled when the last worker finishes a run
+
+	const std::function<void(size_t)>* job_;
+	size_t count_;
+	std::atomic<size_t> next_; // next index to hand out
+	uint64_t generation_; // incremented for each run
+	size_t pending_; // workers that have not finished the current run
+	bool quit_;
+
+	void threadMain();
+	void work();
+};
+
+} // namespace narf
+
+#endif // NARF_WORKERPOOL_H
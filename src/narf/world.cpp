@@ -34,15 +34,35 @@
 #include "narf/console.h"
 
 #include <float.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <deque>
+#include <new>
 
 
 narf::World::World(int32_t sizeX, int32_t sizeY, int32_t sizeZ, int32_t chunkSizeX, int32_t chunkSizeY, int32_t chunkSizeZ) :
 	entityManager(this),
+	particles(this),
+	pathfinder(this),
 	sizeX_(sizeX), sizeY_(sizeY), sizeZ_(sizeZ),
 	chunkSizeX_(chunkSizeX), chunkSizeY_(chunkSizeY), chunkSizeZ_(chunkSizeZ),
+	chunkPool_(sizeof(Chunk), 64 * 1024),
+	chunkDataPool_(Chunk::dataSize({chunkSizeX, chunkSizeY, chunkSizeZ}), 2 * 1024 * 1024),
+	gravity_(0.0f),
+	tick_(0),
 	numBlockTypes_(0)
 {
-	// TODO: verify size is a multiple of chunk_size and a power of 2
+	chunkDataPool_.setHugePages(true);
+
+	// world and chunk sizes must be powers of 2 so block and chunk indexes are shifts and masks
+	assert(sizeX > 0 && (sizeX & (sizeX - 1)) == 0);
+	assert(sizeY > 0 && (sizeY & (sizeY - 1)) == 0);
+	assert(sizeZ > 0 && (sizeZ & (sizeZ - 1)) == 0);
+	assert(chunkSizeX > 0 && (chunkSizeX & (chunkSizeX - 1)) == 0 && chunkSizeX <= sizeX);
+	assert(chunkSizeY > 0 && (chunkSizeY & (chunkSizeY - 1)) == 0 && chunkSizeY <= sizeY);
+	assert(chunkSizeZ > 0 && (chunkSizeZ & (chunkSizeZ - 1)) == 0 && chunkSizeZ <= sizeZ);
 
 	// chunk shifts to get chunk coords from world coords
 	chunkShiftX_ = ilog2(chunkSizeX);
@@ -59,7 +79,14 @@ narf::World::World(int32_t sizeX, int32_t sizeY, int32_t sizeZ, int32_t chunkSiz
 	chunksY_ = sizeY_ / chunkSizeY;
 	chunksZ_ = sizeZ_ / chunkSizeZ;
 
+	// chunk table shifts to get chunk index from chunk coords
+	chunksShiftX_ = ilog2(chunksX_);
+	chunksShiftXY_ = ilog2(chunksX_ * chunksY_);
+
 	chunks_ = (Chunk**)calloc(static_cast<size_t>(chunksX_ * chunksY_ * chunksZ_), sizeof(Chunk*));
+	unloadedSeqs_.assign(static_cast<size_t>(chunksX_ * chunksY_ * chunksZ_), 0);
+	generateChunks_ = true;
+	absentChunk_ = nullptr;
 
 	// initialize block types
 	// TODO: put this in a config file
@@ -84,9 +111,12 @@ narf::World::World(int32_t sizeX, int32_t sizeY, int32_t sizeZ, int32_t chunkSiz
 narf::World::~World() {
 	for (int32_t i = 0; i < chunksX_ * chunksY_ * chunksZ_; i++) {
 		if (chunks_[i]) {
-			delete chunks_[i];
+			deleteChunk(chunks_[i]);
 		}
 	}
+	if (absentChunk_) {
+		deleteChunk(absentChunk_);
+	}
 	free(chunks_);
 }
 
@@ -102,6 +132,17 @@ bool narf::World::validCoords(const narf::BlockCoord& wbc) const {
 }
 
 
+bool narf::World::validChunkCoords(const narf::ChunkCoord& wcc) const {
+	return
+		wcc.x >= 0 &&
+		wcc.y >= 0 &&
+		wcc.z >= 0 &&
+		wcc.x < chunksX_ &&
+		wcc.y < chunksY_ &&
+		wcc.z < chunksZ_;
+}
+
+
 const narf::Block* narf::World::getBlockUnchecked(const narf::BlockCoord& wbc) {
 	ChunkCoord cc;
 	narf::Chunk::BlockCoord cbc;
@@ -124,6 +165,9 @@ void narf::World::putBlockUnchecked(const narf::Block *b, const narf::BlockCoord
 	narf::Chunk::BlockCoord cbc;
 	calcChunkCoords(wbc, cc, cbc);
 	Chunk* chunk = getChunk(cc);
+	if (chunk == absentChunk_) {
+		return; // changes to a chunk that has not been received would be lost when it is
+	}
 	chunk->putBlock(b, cbc);
 }
 
@@ -183,10 +227,36 @@ narf::BlockCoord narf::World::calcBlockCoords(const ChunkCoord& cc) const {
 
 
 narf::Chunk *narf::World::newChunk(int32_t chunk_x, int32_t chunk_y, int32_t chunk_z) {
-	return new Chunk(
+	auto mem = chunkPool_.alloc();
+	if (!mem) {
+		narf::console->println("World::newChunk: out of memory");
+		abort();
+	}
+	return new (mem) Chunk(
 		this,
+		chunkDataPool_,
 		Vector3<int32_t>{chunkSizeX_, chunkSizeY_, chunkSizeZ_},
-		ChunkCoord{chunk_x, chunk_y, chunk_z});
+		ChunkCoord{chunk_x, chunk_y, chunk_z},
+		unloadedSeqs_[chunkIndex({chunk_x, chunk_y, chunk_z})]);
+}
+
+
+void narf::World::deleteChunk(narf::Chunk *chunk) {
+	chunk->~Chunk();
+	chunkPool_.free(chunk);
+}
+
+
+void narf::World::dumpChunkPoolStats() const {
+	auto dump = [](const std::string& name, const SlabPool::Stats& stats) {
+		narf::console->println(name + ": " +
+			std::to_string(stats.liveItems) + " live, " +
+			std::to_string(stats.freeItems) + " free, " +
+			std::to_string(stats.slabs) + " slabs (" +
+			std::to_string(stats.bytes / 1024) + " KiB)");
+	};
+	dump("Chunk objects", chunkPool_.stats());
+	dump("Chunk block data", chunkDataPool_.stats());
 }
 
 
@@ -197,11 +267,14 @@ narf::Chunk *narf::World::getChunk(const narf::ChunkCoord& wcc) {
 	assert(wcc.x < chunksX_);
 	assert(wcc.y < chunksY_);
 	assert(wcc.z < chunksZ_);
-	Chunk *chunk = chunks_[((wcc.z * chunksY_) + wcc.y) * chunksX_ + wcc.x];
+	Chunk *chunk = chunks_[chunkIndex(wcc)];
 	if (!chunk) {
+		if (!generateChunks_) {
+			return absentChunk_; // nothing there until it is received
+		}
 		// get from backing store, or allocate if it doesn't exist yet
 		// for now, no backing store, so just always allocate a new chunk
-		chunk = chunks_[((wcc.z * chunksY_) + wcc.y) * chunksX_ + wcc.x] =
+		chunk = chunks_[chunkIndex(wcc)] =
 			newChunk(wcc.x, wcc.y, wcc.z);
 		chunk->generate();
 	}
@@ -209,8 +282,64 @@ narf::Chunk *narf::World::getChunk(const narf::ChunkCoord& wcc) {
 }
 
 
+narf::Chunk *narf::World::receiveChunk(const narf::ChunkCoord& wcc) {
+	auto& chunk = chunks_[chunkIndex(wcc)];
+	if (!chunk) {
+		chunk = newChunk(wcc.x, wcc.y, wcc.z);
+	}
+	return chunk;
+}
+
+
+void narf::World::setGenerateChunks(bool generate) {
+	generateChunks_ = generate;
+	if (!generate && !absentChunk_) {
+		absentChunk_ = newChunk(0, 0, 0); // never generated or changed, so it stays empty
+	}
+}
+
+
+narf::Chunk *narf::World::loadedChunk(const narf::ChunkCoord& wcc) const {
+	if (!validChunkCoords(wcc)) {
+		return nullptr;
+	}
+	return chunks_[chunkIndex(wcc)];
+}
+
+
+void narf::World::unloadChunk(const narf::ChunkCoord& wcc) {
+	if (!validChunkCoords(wcc)) {
+		return;
+	}
+	auto index = chunkIndex(wcc);
+	auto& chunk = chunks_[index];
+	if (chunk) {
+		unloadedSeqs_[index] = chunk->journal().seq();
+		deleteChunk(chunk);
+		chunk = nullptr;
+		entityManager.chunkChanged(wcc);
+		pathfinder.chunkChanged(wcc);
+	}
+}
+
+
 void narf::World::update(narf::timediff dt) {
 	entityManager.update(dt);
+	particles.update(dt);
+	tick_++;
+	entityManager.recordChecksum(tick_);
+}
+
+
+uint64_t narf::World::checksum() {
+	auto sum = entityManager.checksum();
+	auto numChunks = static_cast<uint64_t>(chunksX_ * chunksY_ * chunksZ_);
+	for (uint64_t i = 0; i < numChunks; i++) {
+		if (chunks_[i]) {
+			sum += mix64(i ^ mix64(chunks_[i]->checksum()));
+		}
+	}
+	return sum;
 }
 
 
@@ -296,6 +425,514 @@ void narf::World::rayTrace(narf::Point3f basePoint, narf::Vector3f direction, st
 }
 
 
+// face of a block that a ray enters through when stepping along axis in direction step
+static narf::BlockFace enteredFace(int axis, int32_t step) {
+	static const narf::BlockFace faces[3][2] = {
+		{narf::XPos, narf::XNeg},
+		{narf::YPos, narf::YNeg},
+		{narf::ZPos, narf::ZNeg},
+	};
+	return faces[axis][step > 0 ? 1 : 0];
+}
+
+bool narf::World::rayCast(const narf::Point3f& origin, const narf::Vector3f& direction, float maxDistance, narf::RayHit& hit) {
+	auto dir = direction.normalize();
+	const float o[3] = {origin.x, origin.y, origin.z};
+	const float d[3] = {dir.x, dir.y, dir.z};
+	const int32_t worldSize[3] = {sizeX_, sizeY_, sizeZ_};
+	const int32_t chunkSize[3] = {chunkSizeX_, chunkSizeY_, chunkSizeZ_};
+
+	int32_t step[3];
+	float tDelta[3];
+	for (int i = 0; i < 3; i++) {
+		step[i] = d[i] > 0.0f ? 1 : (d[i] < 0.0f ? -1 : 0);
+		tDelta[i] = step[i] ? fabsf(1.0f / d[i]) : FLT_MAX;
+	}
+
+	// clip the ray to the world bounds
+	float t = 0.0f;
+	float tEnd = maxDistance;
+	int entryAxis = -1;
+	for (int i = 0; i < 3; i++) {
+		if (step[i] == 0) {
+			if (o[i] < 0.0f || o[i] >= (float)worldSize[i]) {
+				return false;
+			}
+			continue;
+		}
+		float t1 = -o[i] / d[i];
+		float t2 = ((float)worldSize[i] - o[i]) / d[i];
+		if (std::min(t1, t2) > t) {
+			t = std::min(t1, t2);
+			entryAxis = i;
+		}
+		tEnd = std::min(tEnd, std::max(t1, t2));
+	}
+	if (t > tEnd) {
+		return false;
+	}
+
+	int32_t cell[3];
+	for (int i = 0; i < 3; i++) {
+		cell[i] = clampi((int32_t)floorf(o[i] + d[i] * t), 0, worldSize[i] - 1);
+	}
+
+	BlockFace face = BlockFace::Invalid;
+	if (entryAxis >= 0) {
+		cell[entryAxis] = step[entryAxis] > 0 ? 0 : worldSize[entryAxis] - 1;
+		face = enteredFace(entryAxis, step[entryAxis]);
+	}
+
+	// distance along the ray to the next block boundary on each axis
+	float tNext[3];
+	auto calcNextBoundaries = [&]() {
+		for (int i = 0; i < 3; i++) {
+			tNext[i] = step[i] ? ((float)(cell[i] + (step[i] > 0 ? 1 : 0)) - o[i]) / d[i] : FLT_MAX;
+		}
+	};
+	calcNextBoundaries();
+
+	while (t <= tEnd) {
+		ChunkCoord cc;
+		Chunk::BlockCoord cbc;
+		calcChunkCoords({cell[0], cell[1], cell[2]}, cc, cbc);
+		Chunk* chunk = getChunk(cc);
+
+		// find the largest empty region containing the current block, if any
+		int32_t lo[3], size[3];
+		bool skip = false;
+		if (chunk->empty()) {
+			auto corner = calcBlockCoords(cc);
+			lo[0] = corner.x; lo[1] = corner.y; lo[2] = corner.z;
+			size[0] = chunkSize[0]; size[1] = chunkSize[1]; size[2] = chunkSize[2];
+			skip = true;
+		} else if (chunk->brickEmpty(cbc)) {
+			for (int i = 0; i < 3; i++) {
+				lo[i] = cell[i] & ~(Chunk::BrickSize - 1);
+				size[i] = Chunk::BrickSize;
+			}
+			skip = true;
+		} else if (chunk->isOpaque(cbc)) {
+			hit.point = Point3f(o[0] + d[0] * t, o[1] + d[1] * t, o[2] + d[2] * t);
+			hit.wbc = BlockCoord(cell[0], cell[1], cell[2]);
+			hit.face = face;
+			hit.distance = t;
+			return true;
+		}
+
+		int axis = -1;
+		if (skip) {
+			// jump straight to the point where the ray leaves the empty region
+			float tExit = FLT_MAX;
+			for (int i = 0; i < 3; i++) {
+				if (step[i]) {
+					float bound = (float)(step[i] > 0 ? lo[i] + size[i] : lo[i]);
+					float te = (bound - o[i]) / d[i];
+					if (te < tExit) {
+						tExit = te;
+						axis = i;
+					}
+				}
+			}
+			if (axis < 0) {
+				return false;
+			}
+			t = std::max(t, tExit);
+			for (int i = 0; i < 3; i++) {
+				if (i == axis) {
+					cell[i] = step[i] > 0 ? lo[i] + size[i] : lo[i] - 1;
+				} else {
+					cell[i] = clampi((int32_t)floorf(o[i] + d[i] * t), lo[i], lo[i] + size[i] - 1);
+				}
+			}
+			calcNextBoundaries();
+		} else {
+			// step to the adjacent block
+			axis = 0;
+			if (tNext[1] < tNext[axis]) {
+				axis = 1;
+			}
+			if (tNext[2] < tNext[axis]) {
+				axis = 2;
+			}
+			if (!step[axis]) {
+				return false;
+			}
+			t = tNext[axis];
+			cell[axis] += step[axis];
+			tNext[axis] += tDelta[axis];
+		}
+
+		face = enteredFace(axis, step[axis]);
+		if (cell[axis] < 0 || cell[axis] >= worldSize[axis]) {
+			return false; // left the world
+		}
+	}
+
+	return false;
+}
+
+
+bool narf::World::lineOfSight(const narf::Point3f& a, const narf::Point3f& b) {
+	RayHit hit;
+	return !rayCast(a, b - a, a.distanceTo(b), hit);
+}
+
+
+// gap below which boxes are considered touching rather than overlapping
+static const float SweepEpsilon = 1.0f / 1024.0f;
+
+
+void narf::World::updateCollision(const AABB& box, const Vector3f& delta, float stepHeight) {
+	// bounds of the box at both ends of the move, plus room to step up and a block of slack for rounding;
+	// clamped to the world before conversion so far away boxes cannot overflow the cast
+	const float c[3] = {box.center.x, box.center.y, box.center.z};
+	const float h[3] = {box.halfSize.x, box.halfSize.y, box.halfSize.z};
+	const float d[3] = {delta.x, delta.y, delta.z};
+	const int32_t size[3] = {sizeX_, sizeY_, sizeZ_};
+	const int32_t chunkSize[3] = {chunkSizeX_, chunkSizeY_, chunkSizeZ_};
+	int32_t c1[3], c2[3];
+	for (int k = 0; k < 3; k++) {
+		auto lo = c[k] - h[k] + std::min(d[k], 0.0f) - 1.0f;
+		auto hi = c[k] + h[k] + std::max(d[k], 0.0f) + 1.0f + (k == 2 ? stepHeight : 0.0f);
+		lo = std::max(lo, 0.0f);
+		hi = std::min(hi, (float)(size[k] - 1));
+		if (!(lo <= hi)) {
+			return; // entirely outside the world, so nothing to collide with
+		}
+		c1[k] = (int32_t)lo / chunkSize[k];
+		c2[k] = (int32_t)hi / chunkSize[k];
+	}
+
+	for (int32_t z = c1[2]; z <= c2[2]; z++) {
+		for (int32_t y = c1[1]; y <= c2[1]; y++) {
+			for (int32_t x = c1[0]; x <= c2[0]; x++) {
+				getChunk({x, y, z})->updateCollision();
+			}
+		}
+	}
+}
+
+
+float narf::World::sweepAxis(const float mn[3], const float mx[3], int axis, float d, BlockCoord& hitBlock, bool& hit) {
+	hit = false;
+	if (d == 0.0f) {
+		return 0.0f;
+	}
+
+	// region swept by the box; boxes that only touch on the other axes do not block it
+	float lo[3], hi[3];
+	for (int k = 0; k < 3; k++) {
+		lo[k] = mn[k] + SweepEpsilon;
+		hi[k] = mx[k] - SweepEpsilon;
+	}
+	if (d > 0.0f) {
+		lo[axis] = mx[axis] - SweepEpsilon;
+		hi[axis] = mx[axis] + d;
+	} else {
+		lo[axis] = mn[axis] + d;
+		hi[axis] = mn[axis] + SweepEpsilon;
+	}
+
+	// block AABBs are assumed to lie within their own block
+	const int32_t size[3] = {sizeX_, sizeY_, sizeZ_};
+	int32_t c1[3], c2[3];
+	for (int k = 0; k < 3; k++) {
+		c1[k] = std::max((int32_t)floorf(lo[k]), 0);
+		c2[k] = std::min((int32_t)floorf(hi[k]), size[k] - 1);
+		if (c1[k] > c2[k]) {
+			return d; // nothing in the way inside the world
+		}
+	}
+
+	float allowed = fabsf(d);
+
+	// check a block's AABB against the box, unless the box already overlaps it
+	auto blockedBy = [&](const float bmn[3], const float bmx[3], const BlockCoord& bc) {
+		for (int k = 0; k < 3; k++) {
+			if (k != axis && (bmx[k] <= mn[k] + SweepEpsilon || bmn[k] >= mx[k] - SweepEpsilon)) {
+				return;
+			}
+		}
+		float gap = d > 0.0f ? bmn[axis] - mx[axis] : mn[axis] - bmx[axis];
+		if (gap < -SweepEpsilon) {
+			return; // already inside this block
+		}
+		gap = std::max(gap, 0.0f);
+		if (gap < allowed) {
+			allowed = gap;
+			hitBlock = bc;
+			hit = true;
+		}
+	};
+
+	// read the chunks' collision data one layer of blocks at a time, moving away from the box, and stop after
+	// the first layer with something in the way; blocks in farther layers cannot be closer
+	int32_t step = d > 0.0f ? 1 : -1;
+	int32_t end = d > 0.0f ? c2[axis] + 1 : c1[axis] - 1;
+	ChunkCoord cachedCC(-1, -1, -1);
+	const ChunkCollision* collision = nullptr;
+	for (int32_t layer = d > 0.0f ? c1[axis] : c2[axis]; layer != end && !hit; layer += step) {
+		// gap to a full cube in this layer; other shapes are no closer
+		float gap = d > 0.0f ? (float)layer - mx[axis] : mn[axis] - (float)(layer + 1);
+		bool inside = gap < -SweepEpsilon; // the box overlaps this layer, so only smaller shapes can be ahead of it
+		if (!inside && std::max(gap, 0.0f) >= allowed) {
+			break;
+		}
+		int32_t l1[3] = {c1[0], c1[1], c1[2]}, l2[3] = {c2[0], c2[1], c2[2]};
+		l1[axis] = l2[axis] = layer;
+		for (int32_t z = l1[2]; z <= l2[2]; z++) {
+			for (int32_t y = l1[1]; y <= l2[1]; y++) {
+				for (int32_t x = l1[0]; x <= l2[0]; x++) {
+					BlockCoord bc(x, y, z);
+					ChunkCoord cc(x >> chunkShiftX_, y >> chunkShiftY_, z >> chunkShiftZ_);
+					if (!collision || cc != cachedCC) {
+						collision = &getChunk(cc)->getCollision();
+						cachedCC = cc;
+					}
+					auto index = (size_t)(((z & blockMaskZ_) << (chunkShiftX_ + chunkShiftY_)) | ((y & blockMaskY_) << chunkShiftX_) | (x & blockMaskX_));
+					if (collision->cube(index)) {
+						if (!inside) {
+							float bmn[3] = {(float)x, (float)y, (float)z};
+							float bmx[3] = {bmn[0] + 1.0f, bmn[1] + 1.0f, bmn[2] + 1.0f};
+							blockedBy(bmn, bmx, bc);
+						}
+					} else if (!collision->boxes.empty() && collision->shaped(index)) {
+						const auto& aabb = collision->box(index);
+						float bmn[3] = {aabb.center.x - aabb.halfSize.x, aabb.center.y - aabb.halfSize.y, aabb.center.z - aabb.halfSize.z};
+						float bmx[3] = {aabb.center.x + aabb.halfSize.x, aabb.center.y + aabb.halfSize.y, aabb.center.z + aabb.halfSize.z};
+						blockedBy(bmn, bmx, bc);
+					}
+				}
+			}
+		}
+	}
+
+	return d > 0.0f ? allowed : -allowed;
+}
+
+
+void narf::World::sweepAABB(const AABB& box, const Vector3f& delta, float stepHeight, SweepResult& result) {
+	float start[2][3] = {
+		{box.center.x - box.halfSize.x, box.center.y - box.halfSize.y, box.center.z - box.halfSize.z},
+		{box.center.x + box.halfSize.x, box.center.y + box.halfSize.y, box.center.z + box.halfSize.z},
+	};
+	float d[3] = {delta.x, delta.y, delta.z};
+
+	// move the box (min and max corners) along one axis
+	auto move = [this](float (&b)[2][3], int axis, float dist, BlockCoord& hitBlock, bool& hit) {
+		auto moved = sweepAxis(b[0], b[1], axis, dist, hitBlock, hit);
+		b[0][axis] += moved;
+		b[1][axis] += moved;
+		return moved;
+	};
+
+	float b[2][3];
+	memcpy(b, start, sizeof(b));
+	float moved[3];
+	result.toi = 1.0f;
+	result.stepped = false;
+	static const int order[3] = {2, 0, 1};
+	for (auto axis : order) {
+		moved[axis] = move(b, axis, d[axis], result.block, result.hit[axis]);
+		if (result.hit[axis]) {
+			result.toi = std::min(result.toi, moved[axis] / d[axis]);
+		}
+	}
+
+	bool onGround = result.hit[2] && d[2] <= 0.0f;
+	if (stepHeight > 0.0f && onGround && (result.hit[0] || result.hit[1])) {
+		// try again from the start: up, sideways, and back down onto whatever is there
+		float sb[2][3];
+		memcpy(sb, start, sizeof(sb));
+		BlockCoord stepBlock;
+		bool stepHit[3], upHit;
+		float up = move(sb, 2, stepHeight, stepBlock, upHit);
+		float sx = move(sb, 0, d[0], stepBlock, stepHit[0]);
+		float sy = move(sb, 1, d[1], stepBlock, stepHit[1]);
+		float down = move(sb, 2, d[2] - up, stepBlock, stepHit[2]);
+		if (sx * sx + sy * sy > moved[0] * moved[0] + moved[1] * moved[1] + SweepEpsilon) {
+			moved[0] = sx;
+			moved[1] = sy;
+			moved[2] = up + down;
+			memcpy(result.hit, stepHit, sizeof(stepHit));
+			if (stepHit[0] || stepHit[1] || stepHit[2]) {
+				result.block = stepBlock;
+			}
+			result.stepped = true;
+		}
+	}
+
+	result.movement = Vector3f(moved[0], moved[1], moved[2]);
+}
+
+
+// longest move sweepAABBPath() hands to sweepAABB() in one piece
+static const float MaxSubstep = 0.5f;
+
+void narf::World::sweepAABBPath(const AABB& box, const Vector3f& delta, float stepHeight, SweepResult& result) {
+	auto length = delta.length();
+	if (length <= MaxSubstep) {
+		sweepAABB(box, delta, stepHeight, result);
+		return;
+	}
+
+	// DDA over the blocks the box center passes through
+	// tNext[k] is the fraction of delta at which the center next crosses a block boundary along axis k
+	const float c[3] = {box.center.x, box.center.y, box.center.z};
+	const float d[3] = {delta.x, delta.y, delta.z};
+	float tNext[3], tStep[3];
+	for (int k = 0; k < 3; k++) {
+		if (d[k] == 0.0f) {
+			tNext[k] = tStep[k] = INFINITY;
+		} else {
+			float boundary = d[k] > 0.0f ? floorf(c[k]) + 1.0f : ceilf(c[k]) - 1.0f;
+			tNext[k] = (boundary - c[k]) / d[k];
+			tStep[k] = 1.0f / fabsf(d[k]);
+		}
+	}
+
+	result.movement = Vector3f(0.0f, 0.0f, 0.0f);
+	result.toi = 1.0f;
+	result.hit[0] = result.hit[1] = result.hit[2] = false;
+	result.stepped = false;
+
+	AABB cur = box;
+	auto dir = delta; // axes that have been blocked are dropped from the rest of the move
+	float done = 0.0f;
+	auto maxStep = MaxSubstep / length;
+	while (done < 1.0f) {
+		auto t = std::min(std::min(std::min(tNext[0], tNext[1]), std::min(tNext[2], done + maxStep)), 1.0f);
+		for (int k = 0; k < 3; k++) {
+			while (tNext[k] <= t) {
+				tNext[k] += tStep[k];
+			}
+		}
+
+		SweepResult step;
+		sweepAABB(cur, dir * (t - done), stepHeight, step);
+		cur.center += step.movement;
+		result.movement += step.movement;
+		result.stepped = result.stepped || step.stepped;
+
+		if (step.hit[0] || step.hit[1] || step.hit[2]) {
+			if (!result.hit[0] && !result.hit[1] && !result.hit[2]) {
+				result.toi = done + step.toi * (t - done);
+				result.block = step.block;
+			}
+			if (step.hit[0]) { result.hit[0] = true; dir.x = 0.0f; }
+			if (step.hit[1]) { result.hit[1] = true; dir.y = 0.0f; }
+			if (step.hit[2]) { result.hit[2] = true; dir.z = 0.0f; }
+			if (dir.x == 0.0f && dir.y == 0.0f && dir.z == 0.0f) {
+				break;
+			}
+		}
+		done = t;
+	}
+}
+
+
+void narf::World::findVisibleChunks(const narf::Point3f& pos, const narf::Vector3f& viewDir, int32_t radius, std::vector<narf::ChunkCoord>& visible) {
+	visible.clear();
+
+	ChunkCoord camCC(
+		(int32_t)floorf(pos.x / (float)chunkSizeX_),
+		(int32_t)floorf(pos.y / (float)chunkSizeY_),
+		(int32_t)floorf(pos.z / (float)chunkSizeZ_));
+
+	// horizontal range of chunks to consider, clipped to the world
+	ChunkCoord minCC(clampi(camCC.x - radius, 0, chunksX_), clampi(camCC.y - radius, 0, chunksY_), 0);
+	ChunkCoord maxCC(clampi(camCC.x + radius, 0, chunksX_), clampi(camCC.y + radius, 0, chunksY_), chunksZ_);
+	if (minCC.x >= maxCC.x || minCC.y >= maxCC.y) {
+		return;
+	}
+
+	// the same sphere a server streams chunks in (see ChunkStream), so the corners of the range are left out
+	auto inRange = [&](const ChunkCoord& cc) {
+		auto dx = cc.x - camCC.x, dy = cc.y - camCC.y, dz = cc.z - camCC.z;
+		return dx * dx + dy * dy + dz * dz <= radius * radius;
+	};
+
+	if (camCC.x < minCC.x || camCC.y < minCC.y || camCC.z < minCC.z ||
+		camCC.x >= maxCC.x || camCC.y >= maxCC.y || camCC.z >= maxCC.z) {
+		// camera is outside the world; no connectivity information to start from, so consider everything in range
+		ZYXCoordIter<ChunkCoord> iter(minCC, maxCC);
+		for (const auto& cc : iter) {
+			if (inRange(cc)) {
+				visible.push_back(cc);
+			}
+		}
+		return;
+	}
+
+	struct Step {
+		ChunkCoord cc;
+		BlockFace entered; // face of cc this step came in through
+		unsigned directions; // bit set of BlockFace directions travelled so far
+	};
+
+	static const BlockFace opposite[6] = {XNeg, XPos, YNeg, YPos, ZNeg, ZPos};
+	static const ChunkCoord offsets[6] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+
+	auto view = viewDir.normalize();
+
+	// half the diagonal of a chunk, to keep chunks that straddle the plane behind the camera
+	auto chunkRadius = Vector3f((float)chunkSizeX_, (float)chunkSizeY_, (float)chunkSizeZ_).length() * 0.5f;
+
+	auto sx = maxCC.x - minCC.x;
+	auto sy = maxCC.y - minCC.y;
+	std::vector<bool> visited(static_cast<size_t>(sx * sy * chunksZ_), false);
+	auto visitedIndex = [&](const ChunkCoord& cc) {
+		return static_cast<size_t>((cc.z * sy + (cc.y - minCC.y)) * sx + (cc.x - minCC.x));
+	};
+
+	std::deque<Step> queue;
+	queue.push_back({camCC, BlockFace::Invalid, 0});
+	visited[visitedIndex(camCC)] = true;
+
+	while (!queue.empty()) {
+		auto step = queue.front();
+		queue.pop_front();
+		visible.push_back(step.cc);
+
+		auto chunk = getChunk(step.cc);
+		for (unsigned dir = 0; dir < 6; dir++) {
+			// never turn back towards the camera
+			if (step.directions & (1u << opposite[dir])) {
+				continue;
+			}
+
+			ChunkCoord next = step.cc + offsets[dir];
+			if (next.x < minCC.x || next.y < minCC.y || next.z < minCC.z ||
+				next.x >= maxCC.x || next.y >= maxCC.y || next.z >= maxCC.z || !inRange(next)) {
+				continue;
+			}
+
+			auto index = visitedIndex(next);
+			if (visited[index]) {
+				continue;
+			}
+
+			if (step.entered != BlockFace::Invalid && !chunk->facesConnected(step.entered, (BlockFace)dir)) {
+				continue;
+			}
+
+			// skip chunks entirely behind the camera
+			Point3f center(
+				((float)next.x + 0.5f) * (float)chunkSizeX_,
+				((float)next.y + 0.5f) * (float)chunkSizeY_,
+				((float)next.z + 0.5f) * (float)chunkSizeZ_);
+			if ((center - pos).dot(view) < -chunkRadius) {
+				continue;
+			}
+
+			visited[index] = true;
+			queue.push_back({next, opposite[dir], step.directions | (1u << dir)});
+		}
+	}
+}
+
+
 void narf::World::serializeChunk(ByteStream& s, const ChunkCoord& wcc) {
 	s.write(wcc.x, LE);
 	s.write(wcc.y, LE);
@@ -304,6 +941,135 @@ void narf::World::serializeChunk(ByteStream& s, const ChunkCoord& wcc) {
 }
 
 
+void narf::World::serializeChunkUpdate(ByteStream& s, const ChunkCoord& wcc, uint64_t since) {
+	auto chunk = getChunk(wcc);
+	auto numBlocks = static_cast<size_t>(chunkSizeX_ * chunkSizeY_ * chunkSizeZ_);
+
+	// 4 bytes per change, so a handful of changes is always smaller than the whole chunk
+	const size_t SmallDelta = 64;
+	ByteStream delta;
+	std::vector<ChunkJournal::Change> changes;
+	if (since != 0 && numBlocks <= 0x10000 && chunk->journal().changesSince(since, changes)) {
+		delta.write((uint8_t)ChunkUpdateType::Delta);
+		delta.write(wcc.x, LE);
+		delta.write(wcc.y, LE);
+		delta.write(wcc.z, LE);
+		delta.write((uint16_t)changes.size(), LE);
+		for (const auto& change : changes) {
+			delta.write((uint16_t)change.index, LE);
+			delta.write((uint16_t)change.id, LE);
+		}
+		if (delta.size() <= SmallDelta) {
+			s.write(delta.data(), delta.size());
+			return;
+		}
+	}
+
+	ByteStream raw;
+	chunk->serialize(raw);
+	auto packedSize = compressBound(static_cast<uLong>(raw.size()));
+	std::vector<uint8_t> packed(packedSize);
+	if (compress2(packed.data(), &packedSize, static_cast<const Bytef*>(raw.data()), static_cast<uLong>(raw.size()), Z_DEFAULT_COMPRESSION) != Z_OK) {
+		narf::console->println("chunk compression failed");
+		assert(0);
+		return;
+	}
+
+	// 17 bytes of header
+	if (delta.size() > 0 && delta.size() <= packedSize + 17) {
+		s.write(delta.data(), delta.size());
+		return;
+	}
+	s.write((uint8_t)ChunkUpdateType::Full);
+	s.write(wcc.x, LE);
+	s.write(wcc.y, LE);
+	s.write(wcc.z, LE);
+	s.write((uint32_t)packedSize, LE);
+	s.write(packed.data(), packedSize);
+}
+
+
+void narf::World::serializeChunkUnload(ByteStream& s, const ChunkCoord& wcc) const {
+	s.write((uint8_t)ChunkUpdateType::Unload);
+	s.write(wcc.x, LE);
+	s.write(wcc.y, LE);
+	s.write(wcc.z, LE);
+}
+
+
+void narf::World::deserializeChunkUpdate(ByteStream& s) {
+	uint8_t type;
+	ChunkCoord wcc;
+	if (!s.read(&type) ||
+		!s.read(&wcc.x, LE) ||
+		!s.read(&wcc.y, LE) ||
+		!s.read(&wcc.z, LE) ||
+		!validChunkCoords(wcc)) {
+		narf::console->println("chunk update deserialize error");
+		assert(0);
+		return;
+	}
+
+	auto numBlocks = static_cast<size_t>(chunkSizeX_ * chunkSizeY_ * chunkSizeZ_);
+	switch ((ChunkUpdateType)type) {
+	case ChunkUpdateType::Full:
+		{
+			uint32_t packedSize;
+			if (!s.read(&packedSize, LE) || s.bytesLeft() < packedSize) {
+				narf::console->println("chunk update deserialize error");
+				assert(0);
+				return;
+			}
+			std::vector<uint8_t> packed(packedSize), raw(numBlocks * 2);
+			uLongf rawSize = static_cast<uLongf>(raw.size());
+			if (!s.read(packed.data(), packedSize) ||
+				uncompress(raw.data(), &rawSize, packed.data(), packedSize) != Z_OK ||
+				rawSize != raw.size()) {
+				narf::console->println("chunk decompression failed");
+				assert(0);
+				return;
+			}
+			ByteStream bs(raw.data(), raw.size());
+			receiveChunk(wcc)->deserialize(bs);
+			break;
+		}
+
+	case ChunkUpdateType::Delta:
+		{
+			auto chunk = loadedChunk(wcc); // nullptr if it has been unloaded since
+			uint16_t count, index, id;
+			if (!s.read(&count, LE)) {
+				narf::console->println("chunk update deserialize error");
+				assert(0);
+				return;
+			}
+			Block b;
+			for (uint16_t i = 0; i < count; i++) {
+				if (!s.read(&index, LE) || !s.read(&id, LE) || index >= numBlocks) {
+					narf::console->println("chunk update deserialize error");
+					assert(0);
+					return;
+				}
+				b.id = static_cast<BlockTypeId>(id);
+				if (chunk) {
+					chunk->putBlock(&b, chunk->blockCoord(index));
+				}
+			}
+			break;
+		}
+
+	case ChunkUpdateType::Unload:
+		unloadChunk(wcc);
+		break;
+
+	default:
+		narf::console->println("unknown chunk update type " + std::to_string(type));
+		assert(0);
+		break;
+	}
+}
+
+
 void narf::World::serialize(narf::ByteStream& s) {
 	s.write(sizeX_, LE);
 	s.write(sizeY_, LE);
@@ -333,7 +1099,7 @@ void narf::World::deserializeChunk(ByteStream& s, narf::ChunkCoord& wcc) {
 
 	// TODO: sanity check pos
 
-	getChunk(wcc)->deserialize(s);
+	receiveChunk(wcc)->deserialize(s);
  }
 
 
@@ -43,11 +43,31 @@
 #include "narf/block.h"
 #include "narf/chunk.h"
 #include "narf/entity.h"
+#include "narf/particles.h"
+#include "narf/pathfinder.h"
+#include "narf/slab.h"
 #include "narf/time.h"
 #include "narf/math/math.h"
 
 namespace narf {
 
+// result of a World::rayCast() query
+struct RayHit {
+	Point3f point; // point where the ray entered the block
+	BlockCoord wbc; // world coordinates of the block that was hit
+	BlockFace face; // face the ray entered through (Invalid if the ray started inside the block)
+	float distance; // distance along the ray from its origin to point
+};
+
+// result of a World::sweepAABB() query
+struct SweepResult {
+	Vector3f movement; // how far the box actually moved (the requested movement, clipped where it ran into blocks)
+	float toi; // time of impact: fraction of the movement completed before the first contact (1 if nothing was hit)
+	bool hit[3]; // whether movement along x, y and z was stopped by a block
+	BlockCoord block; // a block that stopped the movement (valid if any of hit[] is set)
+	bool stepped; // the box climbed onto an obstacle
+};
+
 class World {
 friend class EntityRef;
 public:
@@ -62,7 +82,16 @@ public:
 	void serializeChunk(ByteStream& s, const ChunkCoord& wcc);
 	void deserializeChunk(ByteStream& s, ChunkCoord& wcc);
 
+	// messages that keep a copy of a chunk up to date, e.g. on a client
+	// since is the version (journal sequence number) of the receiver's copy, or 0 if it has none;
+	// while the journal still has the changes made after it, they are sent instead of the whole chunk,
+	// unless they would take more bytes than the compressed chunk
+	void serializeChunkUpdate(ByteStream& s, const ChunkCoord& wcc, uint64_t since);
+	void serializeChunkUnload(ByteStream& s, const ChunkCoord& wcc) const;
+	void deserializeChunkUpdate(ByteStream& s);
+
 	bool validCoords(const BlockCoord& wbc) const;
+	bool validChunkCoords(const ChunkCoord& wcc) const;
 
 	const Block* getBlockUnchecked(const BlockCoord& c);
 	const Block* getBlock(const BlockCoord& c);
@@ -91,40 +120,133 @@ public:
 	static void rayTrace(Point3f basePoint, Vector3f direction,
 		std::function<bool(const Point3f&, const BlockCoord&, const BlockFace&)> test);
 
+	// find the first opaque block along a ray, skipping empty chunks and bricks without visiting each block
+	// returns false if the ray leaves the world or travels maxDistance without hitting anything
+	bool rayCast(const Point3f& origin, const Vector3f& direction, float maxDistance, RayHit& hit);
+
+	// true if no opaque block lies between a and b
+	bool lineOfSight(const Point3f& a, const Point3f& b);
+
+	// move box by delta, one axis at a time (z, then x, then y), stopping each axis at the first block in the way
+	// so the box slides along whatever it runs into; only the blocks in the region swept by the box are examined
+	// if the box is resting on the ground and stepHeight > 0, it may climb obstacles up to stepHeight high
+	// blocks the box already overlaps are ignored, so it can move out of them
+	// the chunks the sweep passes through must have been prepared with updateCollision()
+	void sweepAABB(const AABB& box, const Vector3f& delta, float stepHeight, SweepResult& result);
+
+	// sweepAABB() that follows the path of a long move more closely: moves of more than half a block are split
+	// into substeps ending where the box center crosses into another block, so resolving the axes separately
+	// cannot carry the box around an obstacle that the straight path runs into
+	// toi and block describe the first hit along the path
+	void sweepAABBPath(const AABB& box, const Vector3f& delta, float stepHeight, SweepResult& result);
+
+	// load the chunks a sweep of box by delta could touch and bring their collision geometry up to date
+	// not thread safe; sweeps themselves only read the chunks, so they can then run on several threads
+	void updateCollision(const AABB& box, const Vector3f& delta, float stepHeight);
+
+	// find chunks within radius chunks of the one containing pos that could be visible looking along viewDir
+	// by walking outward from the chunk containing pos only through chunk faces connected by non-opaque blocks
+	void findVisibleChunks(const Point3f& pos, const Vector3f& viewDir, int32_t radius, std::vector<ChunkCoord>& visible);
+
 	void update(timediff dt);
 
+	// number of update() calls so far (on a client, counted from the server's tick when the first entity snapshot arrived)
+	uint64_t tick() const { return tick_; }
+	void setTick(uint64_t tick) { tick_ = tick; }
+
+	// make entity updates reproducible (see EntityManager::setDeterministic())
+	// the caller must also update with the same dt every tick, as GameLoop does
+	void setDeterministic(bool deterministic) { entityManager.setDeterministic(deterministic); }
+
+	// hash of the entity state and the blocks of every loaded chunk, for comparing two simulations of one world
+	// particles are cosmetic and not included
+	uint64_t checksum();
+
 	BlockTypeId addBlockType(const BlockType &bt);
 	const BlockType *getBlockType(BlockTypeId id) const;
 
 	// TODO: make this private again
 	Chunk *getChunk(const ChunkCoord& cc);
 
+	// the chunk at cc if it is loaded, without generating it if not (nullptr)
+	Chunk *loadedChunk(const ChunkCoord& cc) const;
+
+	// free a chunk; it is generated again the next time it is used, or left absent if chunks are not generated
+	// (for clients, which get chunks they need again from the server)
+	void unloadChunk(const ChunkCoord& cc);
+
+	// whether getChunk() generates terrain for chunks that are not loaded (the default)
+	// a client of a server turns this off: its chunks only come from the server, and until one has been received
+	// (or after it has been unloaded), getChunk() returns a shared empty chunk that putBlock() leaves alone
+	void setGenerateChunks(bool generate);
+
 	void calcChunkCoords(const BlockCoord& wbc, ChunkCoord& cc, Chunk::BlockCoord& cbc) const;
 	BlockCoord calcBlockCoords(const ChunkCoord& cc) const;
 
+	// print chunk allocator statistics to the console
+	void dumpChunkPoolStats() const;
+
 	EntityManager entityManager;
 
+	// no capacity until setCapacity() is called, so worlds that do not show effects pay nothing for them
+	ParticleSystem particles;
+
+	// not updated by update(); the owner runs queued requests with its own time budget
+	Pathfinder pathfinder;
+
 	std::function<void(const BlockCoord&)> blockUpdate;
 	std::function<void(const ChunkCoord&)> chunkUpdate;
 
 protected:
 
+	// sweepAABB() along one axis: how far the box from mn to mx can move by up to d before touching a block
+	float sweepAxis(const float mn[3], const float mx[3], int axis, float d, BlockCoord& hitBlock, bool& hit);
+
 	Chunk **chunks_;
 
+	// journal seq() of each chunk as of its last unload, so a reloaded chunk's seq() keeps increasing and
+	// consumers that remember the old value see it as changed
+	std::vector<uint64_t> unloadedSeqs_;
+
+	bool generateChunks_; // see setGenerateChunks()
+	Chunk *absentChunk_; // stands in for chunks that are not loaded when they are not generated
+
 	int32_t sizeX_, sizeY_, sizeZ_; // size of the world in blocks
 
 	int32_t chunkSizeX_, chunkSizeY_, chunkSizeZ_;
 
+	SlabPool chunkPool_; // Chunk objects
+	SlabPool chunkDataPool_; // block storage for each chunk
+
 	int32_t chunksX_, chunksY_, chunksZ_; // size of the world in chunks
+	int32_t chunksShiftX_, chunksShiftXY_; // log2 of chunksX_ and of chunksX_ * chunksY_
 	int32_t chunkShiftX_, chunkShiftY_, chunkShiftZ_;
 	int32_t blockMaskX_, blockMaskY_, blockMaskZ_;
 
 	float gravity_;
 
+	uint64_t tick_;
+
 	BlockTypeId numBlockTypes_;
 	std::vector<BlockType> blockTypes_;
 
+	// index into chunks_ of the chunk at wcc
+	size_t chunkIndex(const ChunkCoord& wcc) const
+	{
+		return static_cast<size_t>((wcc.z << chunksShiftXY_) | (wcc.y << chunksShiftX_) | wcc.x);
+	}
+
 	Chunk *newChunk(int32_t chunkX, int32_t chunkY, int32_t chunkZ);
+
+	// the chunk at wcc, allocated without generating it if it is not loaded, to be deserialized into
+	Chunk *receiveChunk(const ChunkCoord& wcc);
+	void deleteChunk(Chunk *chunk);
+
+	enum class ChunkUpdateType {
+		Full = 0, // zlib-compressed Chunk::serialize()
+		Delta = 1, // list of (block index, new block type)
+		Unload = 2, // the receiver no longer gets updates of the chunk and may drop it
+	};
 };
 
 } // namespace narf